@@ -1,12 +1,18 @@
 #include "sicc.h"
 
+#include <assert.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 
 #define REG(n) get_reg(n, ins->size)
 #define ARG_REG(n) get_arg_reg(n, ins->size)
 #define REG_ORIG(n) get_reg(n, ins->orig_size)
+// Flags and loaded chars and shorts are widened to at least 32 bits, which
+// clears the rest of the register, so that they read the same at any size.
+#define WIDE_REG(n) get_reg(n, ins->size < 4 ? 4 : ins->size)
+#define LOAD_OP (ins->size < 4 ? "movsx" : "mov")
 
 #define POINTER_SIZE 8
 #define AX 7
@@ -25,11 +31,39 @@ static const char *arg_regs_32[] = {"edi", "esi", "edx", "ecx", "r8d", "r9d"};
 static const char *arg_regs_16[] = {"di", "si", "dx", "cx", "r8w", "r9w"};
 static const char *arg_regs_8[] = {"dil", "sil", "dl", "cl", "r8b", "r9b"};
 
+static THREAD_LOCAL out_t *out;
+static THREAD_LOCAL int gstr_base; // const_str index of the first global string
+
+// Writes one line of assembly. Only the conversions the code generator uses
+// are understood: %s, %d and %+d.
 static void emit(const char *fmt, ...) {
   va_list ap;
   va_start(ap, fmt);
-  vfprintf(stdout, fmt, ap);
-  fprintf(stdout, "\n");
+  const char *p = fmt;
+  for (;;) {
+    const char *q = p;
+    while (*q && *q != '%')
+      q++;
+    out_putn(out, (char *)p, q - p);
+    if (!*q)
+      break;
+    q++;
+    if (*q == 's') {
+      out_puts(out, va_arg(ap, char *));
+    } else if (*q == 'd') {
+      out_int(out, va_arg(ap, int));
+    } else if (*q == '+' && q[1] == 'd') {
+      int n = va_arg(ap, int);
+      if (n >= 0)
+        out_putc(out, '+');
+      out_int(out, n);
+      q++;
+    } else {
+      error("Unknown format in emit: %s", fmt);
+    }
+    p = q + 1;
+  }
+  out_putc(out, '\n');
   va_end(ap);
   return;
 }
@@ -74,25 +108,44 @@ static const char *get_arg_reg(int n, int size) {
   return NULL;
 }
 
-static void init_global_var(ir_t *ir, node_t *init) {
+// A scalar initializer takes the size of the object it initializes, so that
+// the members after it land at their offsets.
+static void init_scalar(int val, int size) {
+  if (size == 1)
+    emit("  .byte %d", val);
+  else if (size == 2)
+    emit("  .short %d", val);
+  else if (size == 8)
+    emit("  .quad %d", val);
+  else
+    emit("  .long %d", val);
+}
+
+static void init_global_var(ir_t *ir, node_t *init, type_t *ty) {
   if (init->ty == ND_NUM) {
-    emit("  .long %d", init->num);
+    init_scalar(init->num, ty->size);
     return;
   }
   if (init->ty == ND_CHARACTER) {
-    emit("  .byte %d", *(init->str));
+    init_scalar(*(init->str), ty->size);
     return;
   }
   if (init->ty == ND_STRING) {
     vec_push(ir->const_str, init->str);
     int i = vec_len(ir->const_str) - 1;
-    emit("  .quad .LC%d", i);
+    emit("  .quad .LC%d", i - gstr_base);
     return;
   }
   if (init->ty == ND_INITIALIZER) {
-    int len = vec_len(init->initializer);
-    for (int i = 0; i < len; i++) {
-      init_global_var(ir, vec_get(init->initializer, i));
+    for (int i = 0; i < init->nlist; i++) {
+      if (ty->ty != TY_STRUCT) {
+        init_global_var(ir, child(init, i), ty->ptr);
+        continue;
+      }
+      init_global_var(ir, child(init, i), vec_get(ty->member->data->items, i));
+      int pad = padding_after(ty, i);
+      if (pad > 0)
+        emit("  .zero %d", pad);
     }
     return;
   }
@@ -105,7 +158,7 @@ static void init_global_var(ir_t *ir, node_t *init) {
     if (!gvar->is_null) {
       error("Cannot initialize global var with %s", init->str);
     }
-    init_global_var(ir, gvar->init);
+    init_global_var(ir, gvar->init, gvar->type);
     return;
   }
   
@@ -113,8 +166,288 @@ static void init_global_var(ir_t *ir, node_t *init) {
   return;
 }
 
-void gen_asm(ir_t *ir) {
-  int len = vec_len(ir->code);
+// Mach-O takes alignments as powers of two.
+static int log2_of(int align) {
+  int n = 0;
+  while ((1 << n) < align)
+    n++;
+  return n;
+}
+
+// Blocks and string literals of a function are named after it and numbered
+// from zero. Its assembly then does not depend on the functions before it,
+// and the codegen cache can reuse it as is.
+static THREAD_LOCAL char *func_name = "";
+static THREAD_LOCAL func_t *cur_func;
+static THREAD_LOCAL vec_t *func_strs; // const_str indexes used by the function
+
+static int local_str(int i) {
+  for (int j = 0; j < vec_len(func_strs); j++) {
+    if ((intptr_t)vec_get(func_strs, j) == i)
+      return j;
+  }
+  vec_push(func_strs, (void *)(intptr_t)i);
+  return vec_len(func_strs) - 1;
+}
+
+// Saves or restores rbx and r12 to r15, as far as the function writes them.
+static void save_regs(bool restore) {
+  for (int r = 2; r < cur_func->nregs && r < 7; r++) {
+    int offset = -cur_func->save_offset + 8 * (r - 2);
+    if (restore)
+      emit("  mov %s, qword ptr [rbp%+d]", regs[r], offset);
+    else
+      emit("  mov qword ptr [rbp%+d], %s", offset, regs[r]);
+  }
+}
+
+static void gen_ins(ir_t *ir, ins_t *ins) {
+  int lhs = ins->lhs;
+  int rhs = ins->rhs;
+
+  switch (ins->op) {
+  case IR_MOV_IMM:
+    emit("  mov %s, %d", REG(lhs), rhs);
+    break;
+  case IR_MOV_RETVAL:
+    emit("  mov %s, rax", regs[lhs]);
+    break;
+  case IR_STORE_ARG:
+    if (lhs < 6)
+      emit("  mov %s, %s", ARG_REG(lhs), REG(rhs));
+    else
+      emit("  push %s", regs[rhs]);
+    break;
+  case IR_LOAD_ARG:
+    if (rhs < 6)
+      emit("  mov %s [rbp%+d], %s", ptr_size(ins), -lhs, ARG_REG(rhs));
+    break;
+  case IR_MOV_ARG:
+    assert(0 <= rhs && rhs < 6);
+    emit("  mov %s, %s", REG(lhs), ARG_REG(rhs));
+    break;
+  case IR_ADD:
+    emit("  add %s, %s", REG(lhs), REG(rhs));
+    break;
+  case IR_SUB:
+    emit("  sub %s, %s", REG(lhs), REG(rhs));
+    break;
+  case IR_MUL:
+    emit("  push rdx");
+    emit("  mov rax, %s", regs[lhs]);
+    emit("  mul %s", regs[rhs]);
+    emit("  add rax, rdx");
+    emit("  mov %s, %s", REG(lhs), REG(AX));
+    emit("  pop rdx");
+    break;
+  case IR_DIV:
+    emit("  push rdx");
+    emit("  mov rax, %s", regs[lhs]);
+    emit("  cqo");
+    emit("  div %s", regs[rhs]);
+    emit("  mov %s, %s", REG(lhs), REG(AX));
+    emit("  pop rdx");
+    break;
+  case IR_GREAT:
+    emit("  cmp %s, %s", REG(lhs), REG(rhs));
+    emit("  setg al");
+    emit("  movzx %s, al", WIDE_REG(lhs));
+    emit("  mov al, 0");
+    break;
+  case IR_LESS:
+    emit("  cmp %s, %s", REG(lhs), REG(rhs));
+    emit("  setl al");
+    emit("  movzx %s, al", WIDE_REG(lhs));
+    emit("  mov al, 0");
+    break;
+  case IR_NOT:
+    emit("  cmp %s, 0", regs[lhs]);
+    emit("  sete al");
+    emit("  movzx %s, al", regs[lhs]);
+    emit("  mov al, 0");
+    break;
+  case IR_STORE:
+    emit("  mov %s [%s], %s", ptr_size(ins), regs[lhs], REG(rhs));
+    break;
+  case IR_LOAD:
+    emit("  %s %s, %s [%s]", LOAD_OP, WIDE_REG(lhs), ptr_size(ins), regs[rhs]);
+    break;
+  case IR_CALL:
+    emit("  call _%s", ins->name);
+    break;
+  case IR_FREE:
+    emit("  add rsp, %d", lhs);
+    break;
+  case IR_RET:
+    emit("  mov rax, %s", regs[lhs]);
+    // emit("  leave");
+    // emit("  ret");
+    break;
+  case IR_JTRUE:
+    emit("  test %s, %s", regs[lhs], regs[lhs]);
+    emit("  jnz .L%s.%d", func_name, rhs);
+    break;
+  case IR_JZERO:
+    emit("  test %s, %s", regs[lhs], regs[lhs]);
+    emit("  jz .L%s.%d", func_name, rhs);
+    break;
+  case IR_JMP:
+    emit("  jmp .L%s.%d", func_name, lhs);
+    break;
+  case IR_STORE_VAR:
+    emit("  mov %s [rbp%+d], %s", ptr_size(ins), -lhs, REG(rhs));
+    break;
+  case IR_LOAD_VAR:
+    emit("  %s %s, %s [rbp%+d]", LOAD_OP, WIDE_REG(lhs), ptr_size(ins), -rhs);
+    break;
+  case IR_LEAVE:
+    save_regs(true);
+    emit("  leave");
+    emit("  ret");
+    break;
+  case IR_LOAD_CONST:
+    emit("  lea %s, [rip+.LC%s.%d]", REG(lhs), func_name, local_str(rhs));
+    break;
+  case IR_PTR_CAST:
+    emit("  mov %s, %s", regs[AX], regs[lhs]);
+    // emit("  cdqe");
+    emit("  lea %s, [0+rax*%d]", regs[lhs], ins->size);
+    break;
+  case IR_EQ:
+    emit("  cmp %s, %s", REG(lhs), REG(rhs));
+    emit("  sete al");
+    emit("  movzx %s, al", WIDE_REG(lhs));
+    emit("  mov al, 0");
+    break;
+  case IR_NEQ:
+    emit("  cmp %s, %s", REG(lhs), REG(rhs));
+    emit("  setne al");
+    emit("  movzx %s, al", WIDE_REG(lhs));
+    emit("  mov al, 0");
+    break;
+  case IR_LOAD_ADDR_VAR:
+    emit("  lea %s, [rbp%+d]", regs[lhs], -rhs);
+    break;
+  case IR_PUSH:
+    emit("  push %s", regs[lhs]);
+    break;
+  case IR_POP:
+    emit("  pop %s", regs[lhs]);
+    break;
+  case IR_LOAD_GVAR:
+    emit("  %s %s, %s [rip+_%s]", LOAD_OP, WIDE_REG(lhs), ptr_size(ins),
+         ins->name);
+    break;
+  case IR_LOAD_ADDR_GVAR:
+    emit("  lea %s, [rip+_%s]", regs[lhs], ins->name);
+    break;
+  case IR_ADD_IMM:
+    emit("  add %s, %d", REG(lhs), rhs);
+    break;
+  case IR_SUB_IMM:
+    emit("  sub %s, %d", REG(lhs), rhs);
+    break;
+  case IR_MOV:
+    emit("  mov %s, %s", REG(lhs), REG(rhs));
+    break;
+  case IR_LOGAND:
+    emit("  and %s, %s", REG(lhs), REG(rhs));
+    emit("  setnz al");
+    emit("  movzx %s, al", WIDE_REG(lhs));
+    emit("  mov al, 0");
+    break;
+  case IR_LOGOR:
+    emit("  or %s, %s", REG(lhs), REG(rhs));
+    emit("  setnz al");
+    emit("  movzx %s, al", WIDE_REG(lhs));
+    emit("  mov al, 0");
+    break;
+  case IR_CAST:
+    if (ins->size < rhs) {
+      emit("  movzx %s, %s", regs[lhs], REG(lhs));
+    }
+    break;
+  case IR_NEG:
+    emit("  neg %s", regs[lhs]);
+    break;
+  case IR_GREAT_EQ:
+    emit("  cmp %s, %s", REG(lhs), REG(rhs));
+    emit("  setge al");
+    emit("  movzx %s, al", WIDE_REG(lhs));
+    emit("  mov al, 0");
+    break;
+  case IR_LESS_EQ:
+    emit("  cmp %s, %s", REG(lhs), REG(rhs));
+    emit("  setle al");
+    emit("  movzx %s, al", WIDE_REG(lhs));
+    emit("  mov al, 0");
+    break;
+  default:
+    error("Unknown IR type: %d", ins->op);
+  }
+}
+
+// Generates a function. If it has a cache key, its assembly is also stored
+// in the codegen cache.
+static void gen_func(ir_t *ir, func_t *func) {
+  func_name = func->name;
+  cur_func = func;
+  func_begin(func_name);
+  func_strs = new_vec();
+  // Only blocks that are jumped to need a label.
+  int nbbs = vec_len(func->bbs);
+  bool *jumped = calloc(nbbs, sizeof(bool));
+  for (int i = 0; i < nbbs; i++) {
+    bb_t *bb = vec_get(func->bbs, i);
+    for (int j = 0; j < bb->nins; j++) {
+      ins_t *ins = &bb->ins[j];
+      if (ins->op == IR_LOAD_CONST)
+        local_str(ins->rhs);
+      if (ins->op == IR_JMP)
+        jumped[ins->lhs] = true;
+      if (ins->op == IR_JTRUE || ins->op == IR_JZERO)
+        jumped[ins->rhs] = true;
+    }
+  }
+
+  char *key = map_get(ir->func_keys, func_name);
+  out_t *dst = out;
+  if (key)
+    out = out_mem();
+  if (vec_len(func_strs)) {
+    emit(".section __TEXT,__cstring");
+    for (int i = 0; i < vec_len(func_strs); i++) {
+      char *s = vec_get(ir->const_str, (intptr_t)vec_get(func_strs, i));
+      emit(".LC%s.%d:\n  .asciz \"%s\"", func_name, i, s);
+    }
+    emit(".section __TEXT,__text");
+  }
+  emit("_%s:", func_name);
+  emit("  push rbp");
+  emit("  mov rbp, rsp");
+  emit("  sub rsp, %d", func->stack_size);
+  save_regs(false);
+  for (int i = 0; i < nbbs; i++) {
+    bb_t *bb = vec_get(func->bbs, i);
+    if (jumped[i])
+      emit(".L%s.%d:", func_name, i);
+    for (int j = 0; j < bb->nins; j++)
+      gen_ins(ir, &bb->ins[j]);
+  }
+  free(jumped);
+  if (key) {
+    out_flush(out);
+    buf_t *text = out->mem;
+    out_close(out);
+    out = dst;
+    cache_store(key, text->data, text->len);
+    out_putn(out, text->data, text->len);
+  }
+  func_end();
+}
+
+void gen_asm(ir_t *ir, out_t *o) {
+  out = o;
   // Number of global functions
   int ngfuncs = vec_len(ir->gfuncs);
   emit(".intel_syntax noprefix");
@@ -123,6 +456,10 @@ void gen_asm(ir_t *ir) {
     emit(".global _%s", vec_get(ir->gfuncs, i));
   }
 
+  // The strings so far are those of functions, which are emitted with them.
+  // Strings of global initializers are added after them.
+  gstr_base = vec_len(ir->const_str);
+
   // Number of global variables
   int ngvars = map_len(ir->gvars);
   emit(".section __DATA,_data");
@@ -133,251 +470,30 @@ void gen_asm(ir_t *ir) {
     // Definition of uninitialized global variable
     if (gvar->is_null) {
       // http://web.mit.edu/gnu/doc/html/as_7.html#SEC74
-      emit("  .comm _%s, %d", gvar->name, gvar->size);
+      emit("  .comm _%s, %d, %d", gvar->name, gvar->size,
+           log2_of(gvar->align));
     } else {
+      emit(".p2align %d", log2_of(gvar->align));
       emit("_%s: ", gvar->name);
-      init_global_var(ir, gvar->init);
+      init_global_var(ir, gvar->init, gvar->type);
     }
   }
 
   // Number of constant strings
   int nconsts = vec_len(ir->const_str);
   emit(".section __TEXT,__cstring");
-  for (int i = 0; i < nconsts; i++) {
+  for (int i = gstr_base; i < nconsts; i++) {
     char *s = vec_get(ir->const_str, i);
-    emit(".LC%d:\n  .asciz \"%s\"", i, s);
+    emit(".LC%d:\n  .asciz \"%s\"", i - gstr_base, s);
   }
 
   emit("\n.section __TEXT,__text");
-  for (int pc = 0; pc < len; pc++) {
-    ins_t *ins = vec_get(ir->code, pc);
-    int lhs = ins->lhs;
-    int rhs = ins->rhs;
-
-    switch (ins->op) {
-    case IR_MOV_IMM:
-      emit("  mov %s, %d", REG(lhs), rhs);
-      break;
-    case IR_MOV_RETVAL:
-      emit("  mov %s, rax", regs[lhs]);
-      break;
-    case IR_STORE_ARG:
-      if (lhs < 6)
-        emit("  mov %s, %s", ARG_REG(lhs), REG(rhs));
-      else
-        emit("  push %s", regs[rhs]);
-      break;
-    case IR_LOAD_ARG:
-      if (rhs < 6)
-        emit("  mov %s [rbp%+d], %s", ptr_size(ins), -lhs, ARG_REG(rhs));
-      break;
-    case IR_MOV_ARG:
-      if (rhs < 0)
-        emit("  mov %s, %s [rbp-%+d]", REG(lhs), ptr_size(ins), -rhs);
-      else if (rhs < 6)
-        emit("  mov %s, %s", REG(lhs), ARG_REG(rhs));
-    case IR_ADD:
-      emit("  add %s, %s", REG(lhs), REG(rhs));
-      break;
-    case IR_SUB:
-      emit("  sub %s, %s", REG(lhs), REG(rhs));
-      break;
-    case IR_MUL:
-      emit("  push rdx");
-      emit("  mov rax, %s", regs[lhs]);
-      emit("  mul %s", regs[rhs]);
-      emit("  add rax, rdx");
-      emit("  mov %s, %s", REG(lhs), REG(AX));
-      emit("  pop rdx");
-      break;
-    case IR_DIV:
-      emit("  push rdx");
-      emit("  mov rax, %s", regs[lhs]);
-      emit("  cqo");
-      emit("  div %s", regs[rhs]);
-      emit("  mov %s, %s", REG(lhs), REG(AX));
-      emit("  pop rdx");
-      break;
-    case IR_GREAT:
-      emit("  cmp %s, %s", REG(lhs), REG(rhs));
-      emit("  setg al");
-      emit("  movzx %s, al", REG(lhs));
-      emit("  mov al, 0");
-      break;
-    case IR_LESS:
-      emit("  cmp %s, %s", REG(lhs), REG(rhs));
-      emit("  setl al");
-      emit("  movzx %s, al", REG(lhs));
-      emit("  mov al, 0");
-      break;
-    case IR_NOT:
-      emit("  cmp %s, 0", regs[lhs]);
-      emit("  sete al");
-      emit("  movzx %s, al", regs[lhs]);
-      emit("  mov al, 0");
-      break;
-    case IR_STORE:
-      emit("  mov %s [%s], %s", ptr_size(ins), regs[lhs], REG(rhs));
-      break;
-    case IR_LOAD:
-      emit("  mov %s, %s [%s]", REG(lhs), ptr_size(ins), regs[rhs]);
-      break;
-    case IR_CALL:
-      emit("  call _%s", ins->name);
-      break;
-    case IR_FUNC:
-      emit("_%s:", ins->name);
-      emit("  push rbp");
-      emit("  mov rbp, rsp");
-      break;
-    case IR_LABEL:
-      emit(".L%d:", lhs);
-      break;
-    case IR_LABEL_BB:
-      emit(".LBB%d: ", lhs);
-      break;
-    case IR_LABEL_BBEND:
-      emit(".LBB_END%d: ", lhs);
-      break;
-    case IR_LABEL_BBSTART:
-      emit(".LBB_START%d: ", lhs);
-      break;
-    case IR_ALLOC:
-      emit("  sub rsp, %d", lhs);
-      break;
-    case IR_FREE:
-      emit("  add rsp, %d", lhs);
-      break;
-    case IR_RET:
-      emit("  mov rax, %s", regs[lhs]);
-      // emit("  leave");
-      // emit("  ret");
-      break;
-    case IR_JTRUE:
-      emit("  test %s, %s", regs[lhs], regs[lhs]);
-      emit("  jnz .L%d", rhs);
-      break;
-    case IR_JTRUE_BB:
-      emit("  test %s, %s", regs[lhs], regs[lhs]);
-      emit("  jnz .LBB%d", rhs);
-      break;
-    case IR_JTRUE_BBEND:
-      emit("  test %s, %s", regs[lhs], regs[lhs]);
-      emit("  jnz .LBB_END%d", rhs);
-      break;
-    case IR_JZERO:
-      emit("  test %s, %s", regs[lhs], regs[lhs]);
-      emit("  jz .L%d", rhs);
-      break;
-    case IR_JZERO_BB:
-      emit("  test %s, %s", regs[lhs], regs[lhs]);
-      emit("  jz .LBB%d", rhs);
-      break;
-    case IR_JZERO_BBEND:
-      emit("  test %s, %s", regs[lhs], regs[lhs]);
-      emit("  jz .LBB_END%d", rhs);
-      break;
-    case IR_JMP:
-      emit("  jmp .L%d", lhs);
-      break;
-    case IR_JMP_BB:
-      emit("  jmp .LBB%d", lhs);
-      break;
-    case IR_JMP_BBEND:
-      emit("  jmp .LBB_END%d", lhs);
-      break;
-    case IR_JMP_BBSTART:
-      emit("  jmp .LBB_START%d", lhs);
-      break;
-    case IR_STORE_VAR:
-      emit("  mov %s [rbp%+d], %s", ptr_size(ins), -lhs, REG(rhs));
-      break;
-    case IR_LOAD_VAR:
-      emit("  mov %s, %s [rbp%+d]", REG(lhs), ptr_size(ins), -rhs);
-      break;
-    case IR_LEAVE:
-      emit("  leave");
-      emit("  ret");
-      break;
-    case IR_LOAD_CONST:
-      emit("  lea %s, [rip+.LC%d]", REG(lhs), rhs);
-      break;
-    case IR_PTR_CAST:
-      emit("  mov %s, %s", regs[AX], regs[lhs]);
-      // emit("  cdqe");
-      emit("  lea %s, [0+rax*%d]", regs[lhs], ins->size);
-      break;
-    case IR_EQ:
-      emit("  cmp %s, %s", REG(lhs), REG(rhs));
-      emit("  sete al");
-      emit("  movzx %s, al", REG(lhs));
-      emit("  mov al, 0");
-      break;
-    case IR_NEQ:
-      emit("  cmp %s, %s", REG(lhs), REG(rhs));
-      emit("  setne al");
-      emit("  movzx %s, al", REG(lhs));
-      emit("  mov al, 0");
-      break;
-    case IR_LOAD_ADDR_VAR:
-      emit("  lea %s, [rbp%+d]", regs[lhs], -rhs);
-      break;
-    case IR_PUSH:
-      emit("  push %s", regs[lhs]);
-      break;
-    case IR_POP:
-      emit("  pop %s", regs[lhs]);
-      break;
-    case IR_LOAD_GVAR:
-      emit("  mov %s, %s [rip+_%s]", REG(lhs), ptr_size(ins), ins->name);
-      break;
-    case IR_LOAD_ADDR_GVAR:
-      emit("  lea %s, [rip+_%s]", regs[lhs], ins->name);
-      break;
-    case IR_ADD_IMM:
-      emit("  add %s, %d", REG(lhs), rhs);
-      break;
-    case IR_SUB_IMM:
-      emit("  sub %s, %d", REG(lhs), rhs);
-      break;
-    case IR_MOV:
-      emit("  mov %s, %s", REG(lhs), REG(rhs));
-      break;
-    case IR_LOGAND:
-      emit("  and %s, %s", REG(lhs), REG(rhs));
-      emit("  setnz al");
-      emit("  movzx %s, al", REG(lhs));
-      emit("  mov al, 0");
-      break;
-    case IR_LOGOR:
-      emit("  or %s, %s", REG(lhs), REG(rhs));
-      emit("  setnz al");
-      emit("  movzx %s, al", REG(lhs));
-      emit("  mov al, 0");
-      break;
-    case IR_CAST:
-      if (ins->size < rhs) {
-        emit("  movzx %s, %s", regs[lhs], REG(lhs));
-      }
-      break;
-    case IR_NEG:
-      emit("  neg %s", regs[lhs]);
-      break;
-    case IR_GREAT_EQ:
-      emit("  cmp %s, %s", REG(lhs), REG(rhs));
-      emit("  setge al");
-      emit("  movzx %s, al", REG(lhs));
-      emit("  mov al, 0");
-      break;
-    case IR_LESS_EQ:
-      emit("  cmp %s, %s", REG(lhs), REG(rhs));
-      emit("  setle al");
-      emit("  movzx %s, al", REG(lhs));
-      emit("  mov al, 0");
-      break;
-    default:
-      error("Unknown IR type: %d", ins->op);
-    }
+  for (int i = 0; i < vec_len(ir->funcs); i++) {
+    func_t *func = vec_get(ir->funcs, i);
+    if (func->cached)
+      out_puts(out, func->cached);
+    else
+      gen_func(ir, func);
   }
   return;
 }
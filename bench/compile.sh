@@ -0,0 +1,142 @@
+#!/bin/bash
+# Measures how sicc's compile time and memory scale with the size of its
+# input. Generates a synthetic corpus at several sizes into bench/corpus,
+# compiles each file a few times and writes the best run of each as JSON.
+#
+#   bench/compile.sh [output.json]
+
+sicc=./sicc
+corpus=bench/corpus
+out="${1:-bench-compile.json}"
+runs="${BENCH_RUNS:-3}"
+
+mkdir -p "$corpus"
+
+# N lines of small functions.
+gen_lines () {
+  awk -v n="$1" 'BEGIN {
+    for (i = 0; i * 10 < n; i++) {
+      printf "int f%d(int a, int b) {\n", i
+      printf "  int x = a * %d + b;\n", i
+      printf "  int y = x - (a + %d) * 3;\n", i % 97
+      printf "  while (y > 100)\n"
+      printf "    y = y / 2;\n"
+      printf "  if (x > y)\n"
+      printf "    return x - y;\n"
+      printf "  return y + %d;\n", i
+      printf "}\n\n"
+    }
+    printf "int main() {\n  return f0(1, 2);\n}\n"
+  }'
+}
+
+# A switch with N cases.
+gen_switch () {
+  awk -v n="$1" 'BEGIN {
+    printf "int f(int a) {\n  int r = 0;\n  switch (a) {\n"
+    for (i = 0; i < n; i++)
+      printf "  case %d:\n    r = %d;\n    break;\n", i, (i * 7) % 1000
+    printf "  default:\n    r = -1;\n  }\n  return r;\n}\n\n"
+    printf "int main() {\n  return f(%d);\n}\n", n / 2
+  }'
+}
+
+# N globals and N enum constants, all used from one function.
+gen_globals () {
+  awk -v n="$1" 'BEGIN {
+    printf "enum {\n"
+    for (i = 0; i < n; i++)
+      printf "  E%d,\n", i
+    printf "};\n\n"
+    for (i = 0; i < n; i++)
+      printf "int g%d = %d;\n", i, i
+    printf "\nint main() {\n  int s = 0;\n"
+    for (i = 0; i < n; i++)
+      printf "  s = s + g%d - E%d;\n", i, i
+    printf "  return s;\n}\n"
+  }'
+}
+
+# An expression nested N parentheses deep, like test/test.c. It nests to the
+# left: nesting to the right needs a register per level, and sicc has no
+# register allocator to spill them.
+gen_nested () {
+  awk -v n="$1" 'BEGIN {
+    printf "int main() {\n  int a = "
+    for (i = 0; i < n; i++)
+      printf "("
+    printf "1"
+    for (i = 0; i < n; i++)
+      printf " + %d)", i % 10
+    printf ";\n  return a;\n}\n"
+  }'
+}
+
+# Prints "wall_ms cpu_ms bytes peak_rss_kb tokens nodes ins lex_mb_s" for the
+# best of $runs compiles of $1.
+measure () {
+  best=""
+  for ((r = 0; r < runs; r++)); do
+    stats="$("$sicc" --stats "$1" -o /dev/null 2>&1 >/dev/null)" || return 1
+    line="$(echo "$stats" | awk '
+      $1 == "total" { wall = $2; cpu = $3; bytes = $4; rss = $5 }
+      $1 == "tokens:" { gsub(",", ""); tokens = $2; nodes = $5; ins = $8 }
+      $1 == "tokenize:" { lex = $4 }
+      END { print wall, cpu, bytes, rss, tokens, nodes, ins, lex }')"
+    if [ -z "$best" ] ||
+       awk -v a="${line%% *}" -v b="${best%% *}" 'BEGIN { exit !(a < b) }'; then
+      best="$line"
+    fi
+  done
+  echo "$best"
+}
+
+if [ ! -x "$sicc" ]; then
+  echo "$sicc not found; run make first" >&2
+  exit 1
+fi
+
+commit="$(git rev-parse --short HEAD 2>/dev/null || echo unknown)"
+{
+  echo "{"
+  echo "  \"commit\": \"$commit\","
+  echo "  \"date\": \"$(date -u +%Y-%m-%dT%H:%M:%SZ)\","
+  echo "  \"runs\": $runs,"
+  echo "  \"results\": ["
+} > "$out"
+
+first=1
+for bench in "lines 1000 10000 100000" "switch 100 1000 10000" \
+             "globals 100 1000 5000" "nested 10 100 1000"; do
+  set -- $bench
+  kind="$1"
+  shift
+  for size in "$@"; do
+    file="$corpus/$kind-$size.c"
+    "gen_$kind" "$size" > "$file"
+    if ! result="$(measure "$file")"; then
+      echo "$file: compile failed" >&2
+      exit 1
+    fi
+    set -- $result
+    printf "%-8s %7d %10.3f ms %10.3f ms cpu %8d KiB %8.1f MB/s lexed\n" \
+      "$kind" "$size" "$1" "$2" "$4" "$8"
+    [ "$first" == 1 ] || echo "," >> "$out"
+    first=0
+    printf '    {"corpus": "%s", "size": %d, "lines": %d, "bytes": %d,\n' \
+      "$kind" "$size" "$(wc -l < "$file")" "$(wc -c < "$file")" >> "$out"
+    printf '     "wall_ms": %s, "cpu_ms": %s, "alloc_bytes": %s,\n' \
+      "$1" "$2" "$3" >> "$out"
+    printf '     "peak_rss_kb": %s, "tokens": %s, "ast_nodes": %s,\n' \
+      "$4" "$5" "$6" >> "$out"
+    printf '     "ir_instructions": %s, "tokenize_mb_s": %s}' "$7" "$8" \
+      >> "$out"
+  done
+done
+
+{
+  echo
+  echo "  ]"
+  echo "}"
+} >> "$out"
+echo "results written to $out"
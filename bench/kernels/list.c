@@ -0,0 +1,30 @@
+// Linked lists of structs: pointer chasing and member access.
+#include <stdlib.h>
+
+struct node {
+  int value;
+  int weight;
+  struct node *next;
+};
+
+int main() {
+  int n = 100000;
+  int i = 0;
+  int sum = 0;
+  int round = 0;
+  struct node *head = 0;
+  struct node *p = 0;
+  for (i = 0; i < n; i++) {
+    p = malloc(sizeof(struct node));
+    p->value = i;
+    p->weight = i - i / 13 * 13;
+    p->next = head;
+    head = p;
+  }
+  for (round = 0; round < 100; round++) {
+    for (p = head; p; p = p->next)
+      sum = sum + p->value / 7 * p->weight;
+  }
+  printf("%d\n", sum);
+  return 0;
+}
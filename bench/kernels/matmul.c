@@ -0,0 +1,34 @@
+// Matrix multiply: nested loops over two-dimensional arrays.
+int a[200][200];
+int b[200][200];
+int c[200][200];
+
+int main() {
+  int n = 200;
+  int round = 0;
+  int i = 0;
+  int j = 0;
+  int k = 0;
+  int sum = 0;
+  for (i = 0; i < n; i++) {
+    for (j = 0; j < n; j++) {
+      a[i][j] = i + j;
+      b[i][j] = i - j;
+    }
+  }
+  for (round = 0; round < 5; round++) {
+    for (i = 0; i < n; i++) {
+      for (j = 0; j < n; j++) {
+        sum = 0;
+        for (k = 0; k < n; k++)
+          sum = sum + a[i][k] * b[k][j];
+        c[i][j] = sum;
+      }
+    }
+  }
+  sum = 0;
+  for (i = 0; i < n; i++)
+    sum = sum + c[i][i] - c[i][n - 1 - i];
+  printf("%d\n", sum);
+  return 0;
+}
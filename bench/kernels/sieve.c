@@ -0,0 +1,24 @@
+// Sieve of Eratosthenes: loops over an array.
+int sieve[2000000];
+
+int main() {
+  int n = 2000000;
+  int count = 0;
+  int round = 0;
+  int i = 0;
+  int j = 0;
+  for (round = 0; round < 10; round++) {
+    for (i = 0; i < n; i++)
+      sieve[i] = 1;
+    count = 0;
+    for (i = 2; i < n; i++) {
+      if (sieve[i] == 1) {
+        count++;
+        for (j = i + i; j < n; j = j + i)
+          sieve[j] = 0;
+      }
+    }
+  }
+  printf("%d\n", count);
+  return 0;
+}
@@ -0,0 +1,36 @@
+// String scanning: walks a string through a char pointer.
+char text[1000000];
+
+int count_words(char *p) {
+  int words = 0;
+  int in_word = 0;
+  for (; *p; p++) {
+    if (*p == ' ' || *p == '\n') {
+      in_word = 0;
+    } else if (in_word == 0) {
+      in_word = 1;
+      words++;
+    }
+  }
+  return words;
+}
+
+int main() {
+  char *words = "the quick brown fox jumps over the lazy dog\n";
+  int len = 44;
+  int limit = 999000;
+  int n = 0;
+  int i = 0;
+  int total = 0;
+  int round = 0;
+  while (n < limit) {
+    for (i = 0; i < len; i++)
+      text[n + i] = words[i];
+    n = n + len;
+  }
+  text[n] = 0;
+  for (round = 0; round < 50; round++)
+    total = total + count_words(text);
+  printf("%d\n", total);
+  return 0;
+}
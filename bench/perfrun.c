@@ -0,0 +1,155 @@
+// Runs a command several times and prints, as JSON, the median wall time
+// and hardware counters of the runs. Linux only.
+//
+//   perfrun RUNS COMMAND [ARGS...]
+//
+// The command's stdout is discarded. Counters the kernel does not let us
+// open (in a container, or with perf_event_paranoid set high) are null.
+
+#include <fcntl.h>
+#include <linux/perf_event.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+typedef struct {
+  char *name;
+  int type;
+  long config;
+} counter_t;
+
+static counter_t counters[] = {
+    {"cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+    {"instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+    {"branch_misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+    {"cache_misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+};
+
+#define NCOUNTERS (int)(sizeof(counters) / sizeof(counters[0]))
+
+// Counts the child from its exec on, user space only.
+static int open_counter(counter_t *c, pid_t pid) {
+  struct perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = c->type;
+  attr.config = c->config;
+  attr.disabled = 1;
+  attr.enable_on_exec = 1;
+  attr.inherit = 1;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  return syscall(SYS_perf_event_open, &attr, pid, -1, -1, 0);
+}
+
+static long now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+// Runs the command once. Counters that could not be opened are -1. Returns
+// the exit status, or -1 if the command did not exit normally.
+static int run(char **argv, long *wall, long *counts) {
+  int go[2];
+  if (pipe(go)) {
+    perror("pipe");
+    exit(1);
+  }
+  pid_t pid = fork();
+  if (pid < 0) {
+    perror("fork");
+    exit(1);
+  }
+  if (pid == 0) {
+    // Wait until the counters are attached, then exec.
+    char c;
+    close(go[1]);
+    if (read(go[0], &c, 1) != 1)
+      _exit(127);
+    int null = open("/dev/null", O_WRONLY);
+    dup2(null, 1);
+    execvp(argv[0], argv);
+    perror(argv[0]);
+    _exit(127);
+  }
+  close(go[0]);
+
+  int fds[NCOUNTERS];
+  for (int i = 0; i < NCOUNTERS; i++)
+    fds[i] = open_counter(&counters[i], pid);
+  long start = now_ns();
+  if (write(go[1], "g", 1) != 1) {
+    perror("write");
+    exit(1);
+  }
+  close(go[1]);
+  int status;
+  waitpid(pid, &status, 0);
+  *wall = now_ns() - start;
+
+  for (int i = 0; i < NCOUNTERS; i++) {
+    uint64_t n;
+    counts[i] = -1;
+    if (fds[i] >= 0 && read(fds[i], &n, sizeof(n)) == sizeof(n))
+      counts[i] = n;
+    if (fds[i] >= 0)
+      close(fds[i]);
+  }
+  return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+static int cmp_long(const void *a, const void *b) {
+  long x = *(long *)a;
+  long y = *(long *)b;
+  return x < y ? -1 : x > y;
+}
+
+static long median(long *v, int n) {
+  qsort(v, n, sizeof(long), cmp_long);
+  return v[n / 2];
+}
+
+int main(int argc, char **argv) {
+  if (argc < 3) {
+    fprintf(stderr, "usage: perfrun RUNS COMMAND [ARGS...]\n");
+    return 1;
+  }
+  int runs = atoi(argv[1]);
+  if (runs < 1)
+    runs = 1;
+
+  long *walls = calloc(runs, sizeof(long));
+  long *counts = calloc(runs * NCOUNTERS, sizeof(long));
+  int status = 0;
+  for (int r = 0; r < runs; r++) {
+    status = run(argv + 2, &walls[r], counts + r * NCOUNTERS);
+    if (status) {
+      runs = r + 1;
+      break;
+    }
+  }
+
+  printf("{\"status\": %d, \"runs\": %d, \"wall_ms\": %.3f", status, runs,
+         median(walls, runs) / 1e6);
+  for (int i = 0; i < NCOUNTERS; i++) {
+    long v[runs];
+    bool ok = true;
+    for (int r = 0; r < runs; r++) {
+      v[r] = counts[r * NCOUNTERS + i];
+      ok = ok && v[r] >= 0;
+    }
+    if (ok)
+      printf(", \"%s\": %ld", counters[i].name, median(v, runs));
+    else
+      printf(", \"%s\": null", counters[i].name);
+  }
+  printf("}\n");
+  return status != 0;
+}
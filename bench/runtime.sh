@@ -0,0 +1,131 @@
+#!/bin/bash
+# Compiles the kernels in bench/kernels with sicc, gcc -O0 and gcc -O2, runs
+# each a few times under bench/perfrun and writes the medians, with sicc's
+# ratios to gcc, as JSON. Linux only.
+#
+#   bench/runtime.sh [output.json]
+
+sicc=./sicc
+cc="${CC:-gcc}"
+build=bench/out
+out="${1:-bench-runtime.json}"
+runs="${BENCH_RUNS:-5}"
+kernels="fib sieve matmul strscan list"
+
+if [ "$(uname)" != 'Linux' ]; then
+  echo "bench/runtime.sh needs Linux; see compare.sh for macOS" >&2
+  exit 1
+fi
+if [ ! -x "$sicc" ]; then
+  echo "$sicc not found; run make first" >&2
+  exit 1
+fi
+
+mkdir -p "$build"
+"$cc" -O2 -o "$build/perfrun" bench/perfrun.c || exit 1
+
+# build_sicc KERNEL: sicc writes an ELF object, which gcc links.
+build_sicc () {
+  "$sicc" -c "bench/kernels/$1.c" -o "$build/$1-sicc.o" 2>"$build/$1-sicc.log" &&
+    "$cc" -no-pie -o "$build/$1-sicc" "$build/$1-sicc.o" \
+      2>>"$build/$1-sicc.log"
+}
+
+# build_gcc KERNEL LEVEL
+build_gcc () {
+  "$cc" -w "-$2" -o "$build/$1-gcc$2" "bench/kernels/$1.c" 2>"$build/$1-gcc$2.log"
+}
+
+# measure KERNEL COMPILER EXPECTED: prints the JSON of one kernel built by
+# one compiler. Anything that does not build, crashes or prints something
+# other than EXPECTED gets a status instead of numbers.
+measure () {
+  exe="$build/$1-$2"
+  if [ ! -x "$exe" ]; then
+    echo '{"status": "compile error"}'
+  elif ! output="$("$exe" 2>/dev/null)"; then
+    echo '{"status": "crash"}'
+  elif [ "$output" != "$3" ]; then
+    echo '{"status": "wrong output"}'
+  else
+    "$build/perfrun" "$runs" "$exe" | sed 's/"status": 0/"status": "ok"/'
+  fi
+}
+
+# field JSON NAME: the number NAME of a flat JSON object, or nothing.
+field () {
+  echo "$1" | sed -n "s/.*\"$2\": \([0-9.]*\).*/\1/p"
+}
+
+# cell JSON: wall_ms for the table, or why there is none.
+cell () {
+  wall="$(field "$1" wall_ms)"
+  [ -n "$wall" ] && echo "$wall" ||
+    echo "$1" | sed -n 's/.*"status": "\([^"]*\)".*/\1/p'
+}
+
+# ratio A B: A / B, or null if either is missing.
+ratio () {
+  if [ -z "$1" ] || [ -z "$2" ]; then
+    echo null
+  else
+    awk -v a="$1" -v b="$2" 'BEGIN { if (b > 0) printf "%.3f\n", a / b; else print "null" }'
+  fi
+}
+
+commit="$(git rev-parse --short HEAD 2>/dev/null || echo unknown)"
+{
+  echo "{"
+  echo "  \"commit\": \"$commit\","
+  echo "  \"date\": \"$(date -u +%Y-%m-%dT%H:%M:%SZ)\","
+  echo "  \"runs\": $runs,"
+  echo "  \"kernels\": ["
+} > "$out"
+
+printf "%-8s %14s %14s %14s %8s %8s\n" kernel "sicc ms" "gcc -O0 ms" \
+  "gcc -O2 ms" "vs -O0" "vs -O2"
+first=1
+for k in $kernels; do
+  rm -f "$build/$k-sicc" "$build/$k-gccO0" "$build/$k-gccO2"
+  build_sicc "$k"
+  build_gcc "$k" O0
+  build_gcc "$k" O2
+  # gcc -O0 is the reference for what the kernel prints.
+  expected="$("$build/$k-gccO0" 2>/dev/null)"
+
+  sicc_json="$(measure "$k" sicc "$expected")"
+  o0_json="$(measure "$k" gccO0 "$expected")"
+  o2_json="$(measure "$k" gccO2 "$expected")"
+
+  ratios=""
+  for base in O0 O2; do
+    [ "$base" == O0 ] && base_json="$o0_json" || base_json="$o2_json"
+    r="\"gcc_$base\": {"
+    sep=""
+    for f in wall_ms cycles instructions branch_misses cache_misses; do
+      r="$r$sep\"$f\": $(ratio "$(field "$sicc_json" $f)" "$(field "$base_json" $f)")"
+      sep=", "
+    done
+    ratios="$ratios${ratios:+, }$r}"
+  done
+
+  printf "%-8s %14s %14s %14s %8s %8s\n" "$k" "$(cell "$sicc_json")" \
+    "$(cell "$o0_json")" "$(cell "$o2_json")" \
+    "$(ratio "$(field "$sicc_json" wall_ms)" "$(field "$o0_json" wall_ms)")" \
+    "$(ratio "$(field "$sicc_json" wall_ms)" "$(field "$o2_json" wall_ms)")"
+
+  [ "$first" == 1 ] || echo "," >> "$out"
+  first=0
+  printf '    {"kernel": "%s",\n' "$k" >> "$out"
+  printf '     "sicc": %s,\n' "$sicc_json" >> "$out"
+  printf '     "gcc_O0": %s,\n' "$o0_json" >> "$out"
+  printf '     "gcc_O2": %s,\n' "$o2_json" >> "$out"
+  printf '     "sicc_ratio": {%s}}' "$ratios" >> "$out"
+done
+
+{
+  echo
+  echo "  ]"
+  echo "}"
+} >> "$out"
+echo "results written to $out"
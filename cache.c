@@ -0,0 +1,150 @@
+#include "sicc.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// The assembly generated for each function is kept in a cache directory,
+// one file per function, named after a hash of everything its code depends
+// on: its AST after sema, and with it the name, size and layout of every
+// type it uses and every global it refers to. A function whose hash has
+// been seen before is not generated again.
+
+// Bump whenever the code generator changes what it emits.
+#define CACHE_VERSION 4
+
+static char *cache_dir;
+
+// NULL turns the cache off.
+void set_cache_dir(char *dir) {
+  cache_dir = dir;
+  if (dir && mkdir(dir, 0777) && errno != EEXIST)
+    error("Cannot create the cache directory: %s", dir);
+}
+
+typedef struct {
+  unsigned long h;
+  vec_t *members; // struct layouts being hashed, to stop at cycles
+} hasher_t;
+
+static void mix(hasher_t *hs, void *p, int n) {
+  unsigned char *s = p;
+  for (int i = 0; i < n; i++) {
+    hs->h ^= s[i];
+    hs->h *= 1099511628211UL;
+  }
+}
+
+static void mix_int(hasher_t *hs, int n) { mix(hs, &n, sizeof(n)); }
+
+static void mix_str(hasher_t *hs, char *s) {
+  if (!s)
+    mix_int(hs, -1);
+  else
+    mix(hs, s, strlen(s) + 1);
+}
+
+static void hash_type(hasher_t *hs, type_t *ty);
+
+static void hash_member(hasher_t *hs, member_t *m) {
+  if (!m) {
+    mix_int(hs, -1);
+    return;
+  }
+  for (int i = 0; i < vec_len(hs->members); i++) {
+    if (vec_get(hs->members, i) == m) {
+      mix_int(hs, -2 - i);
+      return;
+    }
+  }
+  vec_push(hs->members, m);
+  mix_int(hs, m->size);
+  mix_int(hs, map_len(m->data));
+  for (int i = 0; i < map_len(m->data); i++) {
+    char *name = vec_get(m->data->keys, i);
+    mix_str(hs, name);
+    mix_int(hs, (intptr_t)map_get(m->offset, name));
+    hash_type(hs, vec_get(m->data->items, i));
+  }
+  vec_pop(hs->members);
+}
+
+static void hash_type(hasher_t *hs, type_t *ty) {
+  if (!ty) {
+    mix_int(hs, -1);
+    return;
+  }
+  mix_int(hs, ty->ty);
+  mix_int(hs, ty->size);
+  mix_int(hs, ty->align);
+  mix_int(hs, ty->size_deref);
+  mix_int(hs, ty->array_size);
+  hash_type(hs, ty->ptr);
+  hash_member(hs, ty->member);
+}
+
+static void hash_node(hasher_t *hs, node_t *node) {
+  if (!node) {
+    mix_int(hs, -1);
+    return;
+  }
+  mix_int(hs, node->ty);
+  mix_int(hs, node->op);
+  mix_int(hs, node->num);
+  mix_str(hs, node->str);
+  hash_type(hs, node->type);
+  mix_int(hs, node->flags);
+  hash_node(hs, node->lhs);
+  hash_node(hs, node->rhs);
+  mix_int(hs, node->nlist);
+  for (int i = 0; i < node->nlist; i++)
+    hash_node(hs, child(node, i));
+}
+
+// Returns the cache key of a function, or NULL if the cache is off.
+char *cache_key(node_t *func) {
+  if (!cache_dir)
+    return NULL;
+  hasher_t hs = {14695981039346656037UL, new_vec()};
+  mix_int(&hs, CACHE_VERSION);
+#ifdef __APPLE__
+  mix_int(&hs, 1);
+#endif
+  hash_node(&hs, func);
+  return format("%016lx", hs.h);
+}
+
+static char *cache_path(char *key) { return format("%s/%s.s", cache_dir, key); }
+
+// Returns the cached assembly for `key`, or NULL.
+char *cache_load(char *key) {
+  char *path = cache_path(key);
+  if (access(path, R_OK)) {
+    ctx->cache_misses++;
+    return NULL;
+  }
+  ctx->cache_hits++;
+  return read_file(path);
+}
+
+// Written under a temporary name and renamed, so that a compilation running
+// at the same time never sees a partial file.
+void cache_store(char *key, char *text, int len) {
+  char *tmp = format("%s/%s.XXXXXX", cache_dir, key);
+  int fd = mkstemp(tmp);
+  if (fd < 0)
+    error("Cannot write to the cache directory: %s", cache_dir);
+  for (int off = 0; off < len;) {
+    ssize_t w = write(fd, text + off, len - off);
+    if (w < 0)
+      error("Cannot write to the cache directory: %s", cache_dir);
+    off += w;
+  }
+  close(fd);
+  if (rename(tmp, cache_path(key)))
+    unlink(tmp);
+}
@@ -1,18 +1,20 @@
 #include "sicc.h"
 
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
 
 #define CASE(s) case s: {
 #define END                                                                    \
   break;                                                                       \
   }
 
-void debug_tokens(vec_t *tokens) {
-  int len = vec_len(tokens);
-  for (int i = 0; i < len; i++) {
-    token_t *tk = vec_get(tokens, i);
-    printf("[%s]: %d\n", tk->str, tk->ty);
+void debug_tokens() {
+  for (int i = 0; i < ctx->tokens->len; i++) {
+    printf("[%s]: %d\n", token_str(i), token_ty(i));
   }
   return;
 }
@@ -48,6 +50,213 @@ void debug(char *s) {
   char *p = preprocess(str, s, NULL);
   printf("%s\n", p);
   tokenize(p);
-  debug_tokens(tokens);
+  debug_tokens();
+  return;
+}
+
+static void print_arena_stats(out_t *out, arena_t *a) {
+  out_puts(out, format("arena %-5s: %ld bytes in %d allocs, %d chunks, peak "
+                       "%ld bytes\n",
+                       a->name, (long)a->used, a->nallocs, a->nchunks,
+                       (long)a->peak));
+  return;
+}
+
+// A timed span of a compilation: the whole file, one phase of it, or one
+// function within a phase.
+typedef struct {
+  char *name;
+  char *cat; // "file", "phase" or "function"
+  int tid;
+  long start; // ns
+  long wall;
+  long cpu;
+  long bytes; // allocated from the arenas
+  // Peak resident set size at the end, in KiB. It is the whole process's, so
+  // with -c on several files or in the compile server it covers the other
+  // compilations too.
+  long rss;
+} event_t;
+
+static bool tracing = false;
+static vec_t *trace_events;
+static int trace_tids = 0;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static long clock_ns(clockid_t id) {
+  struct timespec ts;
+  clock_gettime(id, &ts);
+  return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+static long arena_bytes() {
+  return ctx->token_arena->used + ctx->ast_arena->used + ctx->ir_arena->used;
+}
+
+static long peak_rss() {
+  struct rusage ru;
+  getrusage(RUSAGE_SELF, &ru);
+#ifdef __APPLE__
+  return ru.ru_maxrss / 1024;
+#else
+  return ru.ru_maxrss;
+#endif
+}
+
+// Per-function spans are only recorded for --trace-json.
+void set_tracing(bool on) {
+  tracing = on;
+  if (trace_events)
+    free_vec(trace_events);
+  trace_events = arena_vec(NULL);
+  trace_tids = 0;
+}
+
+static void begin(char *name, char *cat) {
+  event_t *e = calloc(1, sizeof(event_t));
+  e->name = name;
+  e->cat = cat;
+  e->start = clock_ns(CLOCK_MONOTONIC);
+  e->cpu = clock_ns(CLOCK_THREAD_CPUTIME_ID);
+  e->bytes = arena_bytes();
+  vec_push(ctx->events, e);
+  vec_push(ctx->open_events, e);
+}
+
+void file_begin(char *filename) { begin(filename, "file"); }
+
+void phase_begin(char *name) { begin(name, "phase"); }
+
+void func_begin(char *name) {
+  if (tracing)
+    begin(name, "function");
+}
+
+// Ends the innermost span.
+void event_end() {
+  event_t *e = vec_get(ctx->open_events, vec_len(ctx->open_events) - 1);
+  vec_pop(ctx->open_events);
+  e->wall = clock_ns(CLOCK_MONOTONIC) - e->start;
+  e->cpu = clock_ns(CLOCK_THREAD_CPUTIME_ID) - e->cpu;
+  e->bytes = arena_bytes() - e->bytes;
+  e->rss = peak_rss();
+}
+
+void func_end() {
+  if (tracing)
+    event_end();
+}
+
+// Hands the spans of the current context over to the trace, each
+// compilation on a track of its own. Names are copied, as function names
+// go away with the context.
+void flush_trace() {
+  if (!tracing) {
+    for (int i = 0; i < vec_len(ctx->events); i++)
+      free(vec_get(ctx->events, i));
+    return;
+  }
+  pthread_mutex_lock(&trace_lock);
+  int tid = ++trace_tids;
+  for (int i = 0; i < vec_len(ctx->events); i++) {
+    event_t *e = vec_get(ctx->events, i);
+    e->tid = tid;
+    e->name = strdup(e->name);
+    vec_push(trace_events, e);
+  }
+  pthread_mutex_unlock(&trace_lock);
+}
+
+static void put_json_str(FILE *fp, char *s) {
+  fputc('"', fp);
+  for (; *s; s++) {
+    if (*s == '"' || *s == '\\')
+      fprintf(fp, "\\%c", *s);
+    else if ((unsigned char)*s < 0x20)
+      fprintf(fp, "\\u%04x", *s);
+    else
+      fputc(*s, fp);
+  }
+  fputc('"', fp);
+}
+
+// Writes the trace in the Chrome trace event format, which chrome://tracing
+// and Perfetto open.
+void write_trace(char *path) {
+  FILE *fp = fopen(path, "w");
+  if (!fp)
+    error("Cannot open %s", path);
+  long t0 = 0;
+  for (int i = 0; i < vec_len(trace_events); i++) {
+    event_t *e = vec_get(trace_events, i);
+    if (i == 0 || e->start < t0)
+      t0 = e->start;
+  }
+  fprintf(fp, "{\"traceEvents\":[\n");
+  for (int i = 0; i < vec_len(trace_events); i++) {
+    event_t *e = vec_get(trace_events, i);
+    fprintf(fp, "{\"name\":");
+    put_json_str(fp, e->name);
+    fprintf(fp,
+            ",\"cat\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,"
+            "\"ts\":%.3f,\"dur\":%.3f,"
+            "\"args\":{\"cpu_us\":%.3f,\"bytes\":%ld,\"peak_rss_kb\":%ld}}%s\n",
+            e->cat, e->tid, (e->start - t0) / 1e3, e->wall / 1e3, e->cpu / 1e3,
+            e->bytes, e->rss, i + 1 < vec_len(trace_events) ? "," : "");
+  }
+  fprintf(fp, "]}\n");
+  fclose(fp);
+  for (int i = 0; i < vec_len(trace_events); i++) {
+    event_t *e = vec_get(trace_events, i);
+    free(e->name);
+    free(e);
+  }
+  free_vec(trace_events);
+  trace_events = arena_vec(NULL);
+}
+
+static void print_phases(out_t *out) {
+  event_t *lex = NULL;
+  out_puts(out, format("%-10s %10s %10s %12s %16s\n", "phase", "wall ms",
+                       "cpu ms", "bytes", "process rss KiB"));
+  // The file's own span comes first and is printed last, as the total.
+  for (int i = 1; i <= vec_len(ctx->events); i++) {
+    event_t *e = vec_get(ctx->events, i % vec_len(ctx->events));
+    if (!strcmp(e->cat, "phase") && !strcmp(e->name, "tokenize"))
+      lex = e;
+    if (strcmp(e->cat, "function"))
+      out_puts(out, format("%-10s %10.3f %10.3f %12ld %16ld\n",
+                           i < vec_len(ctx->events) ? e->name : "total",
+                           e->wall / 1e6, e->cpu / 1e6, e->bytes, e->rss));
+  }
+  out_puts(out, format("tokens: %d, AST nodes: %d, IR instructions: %d\n",
+                       ctx->ntokens, ctx->nnodes, ctx->nins));
+  // In stream mode lexing is part of the parse phase and is not measured.
+  if (lex && lex->wall)
+    out_puts(out, format("tokenize: %ld bytes, %.1f MB/s\n", ctx->lex_bytes,
+                         ctx->lex_bytes / 1e6 / (lex->wall / 1e9)));
+}
+
+// Writes the statistics of the current compilation to `out`.
+void print_stats(out_t *out) {
+  print_phases(out);
+  print_arena_stats(out, ctx->token_arena);
+  print_arena_stats(out, ctx->ast_arena);
+  print_arena_stats(out, ctx->ir_arena);
+  print_arena_stats(out, ctx->heap);
+  int lookups = ctx->intern_hits + ctx->intern_misses;
+  out_puts(out, format("intern: %d strings, %d lookups, %d hits, %d misses",
+                       intern_len(), lookups, ctx->intern_hits,
+                       ctx->intern_misses));
+  if (lookups)
+    out_puts(out,
+             format(" (%.1f%% hit)", 100.0 * ctx->intern_hits / lookups));
+  out_putc(out, '\n');
+  if (include_cache_hits + include_cache_misses)
+    out_puts(out, format("include cache: %d hits, %d misses\n",
+                         include_cache_hits, include_cache_misses));
+  if (ctx->cache_hits + ctx->cache_misses)
+    out_puts(out, format("codegen cache: %d hits, %d misses\n",
+                         ctx->cache_hits, ctx->cache_misses));
   return;
 }
@@ -1,25 +1,57 @@
 #include "sicc.h"
 
+#include <setjmp.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 
+// Set while the compile server handles a request: errors go to the client
+// and unwind to the request loop instead of exiting.
+static THREAD_LOCAL jmp_buf *error_jmp;
+static THREAD_LOCAL int error_fd;
+static THREAD_LOCAL bool reporting;
+
+void set_error_handler(void *jmp, int fd) {
+  error_jmp = jmp;
+  error_fd = fd;
+}
+
+static void report(char *prefix, char *fmt, va_list ap) {
+  if (!error_jmp) {
+    fprintf(stderr, "%s", prefix);
+    vfprintf(stderr, fmt, ap);
+    fprintf(stderr, "\n");
+    exit(EXIT_FAILURE);
+  }
+
+  char msg[1024];
+  int len = snprintf(msg, sizeof(msg), "%s", prefix);
+  len += vsnprintf(msg + len, sizeof(msg) - len, fmt, ap);
+  if (len > (int)sizeof(msg) - 2)
+    len = sizeof(msg) - 2;
+  msg[len++] = '\n';
+  // If the client has gone away, writing fails and lands here again.
+  if (!reporting) {
+    reporting = true;
+    write_frame(error_fd, 'e', msg, len);
+  }
+  reporting = false;
+  longjmp(*error_jmp, 1);
+}
+
 void error(char *fmt, ...) {
   va_list ap;
   va_start(ap, fmt);
-  fprintf(stderr, "[Error]: ");
-  vfprintf(stderr, fmt, ap);
-  fprintf(stderr, "\n");
+  report("[Error]: ", fmt, ap);
   va_end(ap);
-  exit(EXIT_FAILURE);
 }
 
-void error_at(token_t *tk, char *fmt, ...) {
+void error_at(int tk, char *fmt, ...) {
+  char prefix[64];
+  snprintf(prefix, sizeof(prefix), "[Error]: at (line: %d, pos: %d); ",
+           token_line(tk), token_col(tk));
   va_list ap;
   va_start(ap, fmt);
-  fprintf(stderr, "[Error]: at (line: %d, pos: %d); ", tk->line, tk->pos);
-  vfprintf(stderr, fmt, ap);
-  fprintf(stderr, "\n");
+  report(prefix, fmt, ap);
   va_end(ap);
-  exit(EXIT_FAILURE);
 }
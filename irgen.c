@@ -1,15 +1,9 @@
 #include "sicc.h"
 
+#include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 
-static int nreg = 0;
-static int narg = 0;
-static int nlabel = 1;
-static int nbblabel = 1;
-static int nbblabel_start = 1;
-static int nbblabel_end = 1;
-static int stack_size = 0;
-static int cur_stack = 0;
 
 int builtin_va_start(ir_t *ir, node_t *node);
 int builtin_va_arg(ir_t *ir, node_t *node);
@@ -27,68 +21,210 @@ static int call_builtin(ir_t *ir, char *name, node_t *arg) {
 }
 
 ir_t *new_ir() {
-  ir_t *ir = calloc(1, sizeof(ir_t));
-  ir->code = new_vec();
+  ir_t *ir = arena_alloc(ctx->heap, sizeof(ir_t));
+  ir->funcs = new_vec();
   ir->gvars = new_map();
-  ir->vars = new_map();
   ir->gfuncs = new_vec();
   ir->const_str = new_vec();
   ir->labels = new_map();
   ir->builtins = init_builtin();
-  ir->env = calloc(1, sizeof(ir_env_t));
+  ir->func_keys = new_map();
+  ir->env = arena_alloc(ctx->heap, sizeof(ir_env_t));
   return ir;
 }
 
-var_t *new_var(int offset, int size) {
-  var_t *var = calloc(1, sizeof(var_t));
-  var->offset = offset;
-  var->size = size;
-  return var;
+// The ABI aligns an array variable of 16 bytes or more to 16, whatever its
+// element type.
+static int var_align(type_t *ty) {
+  if (ty->ty == TY_ARRAY && ty->size >= 16)
+    return 16;
+  return ty->align;
 }
 
-gvar_t *new_gvar(char *name, int size) {
-  gvar_t *gvar = calloc(1, sizeof(gvar_t));
+gvar_t *new_gvar(char *name, type_t *ty) {
+  gvar_t *gvar = arena_alloc(ctx->ir_arena, sizeof(gvar_t));
   gvar->name = name;
-  gvar->size = size;
+  gvar->type = ty;
+  gvar->size = ty->size;
+  gvar->align = var_align(ty);
   return gvar;
 }
 
+// A block is numbered in the order it is made until its function is done;
+// jumps made before then refer to it by that number.
+static bb_t *new_bb(ir_t *ir) {
+  bb_t *bb = arena_alloc(ctx->ir_arena, sizeof(bb_t));
+  bb->label = vec_len(ir->blocks);
+  vec_push(ir->blocks, bb);
+  return bb;
+}
+
+// Moves the instructions of the current block into an array of its own.
+static void close_bb(ir_t *ir) {
+  bb_t *bb = ir->bb;
+  bb->ins = arena_alloc(ctx->ir_arena, ir->nbuf * sizeof(ins_t));
+  memcpy(bb->ins, ir->buf, ir->nbuf * sizeof(ins_t));
+  bb->nins = ir->nbuf;
+  ir->nbuf = 0;
+  ir->bb = NULL;
+}
+
+// Places `bb` after the current block, which falls through to it.
+static void start_bb(ir_t *ir, bb_t *bb) {
+  if (ir->bb)
+    close_bb(ir);
+  vec_push(ir->func->bbs, bb);
+  ir->bb = bb;
+}
+
+static bool is_jump(int op) {
+  return op == IR_JMP || op == IR_JTRUE || op == IR_JZERO;
+}
+
 static ins_t *emit(ir_t *ir, int op, int lhs, int rhs, int size) {
-  ins_t *ins = calloc(1, sizeof(ins_t));
+  // Code after a jump or a return starts a block no fall-through reaches.
+  if (!ir->bb)
+    start_bb(ir, new_bb(ir));
+  if (ir->nbuf == ir->capbuf) {
+    ir->capbuf = ir->capbuf ? ir->capbuf * 2 : 64;
+    ins_t *buf = arena_alloc(ctx->ir_arena, ir->capbuf * sizeof(ins_t));
+    memcpy(buf, ir->buf, ir->nbuf * sizeof(ins_t));
+    ir->buf = buf;
+  }
+  ins_t *ins = &ir->buf[ir->nbuf++];
   ins->op = op;
   ins->lhs = lhs;
   ins->rhs = rhs;
   ins->size = size;
-  vec_push(ir->code, ins);
-  return ins;
+  ins->name = NULL;
+  ctx->nins++;
+  if (ir->func->nregs < ctx->nreg)
+    ir->func->nregs = ctx->nreg;
+  if (op != IR_LEAVE && !is_jump(op))
+    return ins;
+  bb_t *bb = ir->bb;
+  close_bb(ir);
+  return &bb->ins[bb->nins - 1];
+}
+
+static void jump(ir_t *ir, bb_t *target) {
+  emit(ir, IR_JMP, target->label, -1, -1);
+}
+
+// Jumps to `target` if r is true (IR_JTRUE) or zero (IR_JZERO), and falls
+// through to a new block otherwise.
+static void branch(ir_t *ir, int op, int r, bb_t *target) {
+  emit(ir, op, r, target->label, -1);
+}
+
+static bb_t *label_bb(ir_t *ir, char *name) {
+  bb_t *bb = map_get(ir->labels, name);
+  if (!bb) {
+    bb = new_bb(ir);
+    map_put(ir->labels, name, bb);
+  }
+  return bb;
+}
+
+static void add_succ(bb_t *bb, bb_t *succ) {
+  if (!succ || (bb->nsucc && bb->succ[0] == succ))
+    return;
+  bb->succ[bb->nsucc++] = succ;
+  succ->npreds++;
+}
+
+// Numbers the blocks of the function in layout order, points the jumps at
+// those numbers and links the blocks to their successors and predecessors.
+static void end_func(ir_t *ir) {
+  if (ir->bb)
+    close_bb(ir);
+  vec_t *bbs = ir->func->bbs;
+  int n = vec_len(bbs);
+  for (int i = 0; i < vec_len(ir->blocks); i++)
+    ((bb_t *)vec_get(ir->blocks, i))->label = -1;
+  for (int i = 0; i < n; i++)
+    ((bb_t *)vec_get(bbs, i))->label = i;
+
+  for (int i = 0; i < n; i++) {
+    bb_t *bb = vec_get(bbs, i);
+    bb_t *next = i + 1 < n ? vec_get(bbs, i + 1) : NULL;
+    ins_t *last = bb->nins ? &bb->ins[bb->nins - 1] : NULL;
+    if (!last || !is_jump(last->op)) {
+      if (!last || last->op != IR_LEAVE)
+        add_succ(bb, next);
+      continue;
+    }
+    int *target = last->op == IR_JMP ? &last->lhs : &last->rhs;
+    bb_t *to = vec_get(ir->blocks, *target);
+    if (to->label < 0)
+      error("Jump to a label that is not defined in %s", ir->func->name);
+    *target = to->label;
+    add_succ(bb, to);
+    if (last->op != IR_JMP)
+      add_succ(bb, next);
+  }
+
+  for (int i = 0; i < n; i++) {
+    bb_t *bb = vec_get(bbs, i);
+    bb->preds = arena_alloc(ctx->ir_arena, bb->npreds * sizeof(bb_t *));
+    bb->npreds = 0;
+  }
+  for (int i = 0; i < n; i++) {
+    bb_t *bb = vec_get(bbs, i);
+    for (int j = 0; j < bb->nsucc; j++)
+      bb->succ[j]->preds[bb->succ[j]->npreds++] = bb;
+  }
 }
 
-static int alloc_stack(int size) {
-  cur_stack += size;
-  if (stack_size < cur_stack)
-    stack_size = cur_stack;
-  if (stack_size % 16 != 0)
-    stack_size += 16 - (stack_size % 16);
-  return cur_stack;
+// Locals live below rbp, which is 16-byte aligned, so an offset that is a
+// multiple of the alignment is an aligned address.
+static int alloc_stack(int size, int align) {
+  ctx->cur_stack = align_to(ctx->cur_stack + size, align);
+  if (ctx->stack_size < ctx->cur_stack)
+    ctx->stack_size = ctx->cur_stack;
+  if (ctx->stack_size % 16 != 0)
+    ctx->stack_size += 16 - (ctx->stack_size % 16);
+  return ctx->cur_stack;
 }
 
 static int free_stack(int size) {
-  cur_stack -= size;
-  return cur_stack;
+  ctx->cur_stack -= size;
+  return ctx->cur_stack;
+}
+
+// A scalar local whose address is never taken can be kept in a register.
+static bool promotable(symbol_t *sym) {
+  int ty = sym->type->ty;
+  return !sym->is_global && !sym->addr_taken && ty != TY_STRUCT &&
+         ty != TY_ARRAY && ty != TY_ARRAY_NOSIZE;
+}
+
+static void define_local(ir_t *ir, symbol_t *sym, int offset) {
+  sym->offset = offset;
+  if (promotable(sym))
+    vec_push(ir->vars, sym);
+}
+
+// rbx and r12 to r15 belong to the caller. The code generators save the ones
+// the function writes in slots below its locals and restore them on return.
+static void alloc_save_area(func_t *func) {
+  int n = (func->nregs < 7 ? func->nregs : 7) - 2;
+  if (n > 0)
+    func->save_offset = alloc_stack(8 * n, 8);
 }
 
 int builtin_va_start(ir_t *ir, node_t *node) {
-  node_t *vlist = vec_get(node->params, 0);
+  node_t *vlist = child(node, 0);
   int r = gen_ir(ir, vlist);
   emit(ir, IR_MOV_IMM, r, ir->env->final_arg, vlist->type->size);
-  nreg--;
+  ctx->nreg--;
   return -1;
 }
 
 int builtin_va_arg(ir_t *ir, node_t *node) {
-  node_t *vlist = vec_get(node->params, 0);
+  node_t *vlist = child(node, 0);
   int r = gen_ir(ir, vlist);
-  nreg--;
+  ctx->nreg--;
   return -1;
 }
 
@@ -100,35 +236,36 @@ static void gen_stmt(ir_t *ir, node_t *node);
 static int gen_expr(ir_t *ir, node_t *node);
 static int gen_assign(ir_t *ir, node_t *node, int left, int right);
 
+// An array is indexed from its address, a pointer from its value.
+static int index_base(ir_t *ir, node_t *node) {
+  if (node->type->ty == TY_PTR)
+    return gen_ir(ir, node);
+  return gen_lval(ir, node);
+}
+
 static int gen_lval(ir_t *ir, node_t *node) {
   if (node->ty == ND_DEREF) {
     int r = gen_ir(ir, node->lhs);
     return r;
   } else if (node->ty == ND_IDENT) {
-    if (map_find(ir->vars, node->str)) {
-      var_t *var = map_get(ir->vars, node->str);
-      emit(ir, IR_LOAD_ADDR_VAR, nreg++, var->offset, -1);
-    } else if (map_find(ir->gvars, node->str)) {
-      gvar_t *gvar = map_get(ir->gvars, node->str);
-      ins_t *ins = emit(ir, IR_LOAD_ADDR_GVAR, nreg++, -1, -1);
-      ins->name = gvar->name;
+    if (node->sym->is_global) {
+      ins_t *ins = emit(ir, IR_LOAD_ADDR_GVAR, ctx->nreg++, -1, -1);
+      ins->name = node->sym->name;
+    } else {
+      emit(ir, IR_LOAD_ADDR_VAR, ctx->nreg++, node->sym->offset, -1);
     }
-    return nreg - 1;
+    return ctx->nreg - 1;
   } else if (node->ty == ND_DOT) {
     int r = gen_lval(ir, node->lhs);
-    int member_offset =
-        (int)(intptr_t)map_get(node->lhs->type->member->offset, node->str);
-    emit(ir, IR_ADD_IMM, r, member_offset, 8);
+    emit(ir, IR_ADD_IMM, r, node->num, 8);
     return r;
   } else if (node->ty == ND_ARROW) {
     int r = gen_lval(ir, node->lhs);
-    int member_offset =
-        (int)(intptr_t)map_get(node->lhs->type->ptr->member->offset, node->str);
     emit(ir, IR_LOAD, r, r, 8);
-    emit(ir, IR_ADD_IMM, r, member_offset, 8);
+    emit(ir, IR_ADD_IMM, r, node->num, 8);
     return r;
   } else if (node->ty == ND_DEREF_INDEX) {
-    int left = gen_lval(ir, node->lhs);
+    int left = index_base(ir, node->lhs);
     int right = gen_ir(ir, node->rhs);
     int size = node->lhs->type->size_deref;
     // int is_left_ptr = 1;
@@ -140,12 +277,12 @@ static int gen_lval(ir_t *ir, node_t *node) {
     if (size <= 8)
       emit(ir, IR_PTR_CAST, right, -1, size);
     else {
-      emit(ir, IR_MOV_IMM, nreg++, size, 8);
-      emit(ir, IR_MUL, right, nreg - 1, 8);
-      nreg--;
+      emit(ir, IR_MOV_IMM, ctx->nreg++, size, 8);
+      emit(ir, IR_MUL, right, ctx->nreg - 1, 8);
+      ctx->nreg--;
     }
     emit(ir, IR_ADD, left, right, 8);
-    nreg--;
+    ctx->nreg--;
     return left;
   } else {
     error("Invalid lvalue: %d", node->ty);
@@ -154,13 +291,12 @@ static int gen_lval(ir_t *ir, node_t *node) {
 }
 
 static void gen_initializer(ir_t *ir, node_t *node, int offset) {
-  int len = vec_len(node->initializer);
-  for (int i = 0; i < len; i++) {
-    node_t *e = vec_get(node->initializer, i);
+  for (int i = 0; i < node->nlist; i++) {
+    node_t *e = child(node, i);
     int r = gen_ir(ir, e);
     if (!(e->ty == ND_INITIALIZER)) {
       emit(ir, IR_STORE_VAR, offset, r, e->type->size);
-      nreg--;
+      ctx->nreg--;
     }
     offset -= e->type->size;
   }
@@ -168,192 +304,202 @@ static void gen_initializer(ir_t *ir, node_t *node, int offset) {
   return;
 }
 
+// Uses the cached assembly of a function if there is any. Otherwise the
+// function's key is kept for gen_asm to store what it generates.
+static bool gen_cached(ir_t *ir, node_t *func) {
+  char *key = cache_key(func);
+  if (!key)
+    return false;
+  char *text = cache_load(key);
+  if (!text) {
+    map_put(ir->func_keys, func->str, key);
+    return false;
+  }
+  if (!(func->flags & NF_STATIC))
+    vec_push(ir->gfuncs, func->str);
+  func_t *f = arena_alloc(ctx->ir_arena, sizeof(func_t));
+  f->name = func->str;
+  f->cached = text;
+  vec_push(ir->funcs, f);
+  return true;
+}
+
 static void gen_stmt(ir_t *ir, node_t *node) {
   if (node->ty == ND_NOP)
     return;
   if (node->ty == ND_FUNCS) {
-    int len = vec_len(node->funcs);
-    for (int i = 0; i < len; i++) {
-      node_t *func = vec_get(node->funcs, i);
+    for (int i = 0; i < node->nlist; i++) {
+      node_t *func = child(node, i);
       gen_stmt(ir, func);
     }
     return;
   }
   if (node->ty == ND_EXTERNAL) {
-    int len = vec_len(node->decl_list);
-    for (int i = 0; i < len; i++) {
-      node_t *decl = vec_get(node->decl_list, i);
+    for (int i = 0; i < node->nlist; i++) {
+      node_t *decl = child(node, i);
       gen_stmt(ir, decl);
     }
 
-    len = vec_len(node->funcs);
-    for (int i = 0; i < len; i++) {
-      node_t *func = vec_get(node->funcs, i);
+    for (int i = 0; i < node->rhs->nlist; i++) {
+      node_t *func = child(node->rhs, i);
+      if (func->ty == ND_FUNC && gen_cached(ir, func))
+        continue;
+      if (func->ty == ND_FUNC)
+        func_begin(func->str);
       gen_stmt(ir, func);
+      if (func->ty == ND_FUNC)
+        func_end();
     }
 
     return;
   }
   if (node->ty == ND_FUNC) {
-    ins_t *func = emit(ir, IR_FUNC, -1, -1, -1);
-    if (!node->flag->is_node_static)
-      vec_push(ir->gfuncs, node->str);
+    func_t *func = arena_alloc(ctx->ir_arena, sizeof(func_t));
     func->name = node->str;
-    ins_t *stack_alloc = emit(ir, IR_ALLOC, 0, -1, -1);
+    func->bbs = new_vec();
+    vec_push(ir->funcs, func);
+    if (!(node->flags & NF_STATIC))
+      vec_push(ir->gfuncs, node->str);
+    ir->func = func;
+    ir->vars = new_vec();
+    ir->blocks = new_vec();
+    ir->labels = new_map();
 #ifdef __APPLE__
-    alloc_stack(4);
-    emit(ir, IR_MOV_IMM, nreg, 0, 4);
-    emit(ir, IR_STORE_VAR, 4, nreg, 4);
+    alloc_stack(4, 4);
+    emit(ir, IR_MOV_IMM, ctx->nreg, 0, 4);
+    emit(ir, IR_STORE_VAR, 4, ctx->nreg, 4);
 #endif
     gen_stmt(ir, node->rhs);
     gen_stmt(ir, node->lhs);
-    if (stack_size % 16 != 0)
-      stack_size += 16 - (stack_size % 16);
-    stack_alloc->lhs = stack_size;
-    stack_size = 0;
-    cur_stack = 0;
-    nreg = 0;
-    free(ir->vars);
-    ir->vars = new_map();
+    end_func(ir);
+    mem2reg(func, ir->vars);
+    alloc_save_area(func);
+    func->stack_size = align_to(ctx->stack_size, 16);
+    ctx->stack_size = 0;
+    ctx->cur_stack = 0;
+    ctx->nreg = 0;
     return;
   }
   if (node->ty == ND_ARGS) {
-    int len = vec_len(node->args); // Arguments length
+    int len = node->nlist; // Arguments length
     int arg_stack = -16;
-    for (narg = 0; narg < len; narg++) {
-      node_t *arg = vec_get(node->args, narg);
-      if (narg > 5) {
+    for (ctx->narg = 0; ctx->narg < len; ctx->narg++) {
+      node_t *arg = child(node, ctx->narg);
+      if (ctx->narg > 5) {
         int offset = arg_stack;
-        var_t *var = new_var(offset, arg->type->size);
-        map_put(ir->vars, arg->str, var);
+        arg->sym->offset = offset;
         if (arg->type->ty == TY_ARRAY)
-          emit(ir, IR_LOAD_ARG, offset, narg, 8);
+          emit(ir, IR_LOAD_ARG, offset, ctx->narg, 8);
         else
-          emit(ir, IR_LOAD_ARG, offset, narg, arg->type->size);
-        arg_stack -= arg->type->size;
+          emit(ir, IR_LOAD_ARG, offset, ctx->narg, arg->type->size);
+        // Every argument passed on the stack takes an eightbyte.
+        arg_stack -= 8;
       } else {
-        int offset = alloc_stack(arg->type->size);
-        var_t *var = new_var(offset, arg->type->size);
-        map_put(ir->vars, arg->str, var);
+        int offset = alloc_stack(arg->type->size, var_align(arg->type));
+        define_local(ir, arg->sym, offset);
         if (arg->type->ty == TY_ARRAY)
-          emit(ir, IR_LOAD_ARG, offset, narg, 8);
+          emit(ir, IR_LOAD_ARG, offset, ctx->narg, 8);
         else
-          emit(ir, IR_LOAD_ARG, offset, narg, arg->type->size);
+          emit(ir, IR_LOAD_ARG, offset, ctx->narg, arg->type->size);
       }
     }
-    ir->env->final_arg = narg;
+    ir->env->final_arg = ctx->narg;
     return;
   }
   if (node->ty == ND_STMTS) {
-    int len = vec_len(node->stmts);
-    int init_stack = cur_stack;
-    int init_nvar = map_len(ir->vars) - 1;
-    for (int i = 0; i < len; i++) {
-      node_t *stmt = vec_get(node->stmts, i);
+    for (int i = 0; i < node->nlist; i++) {
+      node_t *stmt = child(node, i);
       gen_ir(ir, stmt);
     }
-
-    int nvar = map_len(ir->vars) - 1;
-    for (int i = init_nvar; i < nvar; i++) {
-      map_pop(ir->vars);
-    }
-
     return;
   }
   if (node->ty == ND_RETURN) {
     int r = 7;
     if (node->lhs)
       r = gen_ir(ir, node->lhs);
-    emit(ir, IR_FREE, stack_size, -1, -1);
+    emit(ir, IR_FREE, ctx->stack_size, -1, -1);
     emit(ir, IR_RET, r, -1, -1);
     emit(ir, IR_LEAVE, -1, -1, -1);
-    nreg--;
+    ctx->nreg--;
     return;
   }
   if (node->ty == ND_IF) {
+    bb_t *end = new_bb(ir);
     int r = gen_ir(ir, node->rhs);
-    emit(ir, IR_JTRUE, r, nlabel++, -1);
-    nreg--;
-    emit(ir, IR_JMP, nlabel++, -1, -1);
-    emit(ir, IR_LABEL, nlabel - 2, -1, -1);
+    branch(ir, IR_JZERO, r, end);
+    ctx->nreg--;
     gen_ir(ir, node->lhs);
-    emit(ir, IR_LABEL, nlabel - 1, -1, -1);
+    start_bb(ir, end);
     return;
   }
   if (node->ty == ND_IF_ELSE) {
+    bb_t *els = new_bb(ir);
+    bb_t *end = new_bb(ir);
     int r = gen_ir(ir, node->rhs);
-    emit(ir, IR_JTRUE, r, nlabel++, -1);
-    nreg--;
-    emit(ir, IR_JMP, nlabel++, -1, -1);
-    emit(ir, IR_LABEL, nlabel - 2, -1, -1);
+    branch(ir, IR_JZERO, r, els);
+    ctx->nreg--;
     gen_ir(ir, node->lhs);
-    emit(ir, IR_LABEL, nlabel - 1, -1, -1);
-    gen_ir(ir, node->else_stmt);
+    jump(ir, end);
+    start_bb(ir, els);
+    gen_ir(ir, child(node, 0));
+    start_bb(ir, end);
     return;
   }
   if (node->ty == ND_WHILE) {
-    int eval = nbblabel++;
-    int prog = nbblabel++;
-    int start = nbblabel_start++;
-    int end = nbblabel_end++;
-
-    emit(ir, IR_LABEL_BBSTART, start, -1, -1);
-    emit(ir, IR_JMP_BB, eval, -1, -1);
-    emit(ir, IR_LABEL_BB, prog, -1, -1);
+    bb_t *body = new_bb(ir);
+    bb_t *cond = new_bb(ir);
+    bb_t *end = new_bb(ir);
+    ir_env_t env = *ir->env;
+    ir->env->break_bb = end;
+    ir->env->continue_bb = cond;
+
+    jump(ir, cond);
+    start_bb(ir, body);
     gen_ir(ir, node->lhs);
-    emit(ir, IR_LABEL_BB, eval, -1, -1);
+    start_bb(ir, cond);
     int r = gen_ir(ir, node->rhs);
-    emit(ir, IR_JTRUE_BB, r, prog, -1);
-    nreg--;
-    emit(ir, IR_LABEL_BBEND, end, -1, -1);
+    branch(ir, IR_JTRUE, r, body);
+    ctx->nreg--;
+    start_bb(ir, end);
+    ir->env->break_bb = env.break_bb;
+    ir->env->continue_bb = env.continue_bb;
     return;
   }
   if (node->ty == ND_FOR) {
-    int cond = nbblabel++;
-    int start = nbblabel_start++;
-    int end = nbblabel_end++;
-
-    gen_ir(ir, node->init);
-    emit(ir, IR_LABEL_BBSTART, start, -1, -1);
-    emit(ir, IR_LABEL_BB, cond, -1, -1);
-    int r = gen_ir(ir, node->cond);
+    bb_t *cond = new_bb(ir);
+    bb_t *next = new_bb(ir);
+    bb_t *end = new_bb(ir);
+    ir_env_t env = *ir->env;
+    ir->env->break_bb = end;
+    ir->env->continue_bb = next;
+
+    gen_ir(ir, child(node, FOR_INIT));
+    start_bb(ir, cond);
+    int r = gen_ir(ir, child(node, FOR_COND));
     if (r != -1) {
-      emit(ir, IR_JZERO_BBEND, r, end, -1);
-      nreg--;
+      branch(ir, IR_JZERO, r, end);
+      ctx->nreg--;
     }
-    ir->env->before_continue = node->loop;
-    gen_ir(ir, node->body);
-    if (gen_ir(ir, node->loop) != -1) {
-      nreg--;
-    }
-    emit(ir, IR_JMP_BB, cond, -1, -1);
-    emit(ir, IR_LABEL_BBEND, end, -1, -1);
-
-    if (node->init->ty >= ND_VAR_DEF && node->init->ty <= ND_EXT_VAR_DECL) {
-      if (node->init->ty == ND_VAR_DECL_LIST) {
-        int len = vec_len(node->init->vars);
-        for (int i = 0; i < len; i++) {
-          map_pop(ir->vars);
-        }
-      } else {
-        map_pop(ir->vars);
-      }
+    gen_ir(ir, child(node, FOR_BODY));
+    start_bb(ir, next);
+    if (gen_ir(ir, child(node, FOR_LOOP)) != -1) {
+      ctx->nreg--;
     }
-
+    jump(ir, cond);
+    start_bb(ir, end);
+    ir->env->break_bb = env.break_bb;
+    ir->env->continue_bb = env.continue_bb;
     return;
   }
   if (node->ty == ND_VAR_DEF) {
-    if (map_find(ir->vars, node->str))
-      error("%s is already defined", node->str);
-    int offset = alloc_stack(node->type->size);
+    int offset = alloc_stack(node->type->size, var_align(node->type));
     int r;
     if (node->lhs->ty == ND_INITIALIZER) {
       // if (node->type->ty != TY_ARRAY) {
       //   error("Initializer is only to use to an array");
       // } else {
       gen_initializer(ir, node->lhs, offset);
-      var_t *var = new_var(offset, node->type->size);
-      map_put(ir->vars, node->str, var);
+      define_local(ir, node->sym, offset);
       // }
       return;
     } else {
@@ -361,26 +507,18 @@ static void gen_stmt(ir_t *ir, node_t *node) {
     }
 
     emit(ir, IR_STORE_VAR, offset, r, node->type->size);
-    var_t *var;
-    if (node->type->ty == TY_ARRAY)
-      var = new_var(offset, node->type->size_deref);
-    else
-      var = new_var(offset, node->type->size);
-    map_put(ir->vars, node->str, var);
-    nreg--;
+    define_local(ir, node->sym, offset);
+    ctx->nreg--;
     return;
   }
   if (node->ty == ND_VAR_DECL) {
-    if (map_find(ir->vars, node->str))
-      error("%s is already defined", node->str);
-    int offset = alloc_stack(node->type->size);
-    var_t *var = new_var(offset, node->type->size);
-    map_put(ir->vars, node->str, var);
+    define_local(ir, node->sym,
+                 alloc_stack(node->type->size, var_align(node->type)));
     return;
   }
   if (node->ty == ND_VAR_DECL_LIST) {
-    for (int i = 0, len = vec_len(node->vars); i < len; i++) {
-      gen_ir(ir, vec_get(node->vars, i));
+    for (int i = 0; i < node->nlist; i++) {
+      gen_ir(ir, child(node, i));
     }
     return;
   }
@@ -388,7 +526,7 @@ static void gen_stmt(ir_t *ir, node_t *node) {
     if (map_find(ir->gvars, node->str))
       error("%s is already defined", node->str);
 
-    gvar_t *gvar = new_gvar(node->str, node->type->size);
+    gvar_t *gvar = new_gvar(node->str, node->type);
     gvar->init = node->lhs;
     gvar->is_null = 0;
     map_put(ir->gvars, node->str, gvar);
@@ -398,88 +536,77 @@ static void gen_stmt(ir_t *ir, node_t *node) {
   if (node->ty == ND_EXT_VAR_DECL) {
     if (map_find(ir->gvars, node->str))
       error("%s is already defined", node->str);
-    gvar_t *gvar = new_gvar(node->str, node->type->size);
+    gvar_t *gvar = new_gvar(node->str, node->type);
     gvar->is_null = 1;
     gvar->init = NULL;
-    if (node->flag->is_node_extern)
-      gvar->external = true;
-    if (node->flag->is_node_static)
-      gvar->statical = true;
+    gvar->external = node->sym->is_extern;
+    gvar->statical = node->sym->is_static;
     map_put(ir->gvars, node->str, gvar);
     return;
   }
   if (node->ty == ND_LABEL) {
-    int label = nlabel++;
-    emit(ir, IR_LABEL, label, -1, -1);
-    map_put(ir->labels, node->str, (void *)(intptr_t)label);
+    start_bb(ir, label_bb(ir, node->str));
     return;
   }
   if (node->ty == ND_GOTO) {
-    int label = (int)(intptr_t)map_get(ir->labels, node->str);
-    if (!label)
-      error("label '%s' not found", node->str);
-    emit(ir, IR_JMP, label, -1, -1);
+    jump(ir, label_bb(ir, node->str));
     return;
   }
   if (node->ty == ND_SWITCH) {
-    int end = nbblabel_end++;
-    int stmt_len = vec_len(node->rhs->stmts);
-    vec_t *case_list = new_vec();
-    ins_t *jmp_cond = emit(ir, IR_JMP_BB, 0, -1, -1);
-    int bb_start = nbblabel;
-    for (int i = 0; i < stmt_len; i++) {
-      node_t *stmt = vec_get(node->rhs->stmts, i);
-      gen_ir(ir, stmt);
-      if (stmt->ty == ND_CASE)
-        vec_push(case_list, stmt->lhs);
-    }
-    int case_len = vec_len(case_list);
-    emit(ir, IR_JMP_BBEND, end, -1, -1);
-    jmp_cond->lhs = nbblabel;
-    int i;
-    for (i = 0; i < case_len; i++) {
-      node_t *case_value = vec_get(case_list, i);
-      emit(ir, IR_LABEL_BB, nbblabel++, -1, -1);
+    // The cases are compared after the body, once its case labels are known.
+    bb_t *dispatch = new_bb(ir);
+    bb_t *end = new_bb(ir);
+    ir_env_t env = *ir->env;
+    ir->env->break_bb = end;
+    ir->env->cases = new_vec();
+    ir->env->default_bb = NULL;
+
+    jump(ir, dispatch);
+    for (int i = 0; i < node->rhs->nlist; i++)
+      gen_ir(ir, child(node->rhs, i));
+    jump(ir, end);
+    start_bb(ir, dispatch);
+    vec_t *cases = ir->env->cases;
+    for (int i = 0; i < vec_len(cases); i += 2) {
       int r = gen_ir(ir, node->lhs);
-      int r_value = gen_ir(ir, case_value);
+      int r_value = gen_ir(ir, vec_get(cases, i));
       emit(ir, IR_EQ, r, r_value, 8);
-      emit(ir, IR_JTRUE_BB, r, bb_start + i, -1);
-      emit(ir, IR_JMP_BB, nbblabel, -1, -1);
-      nreg -= 2;
+      branch(ir, IR_JTRUE, r, vec_get(cases, i + 1));
+      ctx->nreg -= 2;
     }
-    // Jump to default label.
-    emit(ir, IR_LABEL_BB, nbblabel++, -1, -1);
-    emit(ir, IR_JMP_BB, bb_start + i, -1, -1);
-    // End of switch statement.
-    emit(ir, IR_LABEL_BBEND, end, -1, -1);
+    jump(ir, ir->env->default_bb ? ir->env->default_bb : end);
+    start_bb(ir, end);
+    ir->env->break_bb = env.break_bb;
+    ir->env->cases = env.cases;
+    ir->env->default_bb = env.default_bb;
     return;
   }
   if (node->ty == ND_CASE) {
-    emit(ir, IR_LABEL_BB, nbblabel++, -1, -1);
-    // int r = nreg++;
-    // emit(ir, IR_POP, r, -1, -1);
-    // int value = gen_ir(ir, node->lhs);
-    // emit(ir, IR_PUSH, r, -1, -1);
-    // emit(ir, IR_EQ, value, r, 8);
-    // emit(ir, IR_JZERO_BB, value, nbblabel, -1);
-    // nreg -= 2;
+    if (!ir->env->cases)
+      error("case label not within a switch statement");
+    bb_t *bb = new_bb(ir);
+    start_bb(ir, bb);
+    vec_push(ir->env->cases, node->lhs);
+    vec_push(ir->env->cases, bb);
     return;
   }
   if (node->ty == ND_DEFAULT) {
-    emit(ir, IR_LABEL_BB, nbblabel++, -1, -1);
+    if (!ir->env->cases)
+      error("default label not within a switch statement");
+    ir->env->default_bb = new_bb(ir);
+    start_bb(ir, ir->env->default_bb);
     return;
   }
   if (node->ty == ND_BREAK) {
-    emit(ir, IR_JMP_BBEND, nbblabel_end - 1, -1, -1);
+    if (!ir->env->break_bb)
+      error("break statement not within a loop or switch");
+    jump(ir, ir->env->break_bb);
     return;
   }
   if (node->ty == ND_CONTINUE) {
-    if (ir->env->before_continue) {
-      gen_ir(ir, ir->env->before_continue);
-      nreg--;
-      ir->env->before_continue = NULL;
-    }
-    emit(ir, IR_JMP_BBSTART, nbblabel_start - 1, -1, -1);
+    if (!ir->env->continue_bb)
+      error("continue statement not within a loop");
+    jump(ir, ir->env->continue_bb);
     return;
   }
   if (node->ty == ND_FUNC_DECL) {
@@ -497,11 +624,51 @@ static int gen_assign(ir_t *ir, node_t *node, int left, int right) {
     return -1;
   } else {
     emit(ir, IR_STORE, left, right, node->lhs->type->size);
-    nreg--;
-    return nreg;
+    ctx->nreg--;
+    return ctx->nreg;
   }
 }
 
+static bool is_reg_var(node_t *node) {
+  return node->ty == ND_IDENT && promotable(node->sym);
+}
+
+// Assignments to a local that may be promoted go to its slot directly rather
+// than through its address, which would keep it in memory.
+static int gen_var_assign(ir_t *ir, node_t *node) {
+  symbol_t *sym = node->lhs->sym;
+  int size = sym->type->size;
+  int right = gen_ir(ir, node->rhs);
+  if (node->op == '=') {
+    emit(ir, IR_STORE_VAR, sym->offset, right, size);
+    ctx->nreg--;
+    return right;
+  }
+  if (node->type->ty == TY_PTR)
+    emit(ir, IR_PTR_CAST, right, -1, node->type->size_deref);
+  int r = ctx->nreg++;
+  emit(ir, IR_LOAD_VAR, r, sym->offset, size);
+  emit(ir, node->op == OP_PLUS_ASSIGN ? IR_ADD : IR_SUB, r, right, size);
+  emit(ir, IR_STORE_VAR, sym->offset, r, size);
+  ctx->nreg -= 2;
+  return r;
+}
+
+static int gen_var_inc(ir_t *ir, node_t *node, int op) {
+  int offset = node->lhs->sym->offset;
+  int size = node->type->size;
+  int r_value = ctx->nreg++;
+  int tr = ctx->nreg++; // tmp reg
+  emit(ir, IR_LOAD_VAR, r_value, offset, size);
+  emit(ir, IR_MOV, tr, r_value, size);
+  emit(ir, op, tr, 1, size);
+  emit(ir, IR_STORE_VAR, offset, tr, size);
+  ctx->nreg--;
+  if (!(node->flags & NF_SHOULD_SAVE))
+    ctx->nreg--;
+  return r_value;
+}
+
 static int gen_expr(ir_t *ir, node_t *node) {
   int left;
   int op;
@@ -510,6 +677,9 @@ static int gen_expr(ir_t *ir, node_t *node) {
   int r;
 
   op = node->op;
+  if ((op == '=' || op == OP_PLUS_ASSIGN || op == OP_MINUS_ASSIGN) &&
+      is_reg_var(node->lhs))
+    return gen_var_assign(ir, node);
   if (op == '=' || op == OP_PLUS_ASSIGN || op == OP_MINUS_ASSIGN) {
     left = gen_lval(ir, node->lhs);
   } else {
@@ -517,7 +687,9 @@ static int gen_expr(ir_t *ir, node_t *node) {
   }
   right = gen_ir(ir, node->rhs);
   if (node->type->ty == TY_PTR || node->type->ty == TY_ARRAY) {
-    emit(ir, IR_PTR_CAST, right, -1, node->type->size_deref);
+    // The right side of a pointer assignment is an address already.
+    if (op != '=')
+      emit(ir, IR_PTR_CAST, right, -1, node->type->size_deref);
     size = 8;
   } else {
     size = node->type->size;
@@ -546,18 +718,18 @@ static int gen_expr(ir_t *ir, node_t *node) {
     left = gen_assign(ir, node, left, right);
     break;
   case OP_PLUS_ASSIGN:
-    r = nreg++;
+    r = ctx->nreg++;
     emit(ir, IR_LOAD, r, left, node->lhs->type->size);
     emit(ir, IR_ADD, r, right, node->lhs->type->size);
     left = gen_assign(ir, node, left, r);
-    nreg--;
+    ctx->nreg--;
     break;
   case OP_MINUS_ASSIGN:
-    r = nreg++;
+    r = ctx->nreg++;
     emit(ir, IR_LOAD, r, left, node->lhs->type->size);
     emit(ir, IR_SUB, r, right, node->lhs->type->size);
     left = gen_assign(ir, node, left, r);
-    nreg--;
+    ctx->nreg--;
     break;
   case OP_EQUAL:
     emit(ir, IR_EQ, left, right, size);
@@ -571,15 +743,14 @@ static int gen_expr(ir_t *ir, node_t *node) {
   case OP_LOGIC_OR:
     emit(ir, IR_LOGOR, left, right, size);
     break;
-  case OP_COND:
-    emit(ir, IR_MOV, left, nreg - 1, size);
-    emit(ir, IR_JTRUE, left, nlabel++, -1);
-    emit(ir, IR_JMP, nlabel++, -1, -1);
-    emit(ir, IR_LABEL, nlabel - 2, -1, -1);
-    emit(ir, IR_MOV, left, nreg - 2, size);
-    emit(ir, IR_LABEL, nlabel - 1, -1, -1);
-    nreg--;
-    break;
+  case OP_COND: {
+    bb_t *end = new_bb(ir);
+    emit(ir, IR_MOV, left, ctx->nreg - 1, size);
+    branch(ir, IR_JZERO, left, end);
+    emit(ir, IR_MOV, left, ctx->nreg - 2, size);
+    start_bb(ir, end);
+    ctx->nreg--;
+  } break;
   case OP_GREAT_EQ:
     emit(ir, IR_GREAT_EQ, left, right, size);
     break;
@@ -589,7 +760,7 @@ static int gen_expr(ir_t *ir, node_t *node) {
   default:
     error("Unknown operator: %d", op);
   }
-  nreg--;
+  ctx->nreg--;
   return left;
 }
 
@@ -605,24 +776,24 @@ int gen_ir(ir_t *ir, node_t *node) {
     return r;
   }
   if (node->ty == ND_NUM) {
-    emit(ir, IR_MOV_IMM, nreg++, node->num, node->type->size);
-    return nreg - 1;
+    emit(ir, IR_MOV_IMM, ctx->nreg++, node->num, node->type->size);
+    return ctx->nreg - 1;
   }
   if (node->ty == ND_IDENT) {
-    if (map_find(ir->vars, node->str)) {
-      var_t *var = (var_t *)map_get(ir->vars, node->str);
-      if (node->type->ty == TY_ARRAY)
-        emit(ir, IR_LOAD_ADDR_VAR, nreg++, var->offset, -1);
-      else
-        emit(ir, IR_LOAD_VAR, nreg++, var->offset, var->size);
-      return nreg - 1;
-    } else if (map_find(ir->gvars, node->str)) {
-      gvar_t *gvar = (gvar_t *)map_get(ir->gvars, node->str);
-      ins_t *ins = emit(ir, IR_LOAD_GVAR, nreg++, -1, gvar->size);
-      ins->name = gvar->name;
-      return nreg - 1;
-    } else
-      error("Undefined variable: %s", node->str);
+    symbol_t *sym = node->sym;
+    // An array stands for its address, global or not.
+    if (sym->is_global && node->type->ty == TY_ARRAY) {
+      ins_t *ins = emit(ir, IR_LOAD_ADDR_GVAR, ctx->nreg++, -1, -1);
+      ins->name = sym->name;
+    } else if (sym->is_global) {
+      ins_t *ins = emit(ir, IR_LOAD_GVAR, ctx->nreg++, -1, sym->type->size);
+      ins->name = sym->name;
+    } else if (node->type->ty == TY_ARRAY) {
+      emit(ir, IR_LOAD_ADDR_VAR, ctx->nreg++, sym->offset, -1);
+    } else {
+      emit(ir, IR_LOAD_VAR, ctx->nreg++, sym->offset, sym->type->size);
+    }
+    return ctx->nreg - 1;
   }
   if (node->ty == ND_DEREF) {
     int r = gen_ir(ir, node->lhs);
@@ -630,7 +801,7 @@ int gen_ir(ir_t *ir, node_t *node) {
     return r;
   }
   if (node->ty == ND_DEREF_INDEX) {
-    int left = gen_lval(ir, node->lhs);
+    int left = index_base(ir, node->lhs);
     int right = gen_ir(ir, node->rhs);
     int size = node->lhs->type->size_deref;
     // int is_left_ptr = 1;
@@ -642,13 +813,13 @@ int gen_ir(ir_t *ir, node_t *node) {
     if (size <= 8)
       emit(ir, IR_PTR_CAST, right, -1, size);
     else {
-      emit(ir, IR_MOV_IMM, nreg++, size, 8);
-      emit(ir, IR_MUL, right, nreg - 1, 8);
-      nreg--;
+      emit(ir, IR_MOV_IMM, ctx->nreg++, size, 8);
+      emit(ir, IR_MUL, right, ctx->nreg - 1, 8);
+      ctx->nreg--;
     }
     emit(ir, IR_ADD, left, right, 8);
     emit(ir, IR_LOAD, left, left, size);
-    nreg--;
+    ctx->nreg--;
     return left;
   }
   if (node->ty == ND_REF) {
@@ -675,230 +846,216 @@ int gen_ir(ir_t *ir, node_t *node) {
       return call_builtin(ir, node->str, node->rhs);
     }
     gen_ir(ir, node->rhs);
-    for (int i = 0; i < nreg; i++) {
+    for (int i = 0; i < ctx->nreg; i++) {
       emit(ir, IR_PUSH, i, -1, -1);
     }
     emit(ir, IR_MOV_IMM, 7, 0, 1);
-    int saved_regs = nreg;
+    int saved_regs = ctx->nreg;
     ins_t *ins = emit(ir, IR_CALL, -1, -1, -1);
     ins->name = node->str;
-    if (node->flag->should_save)
-      emit(ir, IR_MOV_RETVAL, nreg++, -1, -1);
+    if (node->flags & NF_SHOULD_SAVE)
+      emit(ir, IR_MOV_RETVAL, ctx->nreg++, -1, -1);
     for (int i = 0; i < saved_regs; i++) {
       emit(ir, IR_POP, i, -1, -1);
     }
-    return nreg - 1;
+    return ctx->nreg - 1;
   }
   if (node->ty == ND_INC_L) {
-    int r_value = nreg++;
+    if (is_reg_var(node->lhs))
+      return gen_var_inc(ir, node, IR_ADD_IMM);
+    int r_value = ctx->nreg++;
     int r = gen_lval(ir, node->lhs);
-    int tr = nreg++; // tmp reg
+    int tr = ctx->nreg++; // tmp reg
     emit(ir, IR_LOAD, r_value, r, node->type->size);
     emit(ir, IR_MOV, tr, r_value, node->type->size);
     emit(ir, IR_ADD_IMM, tr, 1, node->type->size);
     emit(ir, IR_STORE, r, tr, node->type->size);
-    nreg -= 2;
-    if (!node->flag->should_save)
-      nreg--;
+    ctx->nreg -= 2;
+    if (!(node->flags & NF_SHOULD_SAVE))
+      ctx->nreg--;
     return r_value;
   }
   if (node->ty == ND_DEC_L) {
-    int r_value = nreg++;
+    if (is_reg_var(node->lhs))
+      return gen_var_inc(ir, node, IR_SUB_IMM);
+    int r_value = ctx->nreg++;
     int r = gen_lval(ir, node->lhs);
-    int tr = nreg++; // tmp reg
+    int tr = ctx->nreg++; // tmp reg
     emit(ir, IR_LOAD, r_value, r, node->type->size);
     emit(ir, IR_MOV, tr, r_value, node->type->size);
     emit(ir, IR_SUB_IMM, tr, 1, node->type->size);
     emit(ir, IR_STORE, r, tr, node->type->size);
-    nreg -= 2;
-    if (!node->flag->should_save)
-      nreg--;
+    ctx->nreg -= 2;
+    if (!(node->flags & NF_SHOULD_SAVE))
+      ctx->nreg--;
     return r_value;
   }
   if (node->ty == ND_DOT) {
     int r = gen_lval(ir, node->lhs);
-    int member_offset =
-        (int)(intptr_t)map_get(node->lhs->type->member->offset, node->str);
-    emit(ir, IR_ADD_IMM, r, member_offset, 8);
+    emit(ir, IR_ADD_IMM, r, node->num, 8);
     emit(ir, IR_LOAD, r, r, node->type->size);
     return r;
   }
   if (node->ty == ND_ARROW) {
     int r = gen_lval(ir, node->lhs);
-    int member_offset =
-        (int)(intptr_t)map_get(node->lhs->type->ptr->member->offset, node->str);
     emit(ir, IR_LOAD, r, r, 8);
-    emit(ir, IR_ADD_IMM, r, member_offset, 8);
+    emit(ir, IR_ADD_IMM, r, node->num, 8);
     emit(ir, IR_LOAD, r, r, node->type->size);
     return r;
   }
   if (node->ty == ND_PARAMS) {
-    int len = vec_len(node->params);
-    for (int i = len - 1; i >= 0; i--) {
-      node_t *param = vec_get(node->params, i);
+    for (int i = node->nlist - 1; i >= 0; i--) {
+      node_t *param = child(node, i);
       int r = gen_ir(ir, param);
       if (param->type->ty == TY_ARRAY)
         emit(ir, IR_STORE_ARG, i, r, 8);
       else
         emit(ir, IR_STORE_ARG, i, r, param->type->size);
-      nreg--;
+      ctx->nreg--;
     }
     return -1;
   }
   if (node->ty == ND_STRING) {
     vec_push(ir->const_str, node->str);
     int i = vec_len(ir->const_str) - 1;
-    emit(ir, IR_LOAD_CONST, nreg++, i, node->type->size);
-    return nreg - 1;
+    emit(ir, IR_LOAD_CONST, ctx->nreg++, i, node->type->size);
+    return ctx->nreg - 1;
   }
 
   if (node->ty == ND_CHARACTER) {
-    emit(ir, IR_MOV_IMM, nreg++, node->num, node->type->size);
-    return nreg - 1;
+    emit(ir, IR_MOV_IMM, ctx->nreg++, node->num, node->type->size);
+    return ctx->nreg - 1;
   }
 
   gen_stmt(ir, node);
   return -1;
 }
 
+static void print_ins(ins_t *ins) {
+  switch (ins->op) {
+  case IR_MOV_IMM:
+    printf("  mov_imm r%d, %d\n", ins->lhs, ins->rhs);
+    break;
+  case IR_MOV_RETVAL:
+    printf("  mov_retval r%d, retval\n", ins->lhs);
+    break;
+  case IR_STORE_ARG:
+    printf("  store_arg a%d, r%d\n", ins->lhs, ins->rhs);
+    break;
+  case IR_LOAD_ARG:
+    printf("  load_arg v%d, a%d\n", ins->lhs, ins->rhs);
+    break;
+  case IR_MOV_ARG:
+    printf("  mov_arg r%d, a%d\n", ins->lhs, ins->rhs);
+    break;
+  case IR_ADD:
+    printf("  add r%d, r%d\n", ins->lhs, ins->rhs);
+    break;
+  case IR_SUB:
+    printf("  sub r%d, r%d\n", ins->lhs, ins->rhs);
+    break;
+  case IR_MUL:
+    printf("  mul r%d, r%d\n", ins->lhs, ins->rhs);
+    break;
+  case IR_DIV:
+    printf("  div r%d, r%d\n", ins->lhs, ins->rhs);
+    break;
+  case IR_GREAT:
+    printf("  great r%d, r%d\n", ins->lhs, ins->rhs);
+    break;
+  case IR_LESS:
+    printf("  less r%d, r%d\n", ins->lhs, ins->rhs);
+    break;
+  case IR_STORE:
+    printf("  store [r%d], r%d\n", ins->lhs, ins->rhs);
+    break;
+  case IR_LOAD:
+    printf("  load r%d, [r%d]\n", ins->lhs, ins->rhs);
+    break;
+  case IR_CALL:
+    printf("  call %s\n", ins->name);
+    break;
+  case IR_FREE:
+    printf("  free %d\n", ins->lhs);
+    break;
+  case IR_RET:
+    printf("  ret r%d\n", ins->lhs);
+    break;
+  case IR_JTRUE:
+    printf("  jtrue r%d, .L%d\n", ins->lhs, ins->rhs);
+    break;
+  case IR_JZERO:
+    printf("  jzero r%d, .L%d\n", ins->lhs, ins->rhs);
+    break;
+  case IR_JMP:
+    printf("  jmp .L%d\n", ins->lhs);
+    break;
+  case IR_STORE_VAR:
+    printf("  store_var v%d, r%d\n", ins->lhs, ins->rhs);
+    break;
+  case IR_LOAD_VAR:
+    printf("  load_var r%d, v%d\n", ins->lhs, ins->rhs);
+    break;
+  case IR_LEAVE:
+    printf("  leave\n");
+    break;
+  case IR_LOAD_CONST:
+    printf("  load_const r%d, c%d\n", ins->lhs, ins->rhs);
+    break;
+  case IR_PTR_CAST:
+    printf("  ptr_cast r%d\n", ins->lhs);
+    break;
+  case IR_LOAD_ADDR_VAR:
+    printf("  load_addr_var r%d, v%d\n", ins->lhs, ins->rhs);
+    break;
+  case IR_PUSH:
+    printf("  push r%d\n", ins->lhs);
+    break;
+  case IR_POP:
+    printf("  pop r%d\n", ins->lhs);
+    break;
+  case IR_LOAD_GVAR:
+    printf("  load_gvar r%d, %s\n", ins->lhs, ins->name);
+    break;
+  case IR_LOAD_ADDR_GVAR:
+    printf("  load_addr_gvar r%d, %s\n", ins->lhs, ins->name);
+    break;
+  case IR_MOV:
+    printf("  mov r%d, r%d\n", ins->lhs, ins->rhs);
+    break;
+  case IR_ADD_IMM:
+    printf("  add_imm r%d, %d\n", ins->lhs, ins->rhs);
+    break;
+  case IR_SUB_IMM:
+    printf("  sub_imm r%d, %d\n", ins->lhs, ins->rhs);
+    break;
+  case IR_EQ:
+    printf("  eq r%d, r%d\n", ins->lhs, ins->rhs);
+    break;
+  case IR_NEQ:
+    printf("  neq r%d, r%d\n", ins->lhs, ins->rhs);
+    break;
+  default:
+    printf("  op%d r%d, r%d\n", ins->op, ins->lhs, ins->rhs);
+  }
+}
+
 void print_ir(ir_t *ir) {
-  int len = vec_len(ir->code);
-  for (int i = 0; i < len; i++) {
-    ins_t *ins = vec_get(ir->code, i);
-    switch (ins->op) {
-    case IR_MOV_IMM:
-      printf("  mov_imm r%d, %d\n", ins->lhs, ins->rhs);
-      break;
-    case IR_MOV_RETVAL:
-      printf("  mov_retval r%d, retval\n", ins->lhs);
-      break;
-    case IR_STORE_ARG:
-      printf("  store_arg a%d, r%d\n", ins->lhs, ins->rhs);
-      break;
-    case IR_LOAD_ARG:
-      printf("  load_arg v%d, a%d\n", ins->lhs, ins->rhs);
-      break;
-    case IR_ADD:
-      printf("  add r%d, r%d\n", ins->lhs, ins->rhs);
-      break;
-    case IR_SUB:
-      printf("  sub r%d, r%d\n", ins->lhs, ins->rhs);
-      break;
-    case IR_MUL:
-      printf("  mul r%d, r%d\n", ins->lhs, ins->rhs);
-      break;
-    case IR_DIV:
-      printf("  div r%d, r%d\n", ins->lhs, ins->rhs);
-      break;
-    case IR_GREAT:
-      printf("  great r%d, r%d", ins->lhs, ins->rhs);
-      break;
-    case IR_LESS:
-      printf("  less r%d, r%d\n", ins->lhs, ins->rhs);
-      break;
-    case IR_STORE:
-      printf("  store [r%d], r%d\n", ins->lhs, ins->rhs);
-      break;
-    case IR_LOAD:
-      printf("  load r%d, [r%d]\n", ins->lhs, ins->rhs);
-      break;
-    case IR_CALL:
-      printf("  call %s\n", ins->name);
-      break;
-    case IR_FUNC:
-      printf("func %s:\n", ins->name);
-      break;
-    case IR_LABEL:
-      printf(".L%d:\n", ins->lhs);
-      break;
-    case IR_LABEL_BB:
-      printf(".LBB%d\n", ins->lhs);
-      break;
-    case IR_LABEL_BBEND:
-      printf(".LBB_END%d\n", ins->lhs);
-      break;
-    case IR_LABEL_BBSTART:
-      printf(".LBB_START%d\n", ins->lhs);
-      break;
-    case IR_ALLOC:
-      printf("  alloc %d\n", ins->lhs);
-      break;
-    case IR_FREE:
-      printf("  free %d\n", ins->lhs);
-      break;
-    case IR_RET:
-      printf("  ret r%d\n", ins->lhs);
-      break;
-    case IR_JTRUE:
-      printf("  jtrue r%d, .L%d\n", ins->lhs, ins->rhs);
-      break;
-    case IR_JTRUE_BB:
-      printf("  jtrue r%d, .LBB%d\n", ins->lhs, ins->rhs);
-      break;
-    case IR_JTRUE_BBEND:
-      printf("  jtrue r%d, .LBB_END%d\n", ins->lhs, ins->rhs);
-      break;
-    case IR_JZERO:
-      printf("  jzero r%d, .L%d\n", ins->lhs, ins->rhs);
-      break;
-    case IR_JZERO_BB:
-      printf("  jzero r%d, .LBB%d\n", ins->lhs, ins->rhs);
-      break;
-    case IR_JZERO_BBEND:
-      printf("  jzero r%d, .LBB_END%d\n", ins->lhs, ins->rhs);
-      break;
-    case IR_JMP:
-      printf("  jmp .L%d\n", ins->lhs);
-      break;
-    case IR_JMP_BB:
-      printf("  jmp .LBB%d\n", ins->lhs);
-      break;
-    case IR_JMP_BBEND:
-      printf("  jmp .LBB_END%d\n", ins->lhs);
-      break;
-    case IR_JMP_BBSTART:
-      printf("  jmp .LBB_START%d\n", ins->lhs);
-      break;
-    case IR_STORE_VAR:
-      printf("  store_var v%d, r%d\n", ins->lhs, ins->rhs);
-      break;
-    case IR_LOAD_VAR:
-      printf("  load_var r%d, v%d\n", ins->lhs, ins->rhs);
-      break;
-    case IR_LEAVE:
-      printf("  leave\n");
-      break;
-    case IR_LOAD_CONST:
-      printf("  load_const r%d, c%d\n", ins->lhs, ins->rhs);
-      break;
-    case IR_PTR_CAST:
-      printf("  ptr_cast r%d\n", ins->lhs);
-      break;
-    case IR_LOAD_ADDR_VAR:
-      printf("  load_addr_var r%d, v%d\n", ins->lhs, ins->rhs);
-      break;
-    case IR_PUSH:
-      printf("  push r%d\n", ins->lhs);
-      break;
-    case IR_POP:
-      printf("  pop r%d\n", ins->lhs);
-      break;
-    case IR_LOAD_GVAR:
-      printf("  load_gvar r%d, %s\n", ins->lhs, ins->name);
-      break;
-    case IR_LOAD_ADDR_GVAR:
-      printf("  load_addr_gvar r%d, %s\n", ins->lhs, ins->name);
-      break;
-    case IR_EQ:
-      printf("  eq r%d, r%d\n", ins->lhs, ins->rhs);
-      break;
-    case IR_NEQ:
-      printf("  neq r%d, r%d\n", ins->lhs, ins->rhs);
-      break;
-    default:
-      error("Unknown operator: %d", ins->op);
+  for (int i = 0; i < vec_len(ir->funcs); i++) {
+    func_t *func = vec_get(ir->funcs, i);
+    printf("func %s:\n", func->name);
+    if (func->cached) {
+      printf("  (cached)\n");
+      continue;
+    }
+    for (int j = 0; j < vec_len(func->bbs); j++) {
+      bb_t *bb = vec_get(func->bbs, j);
+      printf(".L%d:", bb->label);
+      for (int k = 0; k < bb->npreds; k++)
+        printf("%s.L%d", k ? ", " : " ; preds ", bb->preds[k]->label);
+      printf("\n");
+      for (int k = 0; k < bb->nins; k++)
+        print_ins(&bb->ins[k]);
     }
   }
-
-  return;
 }
@@ -1,9 +1,267 @@
 #include "sicc.h"
 
 #include <ctype.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+
+static bool stats = false;
+static bool stream = false;
+static bool object = false;
+static char *pch_path;
+// The connection of the compile server's current client, or -1.
+static int client_fd = -1;
+
+// Runs the front end and the IR generator on `filename` in the current
+// context.
+static ir_t *gen_file(char *filename) {
+  if (pch_path) {
+    phase_begin("pch");
+    ctx->pch = load_pch(pch_path);
+    event_end();
+  }
+  char *s = read_file(filename);
+  if (stream) {
+    // Preprocess and lex on demand as the parser consumes tokens, so all
+    // three are one phase.
+    phase_begin("parse");
+    tokenize_stream(pp_open(s, filename));
+  } else {
+    phase_begin("preprocess");
+    char *p = preprocess(s, filename, NULL);
+    event_end();
+    phase_begin("tokenize");
+    tokenize(p);
+    event_end();
+    phase_begin("parse");
+  }
+  node_t *node = parse();
+  ctx->ntokens = ctx->tokens->len;
+  arena_release(ctx->token_arena);
+  event_end();
+  phase_begin("sema");
+  sema(node);
+  event_end();
+  phase_begin("irgen");
+  ir_t *ir = new_ir();
+  gen_ir(ir, node);
+  event_end();
+  return ir;
+}
+
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Statistics go to stderr, or to the client when the compile server runs the
+// command. Files compiled in parallel report one at a time.
+static void report_stats() {
+  out_t *out = out_mem();
+  print_stats(out);
+  out_flush(out);
+  pthread_mutex_lock(&stats_lock);
+  if (client_fd >= 0)
+    write_frame(client_fd, 'e', out->mem->data, out->mem->len);
+  else
+    fwrite(out->mem->data, 1, out->mem->len, stderr);
+  pthread_mutex_unlock(&stats_lock);
+  out_close(out);
+}
+
+// Compiles one translation unit with a context of its own. A NULL `outfile`
+// means stdout.
+static void compile(char *filename, char *outfile) {
+  ctx = new_ctx();
+  file_begin(filename);
+  ir_t *ir = gen_file(filename);
+  phase_begin(object ? "objgen" : "asmgen");
+  out_t *out;
+  if (!outfile && client_fd >= 0)
+    out = out_frames(client_fd, 'o');
+  else
+    out = out_open(outfile);
+  if (object)
+    gen_obj(ir, out);
+  else
+    gen_asm(ir, out);
+  out_close(out);
+  event_end();
+  event_end();
+  arena_release(ctx->ir_arena);
+  arena_release(ctx->ast_arena);
+  if (stats)
+    report_stats();
+  flush_trace();
+  free_ctx(ctx);
+  ctx = NULL;
+}
+
+// foo/bar.c -> bar.s, or bar.o with -c
+static char *output_name(char *filename) {
+  char *base = strrchr(filename, '/');
+  base = base ? base + 1 : filename;
+  int len = strlen(base);
+  if (len > 2 && !strcmp(base + len - 2, ".c"))
+    len -= 2;
+  return format("%.*s%s", len, base, object ? ".o" : ".s");
+}
+
+static vec_t *inputs;
+static int next_input = 0;
+static pthread_mutex_t input_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void *compile_worker(void *arg) {
+  for (;;) {
+    pthread_mutex_lock(&input_lock);
+    int i = next_input++;
+    pthread_mutex_unlock(&input_lock);
+    if (i >= vec_len(inputs))
+      return NULL;
+    char *filename = vec_get(inputs, i);
+    char *outfile = output_name(filename);
+    compile(filename, outfile);
+    free(outfile);
+  }
+}
+
+// Compiles every input on a pool of one thread per core.
+static void compile_all() {
+  int nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+  if (nthreads < 1)
+    nthreads = 1;
+  if (nthreads > vec_len(inputs))
+    nthreads = vec_len(inputs);
+  pthread_t *threads = calloc(nthreads, sizeof(pthread_t));
+  for (int i = 0; i < nthreads; i++) {
+    if (pthread_create(&threads[i], NULL, compile_worker, NULL))
+      error("Cannot create a compile thread");
+  }
+  for (int i = 0; i < nthreads; i++)
+    pthread_join(threads[i], NULL);
+  free(threads);
+}
+
+// Parses the options of a compile command and runs it. `client` is the
+// connection the compile server runs the command for, or -1 to run it in
+// this process.
+int run_command(int argc, char **argv, int client) {
+  stats = false;
+  stream = false;
+  object = false;
+  pch_path = NULL;
+  client_fd = client;
+  // The compile server runs one command after another in this process.
+  if (inputs)
+    free_vec(inputs);
+  inputs = new_vec();
+  next_input = 0;
+  vec_t *include_paths = new_vec();
+  char *outfile = NULL;
+  bool run = false;
+  bool emit = false;
+  char *cache_dir = NULL;
+  char *trace_path = NULL;
+  int prog_argc = 0;
+  char **prog_argv = NULL;
+  for (int i = 1; i < argc; i++) {
+    if (!strcmp(argv[i], "--stats")) {
+      stats = true;
+    } else if (!strcmp(argv[i], "--trace-json")) {
+      if (++i == argc)
+        error("Missing output file after --trace-json");
+      trace_path = argv[i];
+    } else if (!strcmp(argv[i], "--stream")) {
+      stream = true;
+    } else if (!strcmp(argv[i], "--run")) {
+      // The file and everything after it are the program's arguments.
+      if (++i == argc)
+        error("Missing input file after --run");
+      run = true;
+      vec_push(inputs, argv[i]);
+      prog_argc = argc - i;
+      prog_argv = argv + i;
+      break;
+    } else if (!strcmp(argv[i], "--emit-pch")) {
+      emit = true;
+    } else if (!strcmp(argv[i], "-include-pch")) {
+      if (++i == argc)
+        error("Missing file after -include-pch");
+      pch_path = argv[i];
+    } else if (!strcmp(argv[i], "--cache-dir")) {
+      if (++i == argc)
+        error("Missing directory after --cache-dir");
+      cache_dir = argv[i];
+    } else if (!strcmp(argv[i], "-c")) {
+      object = true;
+    } else if (!strcmp(argv[i], "-o")) {
+      if (++i == argc)
+        error("Missing output file after -o");
+      outfile = argv[i];
+    } else if (!strcmp(argv[i], "-I")) {
+      if (++i == argc)
+        error("Missing directory after -I");
+      vec_push(include_paths, argv[i]);
+    } else if (!strncmp(argv[i], "-I", 2)) {
+      vec_push(include_paths, argv[i] + 2);
+    } else {
+      vec_push(inputs, argv[i]);
+    }
+  }
+  if (vec_len(inputs) == 0)
+    error("Missing input file");
+  set_include_paths(include_paths);
+  set_tracing(trace_path != NULL);
+  // Only assembly output is cached.
+  set_cache_dir(object || run ? NULL : cache_dir);
+
+  if (emit) {
+    if (vec_len(inputs) > 1 || !outfile)
+      error("--emit-pch takes one header and -o");
+    ctx = new_ctx();
+    emit_pch(vec_get(inputs, 0), outfile);
+    free_ctx(ctx);
+    ctx = NULL;
+    return 0;
+  }
+
+  if (run) {
+    if (client >= 0)
+      error("--run cannot be used with the compile server");
+    if (vec_len(inputs) > 1)
+      error("--run takes a single input file");
+    ctx = new_ctx();
+    file_begin(vec_get(inputs, 0));
+    ir_t *ir = gen_file(vec_get(inputs, 0));
+    event_end();
+    if (stats)
+      report_stats();
+    flush_trace();
+    if (trace_path)
+      write_trace(trace_path);
+    return run_jit(ir, prog_argc, prog_argv);
+  }
+
+  // A single input goes to -o or stdout; several are compiled in parallel,
+  // each into its own file.
+  if (vec_len(inputs) == 1) {
+    compile(vec_get(inputs, 0), outfile);
+  } else if (outfile) {
+    error("-o cannot be used with multiple input files");
+  } else if (client >= 0) {
+    // The server keeps one set of caches, so it compiles one file at a time.
+    for (int i = 0; i < vec_len(inputs); i++) {
+      char *filename = vec_get(inputs, i);
+      char *outfile = output_name(filename);
+      compile(filename, outfile);
+      free(outfile);
+    }
+  } else {
+    compile_all();
+  }
+  if (trace_path)
+    write_trace(trace_path);
+  return 0;
+}
 
 int main(int argc, char **argv) {
   if (argc < 2) {
@@ -12,22 +270,24 @@ int main(int argc, char **argv) {
 
   char *arg = argv[1];
   if (!strcmp(arg, "--debug")) {
+    ctx = new_ctx();
     debug(argv[2]);
     return 0;
   } else if (!strcmp(arg, "--dump-ir")) {
     if (argc < 3)
       return 1;
+    ctx = new_ctx();
     debug_ir(argv[2]);
     return 0;
+  } else if (!strcmp(arg, "--server")) {
+    run_server();
+    return 0;
+  } else if (!strcmp(arg, "--client")) {
+    // Hand the command to a running server, or compile here without one.
+    int status = run_client(argc - 1, argv + 1);
+    if (status >= 0)
+      return status;
+    return run_command(argc - 1, argv + 1, -1);
   }
-
-  char *s = read_file(arg);
-  char *p = preprocess(s, arg, NULL);
-  tokenize(p);
-  node_t *node = parse();
-  sema(node);
-  ir_t *ir = new_ir();
-  gen_ir(ir, node);
-  gen_asm(ir);
-  return 0;
+  return run_command(argc, argv, -1);
 }
@@ -0,0 +1,906 @@
+#include "sicc.h"
+
+#include <assert.h>
+#include <dlfcn.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+// Encodes the instructions asmgen.c prints and either writes them as an
+// ELF64 relocatable object, so no external assembler is needed, or loads them
+// into memory and runs them.
+
+// Hardware numbers of the registers in asmgen.c's tables.
+static const int regs[] = {10, 11, 3, 12, 13, 14, 15, 0, 7};
+static const int arg_regs[] = {7, 6, 2, 1, 8, 9};
+
+#define RAX 0
+#define RSP 4
+#define RBP 5
+
+// Section header indices. The section symbols use the same indices.
+#define SEC_TEXT 1
+#define SEC_DATA 2
+#define SEC_RODATA 3
+#define SEC_RELA_TEXT 4
+#define SEC_RELA_DATA 5
+#define SEC_SYMTAB 6
+#define SEC_STRTAB 7
+#define SEC_NOTE_STACK 8
+#define SEC_SHSTRTAB 9
+#define NSECTIONS 10
+
+#define SHN_COMMON 0xfff2
+
+#define R_X86_64_64 1
+#define R_X86_64_PC32 2
+#define R_X86_64_PLT32 4
+
+typedef struct {
+  char *name;
+  int sec; // 0 while undefined
+  int value;
+  int size;
+  bool global;
+  bool func;
+  int index; // position in .symtab, or stub/common slot in run_jit()
+  char *addr; // when loaded by run_jit()
+} obj_sym_t;
+
+typedef struct {
+  int offset;
+  int type;
+  obj_sym_t *sym; // NULL for a reference to .rodata
+  long addend;
+} reloc_t;
+
+typedef struct {
+  int offset; // of the rel32 field
+  int label;
+} fixup_t;
+
+// State of one assemble() call. Each compiling thread has its own.
+static THREAD_LOCAL buf_t *text;
+static THREAD_LOCAL buf_t *data;
+static THREAD_LOCAL buf_t *rodata;
+static THREAD_LOCAL vec_t *text_relocs;
+static THREAD_LOCAL vec_t *data_relocs;
+static THREAD_LOCAL vec_t *fixups; // jumps of the current function
+static THREAD_LOCAL map_t *syms;
+static THREAD_LOCAL vec_t *lc_refs; // (data offset, string index) pairs
+static THREAD_LOCAL int *lc_offset;
+static THREAD_LOCAL int *block_at; // text offset of each block of it
+static THREAD_LOCAL func_t *cur_func;
+
+// Little-endian
+static void put(buf_t *b, long v, int size) {
+  for (int i = 0; i < size; i++) {
+    buf_push(b, v & 0xff);
+    v >>= 8;
+  }
+  return;
+}
+
+static void pad_to(buf_t *b, int align) {
+  while (b->len % align)
+    buf_push(b, 0);
+}
+
+static void patch32(buf_t *b, int offset, int v) {
+  for (int i = 0; i < 4; i++)
+    b->data[offset + i] = (v >> (i * 8)) & 0xff;
+  return;
+}
+
+static void byte(int c) { buf_push(text, c); }
+
+static obj_sym_t *get_sym(char *name) {
+  obj_sym_t *sym = map_get(syms, name);
+  if (sym)
+    return sym;
+  sym = arena_alloc(ctx->ir_arena, sizeof(obj_sym_t));
+  sym->name = name;
+  sym->global = true;
+  map_put(syms, name, sym);
+  return sym;
+}
+
+static void add_reloc(vec_t *relocs, int offset, int type, obj_sym_t *sym,
+                      long addend) {
+  reloc_t *r = arena_alloc(ctx->ir_arena, sizeof(reloc_t));
+  r->offset = offset;
+  r->type = type;
+  r->sym = sym;
+  r->addend = addend;
+  vec_push(relocs, r);
+}
+
+static int op_size(ins_t *ins) {
+  int size = ins->size;
+  if (size != 1 && size != 2 && size != 4 && size != 8)
+    error("Undefined size: %d op: %d", size, ins->op);
+  return size;
+}
+
+// Byte registers 4-7 mean spl/bpl/sil/dil only under a REX prefix.
+static bool needs_rex8(int r) { return r >= 4 && r < 8; }
+
+static void prefix(int size, int reg, int rm, bool force_rex) {
+  if (size == 2)
+    byte(0x66);
+  int rex = (size == 8) << 3 | (reg & 8) >> 1 | (rm & 8) >> 3;
+  if (rex || force_rex)
+    byte(0x40 | rex);
+}
+
+static void modrm_reg(int reg, int rm) {
+  byte(0xc0 | (reg & 7) << 3 | (rm & 7));
+}
+
+static void modrm_mem(int reg, int base, int disp) {
+  int mod = 2;
+  if (disp == 0 && (base & 7) != RBP)
+    mod = 0;
+  else if (disp >= -128 && disp < 128)
+    mod = 1;
+  byte(mod << 6 | (reg & 7) << 3 | (base & 7));
+  if ((base & 7) == RSP)
+    byte(0x24);
+  if (mod == 1)
+    byte(disp & 0xff);
+  else if (mod == 2)
+    put(text, disp, 4);
+}
+
+// [rip+sym]
+static void modrm_rip(int reg, obj_sym_t *sym, vec_t *relocs) {
+  byte((reg & 7) << 3 | 5);
+  add_reloc(relocs, text->len, R_X86_64_PC32, sym, -4);
+  put(text, 0, 4);
+}
+
+// `op` is the opcode of the 16/32/64-bit form; the byte form is op - 1.
+static void op_rr(int op, int size, int dst, int src) {
+  prefix(size, src, dst, size == 1 && (needs_rex8(src) || needs_rex8(dst)));
+  byte(size == 1 ? op - 1 : op);
+  modrm_reg(src, dst);
+}
+
+static void store(int size, int base, int disp, int src) {
+  prefix(size, src, base, size == 1 && needs_rex8(src));
+  byte(size == 1 ? 0x88 : 0x89);
+  modrm_mem(src, base, disp);
+}
+
+// A char or short is sign-extended to 32 bits, which clears the rest of the
+// register, so that the value reads the same at any size:
+//   movsx r32, byte/word ptr [mem], or mov r, [mem]
+static void load_op(int size, int dst, int base) {
+  if (size < 4) {
+    prefix(4, dst, base, false);
+    byte(0x0f);
+    byte(size == 1 ? 0xbe : 0xbf);
+    return;
+  }
+  prefix(size, dst, base, false);
+  byte(0x8b);
+}
+
+static void load(int size, int dst, int base, int disp) {
+  load_op(size, dst, base);
+  modrm_mem(dst, base, disp);
+}
+
+static void mov_imm(int size, int dst, int imm) {
+  if (size == 8) {
+    prefix(8, 0, dst, false);
+    byte(0xc7);
+    modrm_reg(0, dst);
+    put(text, imm, 4);
+    return;
+  }
+  prefix(size, 0, dst, size == 1 && needs_rex8(dst));
+  byte((size == 1 ? 0xb0 : 0xb8) | (dst & 7));
+  put(text, imm, size);
+}
+
+// add (ext 0), sub (ext 5) or cmp (ext 7) with an immediate.
+static void alu_imm(int ext, int size, int dst, int imm) {
+  prefix(size, 0, dst, size == 1 && needs_rex8(dst));
+  if (size == 1) {
+    byte(0x80);
+    modrm_reg(ext, dst);
+    byte(imm & 0xff);
+  } else if (imm >= -128 && imm < 128) {
+    byte(0x83);
+    modrm_reg(ext, dst);
+    byte(imm & 0xff);
+  } else {
+    byte(0x81);
+    modrm_reg(ext, dst);
+    put(text, imm, size == 2 ? 2 : 4);
+  }
+}
+
+// Unary group 3 instruction on a 64-bit register: neg (3), mul (4), div (6).
+static void unary64(int ext, int r) {
+  prefix(8, 0, r, false);
+  byte(0xf7);
+  modrm_reg(ext, r);
+}
+
+static void push(int r) {
+  if (r & 8)
+    byte(0x41);
+  byte(0x50 | (r & 7));
+}
+
+static void pop(int r) {
+  if (r & 8)
+    byte(0x41);
+  byte(0x58 | (r & 7));
+}
+
+// movzx with a byte or word source. A byte "movzx" to a byte register is a
+// plain move.
+static void movzx(int size, int dst, int src, int src_size) {
+  if (size == src_size) {
+    op_rr(0x89, size, dst, src);
+    return;
+  }
+  prefix(size, dst, src, src_size == 1 && needs_rex8(src));
+  byte(0x0f);
+  byte(src_size == 1 ? 0xb6 : 0xb7);
+  modrm_reg(dst, src);
+}
+
+// setcc al; movzx dst, al; mov al, 0. The flag is widened to at least 32
+// bits, which clears the rest of the register, so that it reads the same at
+// any size.
+static void set_flag(int cc, int size, int dst) {
+  byte(0x0f);
+  byte(0x90 | cc);
+  byte(0xc0);
+  movzx(size < 4 ? 4 : size, dst, RAX, 1);
+  byte(0xb0);
+  byte(0);
+}
+
+#define CC_E 0x4
+#define CC_NE 0x5
+#define CC_L 0xc
+#define CC_GE 0xd
+#define CC_LE 0xe
+#define CC_G 0xf
+
+static void compare(ins_t *ins, int cc) {
+  int size = op_size(ins);
+  op_rr(0x39, size, regs[ins->lhs], regs[ins->rhs]);
+  set_flag(cc, size, regs[ins->lhs]);
+}
+
+static void jump(int op, int label) {
+  if (op == 0xe9) {
+    byte(0xe9);
+  } else {
+    byte(0x0f);
+    byte(op);
+  }
+  fixup_t *f = arena_alloc(ctx->ir_arena, sizeof(fixup_t));
+  f->offset = text->len;
+  f->label = label;
+  vec_push(fixups, f);
+  put(text, 0, 4);
+}
+
+static void test_jump(int r, int op, int label) {
+  op_rr(0x85, 8, r, r);
+  jump(op, label);
+}
+
+#define JMP 0xe9
+#define JZ 0x84
+#define JNZ 0x85
+
+static void init_global_var(ir_t *ir, node_t *init, type_t *ty) {
+  // A scalar takes the size of the object it initializes.
+  if (init->ty == ND_NUM) {
+    put(data, init->num, ty->size);
+    return;
+  }
+  if (init->ty == ND_CHARACTER) {
+    put(data, *(init->str), ty->size);
+    return;
+  }
+  if (init->ty == ND_STRING) {
+    vec_push(ir->const_str, init->str);
+    vec_push(lc_refs, (void *)(intptr_t)data->len);
+    vec_push(lc_refs, (void *)(intptr_t)(vec_len(ir->const_str) - 1));
+    put(data, 0, 8);
+    return;
+  }
+  if (init->ty == ND_INITIALIZER) {
+    for (int i = 0; i < init->nlist; i++) {
+      if (ty->ty != TY_STRUCT) {
+        init_global_var(ir, child(init, i), ty->ptr);
+        continue;
+      }
+      init_global_var(ir, child(init, i), vec_get(ty->member->data->items, i));
+      int pad = padding_after(ty, i);
+      if (pad > 0)
+        put(data, 0, pad);
+    }
+    return;
+  }
+  if (init->ty == ND_IDENT) {
+    gvar_t *gvar = map_get(ir->gvars, init->str);
+    if (!gvar) {
+      error("%s is not defined as global variable", init->str);
+    }
+    if (!gvar->is_null) {
+      error("Cannot initialize global var with %s", init->str);
+    }
+    init_global_var(ir, gvar->init, gvar->type);
+    return;
+  }
+
+  error("Cannot initialize global var with %d", init->ty);
+  return;
+}
+
+static void gen_data(ir_t *ir) {
+  int ngvars = map_len(ir->gvars);
+  for (int i = 0; i < ngvars; i++) {
+    gvar_t *gvar = vec_get(ir->gvars->items, i);
+    obj_sym_t *sym = get_sym(gvar->name);
+    sym->size = gvar->size;
+    if (gvar->is_null) {
+      // Common symbols are always global, as with .comm.
+      sym->sec = SHN_COMMON;
+      sym->value = gvar->align;
+      continue;
+    }
+    sym->global = !gvar->statical;
+    sym->sec = SEC_DATA;
+    pad_to(data, gvar->align);
+    sym->value = data->len;
+    init_global_var(ir, gvar->init, gvar->type);
+  }
+}
+
+// String literals keep their source escapes; decode them as `as` would.
+static void gen_rodata(ir_t *ir) {
+  int nconsts = vec_len(ir->const_str);
+  lc_offset = arena_alloc(ctx->ir_arena, (nconsts + 1) * sizeof(int));
+  for (int i = 0; i < nconsts; i++) {
+    lc_offset[i] = rodata->len;
+    char *s = vec_get(ir->const_str, i);
+    while (*s) {
+      char c = *s++;
+      buf_push(rodata, get_escape_char(c, &s));
+    }
+    buf_push(rodata, '\0');
+  }
+
+  for (int i = 0; i < vec_len(lc_refs); i += 2) {
+    int offset = (intptr_t)vec_get(lc_refs, i);
+    int lc = (intptr_t)vec_get(lc_refs, i + 1);
+    add_reloc(data_relocs, offset, R_X86_64_64, NULL, lc_offset[lc]);
+  }
+}
+
+// Saves or restores rbx and r12 to r15, as far as the function writes them.
+static void save_regs(bool restore) {
+  for (int r = 2; r < cur_func->nregs && r < 7; r++) {
+    int offset = -cur_func->save_offset + 8 * (r - 2);
+    if (restore)
+      load(8, regs[r], RBP, offset);
+    else
+      store(8, RBP, offset, regs[r]);
+  }
+}
+
+static void gen_ins(ins_t *ins) {
+  int lhs = ins->lhs;
+  int rhs = ins->rhs;
+
+  switch (ins->op) {
+  case IR_MOV_IMM:
+    mov_imm(op_size(ins), regs[lhs], rhs);
+    break;
+  case IR_MOV_RETVAL:
+    op_rr(0x89, 8, regs[lhs], RAX);
+    break;
+  case IR_STORE_ARG:
+    if (lhs < 6)
+      op_rr(0x89, op_size(ins), arg_regs[lhs], regs[rhs]);
+    else
+      push(regs[rhs]);
+    break;
+  case IR_LOAD_ARG:
+    if (rhs < 6)
+      store(op_size(ins), RBP, -lhs, arg_regs[rhs]);
+    break;
+  case IR_MOV_ARG:
+    assert(0 <= rhs && rhs < 6);
+    op_rr(0x89, op_size(ins), regs[lhs], arg_regs[rhs]);
+    break;
+  case IR_ADD:
+    op_rr(0x01, op_size(ins), regs[lhs], regs[rhs]);
+    break;
+  case IR_SUB:
+    op_rr(0x29, op_size(ins), regs[lhs], regs[rhs]);
+    break;
+  case IR_MUL:
+    push(2);
+    op_rr(0x89, 8, RAX, regs[lhs]);
+    unary64(4, regs[rhs]);
+    op_rr(0x01, 8, RAX, 2);
+    op_rr(0x89, op_size(ins), regs[lhs], RAX);
+    pop(2);
+    break;
+  case IR_DIV:
+    push(2);
+    op_rr(0x89, 8, RAX, regs[lhs]);
+    byte(0x48);
+    byte(0x99);
+    unary64(6, regs[rhs]);
+    op_rr(0x89, op_size(ins), regs[lhs], RAX);
+    pop(2);
+    break;
+  case IR_GREAT:
+    compare(ins, CC_G);
+    break;
+  case IR_LESS:
+    compare(ins, CC_L);
+    break;
+  case IR_GREAT_EQ:
+    compare(ins, CC_GE);
+    break;
+  case IR_LESS_EQ:
+    compare(ins, CC_LE);
+    break;
+  case IR_EQ:
+    compare(ins, CC_E);
+    break;
+  case IR_NEQ:
+    compare(ins, CC_NE);
+    break;
+  case IR_NOT:
+    alu_imm(7, 8, regs[lhs], 0);
+    set_flag(CC_E, 8, regs[lhs]);
+    break;
+  case IR_STORE:
+    store(op_size(ins), regs[lhs], 0, regs[rhs]);
+    break;
+  case IR_LOAD:
+    load(op_size(ins), regs[lhs], regs[rhs], 0);
+    break;
+  case IR_CALL:
+    byte(0xe8);
+    add_reloc(text_relocs, text->len, R_X86_64_PLT32, get_sym(ins->name), -4);
+    put(text, 0, 4);
+    break;
+  case IR_FREE:
+    alu_imm(0, 8, RSP, lhs);
+    break;
+  case IR_RET:
+    op_rr(0x89, 8, RAX, regs[lhs]);
+    break;
+  case IR_JTRUE:
+    test_jump(regs[lhs], JNZ, rhs);
+    break;
+  case IR_JZERO:
+    test_jump(regs[lhs], JZ, rhs);
+    break;
+  case IR_JMP:
+    jump(JMP, lhs);
+    break;
+  case IR_STORE_VAR:
+    store(op_size(ins), RBP, -lhs, regs[rhs]);
+    break;
+  case IR_LOAD_VAR:
+    load(op_size(ins), regs[lhs], RBP, -rhs);
+    break;
+  case IR_LEAVE:
+    save_regs(true);
+    byte(0xc9);
+    byte(0xc3);
+    break;
+  case IR_LOAD_CONST:
+    if (op_size(ins) == 1)
+      error("Cannot load an address into a byte register");
+    prefix(ins->size, regs[lhs], 0, false);
+    byte(0x8d);
+    byte((regs[lhs] & 7) << 3 | 5);
+    add_reloc(text_relocs, text->len, R_X86_64_PC32, NULL,
+              lc_offset[rhs] - 4);
+    put(text, 0, 4);
+    break;
+  case IR_PTR_CAST: {
+    // lea reg, [0+rax*size]
+    int scale = 0;
+    while ((1 << scale) < op_size(ins))
+      scale++;
+    op_rr(0x89, 8, RAX, regs[lhs]);
+    prefix(8, regs[lhs], 0, false);
+    byte(0x8d);
+    byte((regs[lhs] & 7) << 3 | 4);
+    byte(scale << 6 | RAX << 3 | 5);
+    put(text, 0, 4);
+  } break;
+  case IR_LOAD_ADDR_VAR:
+    prefix(8, regs[lhs], RBP, false);
+    byte(0x8d);
+    modrm_mem(regs[lhs], RBP, -rhs);
+    break;
+  case IR_PUSH:
+    push(regs[lhs]);
+    break;
+  case IR_POP:
+    pop(regs[lhs]);
+    break;
+  case IR_LOAD_GVAR: {
+    load_op(op_size(ins), regs[lhs], 0);
+    modrm_rip(regs[lhs], get_sym(ins->name), text_relocs);
+  } break;
+  case IR_LOAD_ADDR_GVAR:
+    prefix(8, regs[lhs], 0, false);
+    byte(0x8d);
+    modrm_rip(regs[lhs], get_sym(ins->name), text_relocs);
+    break;
+  case IR_ADD_IMM:
+    alu_imm(0, op_size(ins), regs[lhs], rhs);
+    break;
+  case IR_SUB_IMM:
+    alu_imm(5, op_size(ins), regs[lhs], rhs);
+    break;
+  case IR_MOV:
+    op_rr(0x89, op_size(ins), regs[lhs], regs[rhs]);
+    break;
+  case IR_LOGAND:
+    op_rr(0x21, op_size(ins), regs[lhs], regs[rhs]);
+    set_flag(CC_NE, ins->size, regs[lhs]);
+    break;
+  case IR_LOGOR:
+    op_rr(0x09, op_size(ins), regs[lhs], regs[rhs]);
+    set_flag(CC_NE, ins->size, regs[lhs]);
+    break;
+  case IR_CAST:
+    if (ins->size < rhs) {
+      // There is no movzx from a dword; a 32-bit move zero-extends.
+      if (op_size(ins) == 4)
+        op_rr(0x89, 4, regs[lhs], regs[lhs]);
+      else
+        movzx(8, regs[lhs], regs[lhs], ins->size);
+    }
+    break;
+  case IR_NEG:
+    unary64(3, regs[lhs]);
+    break;
+  default:
+    error("Unknown IR type: %d", ins->op);
+  }
+}
+
+static void gen_func(func_t *func, bool global) {
+  obj_sym_t *sym = get_sym(func->name);
+  sym->sec = SEC_TEXT;
+  sym->value = text->len;
+  sym->func = true;
+  sym->global = global;
+  push(RBP);
+  op_rr(0x89, 8, RBP, RSP);
+  alu_imm(5, 8, RSP, func->stack_size);
+  cur_func = func;
+  save_regs(false);
+
+  int nbbs = vec_len(func->bbs);
+  block_at = calloc(nbbs, sizeof(int));
+  fixups = new_vec();
+  for (int i = 0; i < nbbs; i++) {
+    bb_t *bb = vec_get(func->bbs, i);
+    block_at[i] = text->len;
+    for (int j = 0; j < bb->nins; j++)
+      gen_ins(&bb->ins[j]);
+  }
+  for (int i = 0; i < vec_len(fixups); i++) {
+    fixup_t *f = vec_get(fixups, i);
+    patch32(text, f->offset, block_at[f->label] - (f->offset + 4));
+  }
+  free(block_at);
+  sym->size = text->len - sym->value;
+}
+
+static void gen_text(ir_t *ir) {
+  map_t *gfuncs = new_map();
+  for (int i = 0; i < vec_len(ir->gfuncs); i++)
+    map_put(gfuncs, vec_get(ir->gfuncs, i), NULL);
+  for (int i = 0; i < vec_len(ir->funcs); i++) {
+    func_t *func = vec_get(ir->funcs, i);
+    gen_func(func, map_find(gfuncs, func->name));
+  }
+}
+
+static int add_str(buf_t *strtab, char *s) {
+  int offset = strtab->len;
+  buf_appendn(strtab, s, strlen(s) + 1);
+  return offset;
+}
+
+static void put_sym(buf_t *b, int name, int info, int shndx, long value,
+                    long size) {
+  put(b, name, 4);
+  put(b, info, 1);
+  put(b, 0, 1);
+  put(b, shndx, 2);
+  put(b, value, 8);
+  put(b, size, 8);
+}
+
+static void put_relocs(buf_t *b, vec_t *relocs) {
+  for (int i = 0; i < vec_len(relocs); i++) {
+    reloc_t *r = vec_get(relocs, i);
+    long sym = r->sym ? r->sym->index : SEC_RODATA;
+    put(b, r->offset, 8);
+    put(b, sym << 32 | r->type, 8);
+    put(b, r->addend, 8);
+  }
+}
+
+static void put_shdr(buf_t *b, int name, int type, long flags, long offset,
+                     long size, int link, int info, long align, long entsize) {
+  put(b, name, 4);
+  put(b, type, 4);
+  put(b, flags, 8);
+  put(b, 0, 8);
+  put(b, offset, 8);
+  put(b, size, 8);
+  put(b, link, 4);
+  put(b, info, 4);
+  put(b, align, 8);
+  put(b, entsize, 8);
+}
+
+static void write_elf(out_t *out) {
+  // Symbol table: null, section symbols, locals, then globals.
+  buf_t *symtab = new_buf();
+  buf_t *strtab = new_buf();
+  buf_push(strtab, '\0');
+  put_sym(symtab, 0, 0, 0, 0, 0);
+  for (int sec = SEC_TEXT; sec <= SEC_RODATA; sec++)
+    put_sym(symtab, 0, 3, sec, 0, 0);
+  int nsyms = 1 + SEC_RODATA;
+  int first_global = 0;
+  for (int pass = 0; pass < 2; pass++) {
+    if (pass == 1)
+      first_global = nsyms;
+    for (int i = 0; i < map_len(syms); i++) {
+      obj_sym_t *sym = vec_get(syms->items, i);
+      if (sym->global != pass)
+        continue;
+      int type = sym->func ? 2 : (sym->sec ? 1 : 0);
+      sym->index = nsyms++;
+      put_sym(symtab, add_str(strtab, sym->name), sym->global << 4 | type,
+              sym->sec, sym->value, sym->size);
+    }
+  }
+
+  buf_t *rela_text = new_buf();
+  buf_t *rela_data = new_buf();
+  put_relocs(rela_text, text_relocs);
+  put_relocs(rela_data, data_relocs);
+
+  buf_t *shstrtab = new_buf();
+  buf_push(shstrtab, '\0');
+  char *names[] = {"", ".text", ".data", ".rodata", ".rela.text", ".rela.data",
+                   ".symtab", ".strtab", ".note.GNU-stack", ".shstrtab"};
+  int name_off[NSECTIONS];
+  for (int i = 1; i < NSECTIONS; i++)
+    name_off[i] = add_str(shstrtab, names[i]);
+
+  buf_t *contents[] = {NULL, text, data, rodata, rela_text, rela_data,
+                       symtab, strtab, new_buf(), shstrtab};
+  buf_t *elf = new_buf();
+  put(elf, 0x464c457f, 4); // "\x7fELF"
+  put(elf, 2, 1);          // 64-bit
+  put(elf, 1, 1);          // little endian
+  put(elf, 1, 1);          // version
+  put(elf, 0, 9);
+  put(elf, 1, 2);  // ET_REL
+  put(elf, 62, 2); // EM_X86_64
+  put(elf, 1, 4);
+  put(elf, 0, 8); // entry
+  put(elf, 0, 8); // program headers
+  int shoff_at = elf->len;
+  put(elf, 0, 8);
+  put(elf, 0, 4);
+  put(elf, 64, 2);
+  put(elf, 0, 2);
+  put(elf, 0, 2);
+  put(elf, 64, 2);
+  put(elf, NSECTIONS, 2);
+  put(elf, SEC_SHSTRTAB, 2);
+
+  long offsets[NSECTIONS] = {0};
+  for (int i = 1; i < NSECTIONS; i++) {
+    pad_to(elf, 16);
+    offsets[i] = elf->len;
+    buf_appendn(elf, contents[i]->data, contents[i]->len);
+  }
+  pad_to(elf, 8);
+  patch32(elf, shoff_at, elf->len);
+
+  put_shdr(elf, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+  put_shdr(elf, name_off[SEC_TEXT], 1, 6, offsets[SEC_TEXT], text->len, 0, 0,
+           16, 0);
+  put_shdr(elf, name_off[SEC_DATA], 1, 3, offsets[SEC_DATA], data->len, 0, 0,
+           16, 0);
+  put_shdr(elf, name_off[SEC_RODATA], 1, 2, offsets[SEC_RODATA], rodata->len,
+           0, 0, 1, 0);
+  put_shdr(elf, name_off[SEC_RELA_TEXT], 4, 0x40, offsets[SEC_RELA_TEXT],
+           rela_text->len, SEC_SYMTAB, SEC_TEXT, 8, 24);
+  put_shdr(elf, name_off[SEC_RELA_DATA], 4, 0x40, offsets[SEC_RELA_DATA],
+           rela_data->len, SEC_SYMTAB, SEC_DATA, 8, 24);
+  put_shdr(elf, name_off[SEC_SYMTAB], 2, 0, offsets[SEC_SYMTAB], symtab->len,
+           SEC_STRTAB, first_global, 8, 24);
+  put_shdr(elf, name_off[SEC_STRTAB], 3, 0, offsets[SEC_STRTAB], strtab->len,
+           0, 0, 1, 0);
+  // Empty and not executable, so the linker does not make the stack
+  // executable.
+  put_shdr(elf, name_off[SEC_NOTE_STACK], 1, 0, offsets[SEC_NOTE_STACK], 0, 0,
+           0, 1, 0);
+  put_shdr(elf, name_off[SEC_SHSTRTAB], 3, 0, offsets[SEC_SHSTRTAB],
+           shstrtab->len, 0, 0, 1, 0);
+
+  out_putn(out, elf->data, elf->len);
+}
+
+static void assemble(ir_t *ir) {
+  text = new_buf();
+  data = new_buf();
+  rodata = new_buf();
+  text_relocs = new_vec();
+  data_relocs = new_vec();
+  lc_refs = new_vec();
+  syms = new_map();
+
+  gen_data(ir);
+  gen_rodata(ir);
+  gen_text(ir);
+  return;
+}
+
+void gen_obj(ir_t *ir, out_t *out) {
+  assemble(ir);
+  write_elf(out);
+  return;
+}
+
+// Functions outside the program are called through a stub placed right after
+// the code, since they are usually too far away for a rel32:
+//   jmp [rip+0]
+//   .quad address
+#define STUB_SIZE 16
+
+// Generated functions save the callee-saved registers they write in their
+// own frames, right below their locals. A program whose out-of-bounds store
+// lands on those saves would hand sicc back clobbered registers, so main()
+// is entered through a trampoline that keeps sicc's copies:
+//   push rbx; push rbp; push r12; push r13; push r14; push r15
+//   sub rsp, 8; call main; add rsp, 8
+//   pop r15; pop r14; pop r13; pop r12; pop rbp; pop rbx; ret
+static const unsigned char trampoline[] = {
+    0x53, 0x55, 0x41, 0x54, 0x41, 0x55, 0x41, 0x56, 0x41, 0x57, 0x48, 0x83,
+    0xec, 0x08, 0xe8, 0,    0,    0,    0,    0x48, 0x83, 0xc4, 0x08, 0x41,
+    0x5f, 0x41, 0x5e, 0x41, 0x5d, 0x41, 0x5c, 0x5d, 0x5b, 0xc3};
+#define TRAMPOLINE_CALL 15 // offset of the rel32
+
+static long page_align(long n, long page) { return (n + page - 1) / page * page; }
+
+static char *resolve(void *dl, char *name) {
+  char *addr = dlsym(dl, name);
+  if (!addr)
+    error("Undefined symbol: %s", name);
+  return addr;
+}
+
+static void apply_relocs(vec_t *relocs, char *base, char *rodata_addr) {
+  for (int i = 0; i < vec_len(relocs); i++) {
+    reloc_t *r = vec_get(relocs, i);
+    char *p = base + r->offset;
+    char *s = r->sym ? r->sym->addr : rodata_addr;
+    if (r->type == R_X86_64_64) {
+      *(intptr_t *)p = (intptr_t)(s + r->addend);
+      continue;
+    }
+    long rel = s + r->addend - p;
+    if (rel != (int)rel)
+      error("%s is too far away to be referenced", r->sym->name);
+    *(int *)p = rel;
+  }
+}
+
+// Loads the program into executable memory and calls its main().
+int run_jit(ir_t *ir, int argc, char **argv) {
+  assemble(ir);
+
+  void *dl = dlopen(NULL, RTLD_LAZY);
+  long page = sysconf(_SC_PAGESIZE);
+  // Only calls can go through a stub; data from outside is used directly.
+  for (int i = 0; i < vec_len(text_relocs); i++) {
+    reloc_t *r = vec_get(text_relocs, i);
+    if (r->type == R_X86_64_PLT32)
+      r->sym->func = true;
+  }
+
+  int nsyms = map_len(syms);
+  int nstubs = 0;
+  int bss_size = 0;
+  for (int i = 0; i < nsyms; i++) {
+    obj_sym_t *sym = vec_get(syms->items, i);
+    if (sym->sec == SHN_COMMON) {
+      bss_size = (bss_size + sym->value - 1) / sym->value * sym->value;
+      sym->index = bss_size;
+      bss_size += sym->size;
+    } else if (!sym->sec && sym->func) {
+      sym->index = nstubs++;
+    }
+  }
+
+  // Code and stubs, read-only data, then data and common symbols, each on
+  // their own pages.
+  long text_size =
+      page_align(text->len + nstubs * STUB_SIZE + sizeof(trampoline), page);
+  long rodata_size = page_align(rodata->len, page);
+  long data_off = text_size + rodata_size;
+  long data_end = (data->len + 15) / 16 * 16;
+  long size = data_off + page_align(data_end + bss_size, page);
+  char *mem = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (mem == MAP_FAILED)
+    error("Cannot map memory for the program");
+  memcpy(mem, text->data, text->len);
+  memcpy(mem + text_size, rodata->data, rodata->len);
+  memcpy(mem + data_off, data->data, data->len);
+
+  for (int i = 0; i < nsyms; i++) {
+    obj_sym_t *sym = vec_get(syms->items, i);
+    if (sym->sec == SEC_TEXT) {
+      sym->addr = mem + sym->value;
+    } else if (sym->sec == SEC_DATA) {
+      sym->addr = mem + data_off + sym->value;
+    } else if (sym->sec == SHN_COMMON) {
+      sym->addr = mem + data_off + data_end + sym->index;
+    } else if (!sym->func) {
+      sym->addr = resolve(dl, sym->name);
+    } else {
+      char *stub = mem + text->len + sym->index * STUB_SIZE;
+      stub[0] = 0xff;
+      stub[1] = 0x25;
+      *(int *)(stub + 2) = 0;
+      *(char **)(stub + 6) = resolve(dl, sym->name);
+      sym->addr = stub;
+    }
+  }
+
+  apply_relocs(text_relocs, mem, mem + text_size);
+  apply_relocs(data_relocs, mem + data_off, mem + text_size);
+
+  obj_sym_t *main_sym = map_get(syms, "main");
+  if (!main_sym || main_sym->sec != SEC_TEXT)
+    error("main is not defined");
+  char *entry_addr = mem + text->len + nstubs * STUB_SIZE;
+  memcpy(entry_addr, trampoline, sizeof(trampoline));
+  *(int *)(entry_addr + TRAMPOLINE_CALL) =
+      main_sym->addr - (entry_addr + TRAMPOLINE_CALL + 4);
+  int (*entry)(int, char **) = (void *)entry_addr;
+
+  if (mprotect(mem, text_size, PROT_READ | PROT_EXEC) ||
+      mprotect(mem + text_size, rodata_size, PROT_READ))
+    error("Cannot protect program memory");
+
+  return entry(argc, argv);
+}
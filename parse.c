@@ -1,13 +1,9 @@
 #include "sicc.h"
 
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 
-static int cur = 0;
-
-map_t *types;     // type_info_t map
-map_t *enum_list; // intptr_t map
-
 // static type_info_t *new_type_info(int size, int ty) {
 //   type_info_t *tyinfo = calloc(1, sizeof(type_info_t));
 //   tyinfo->size = size;
@@ -15,58 +11,122 @@ map_t *enum_list; // intptr_t map
 //   return tyinfo;
 // }
 
-static token_t *peek(int offset) { return vec_get(tokens, cur + offset); }
+static int peek(int offset) { return ctx->cur + offset; }
 
-static token_t *eat() { return vec_get(tokens, cur++); }
+static int eat() { return ctx->cur++; }
 
-static int lineno(token_t *tk) { return tk->line; }
+static int lineno(int tk) { return token_line(tk); }
 
-static int equal(token_t *tk, char *str) {
-  if (!strcmp(tk->str, str))
+// Token strings are interned, so a pointer compare is enough.
+static int equal(int tk, char *str) {
+  if (token_str(tk) == intern_lit(str))
     return 1;
   return 0;
 }
 
-static int type_equal(token_t *tk, int ty) {
-  if (tk->ty == ty)
+static int type_equal(int tk, int ty) {
+  if (token_ty(tk) == ty)
     return 1;
   return 0;
 }
 
-static void expect(token_t *tk, char *str) {
-  if (!strcmp(tk->str, str))
+static void expect(int tk, char *str) {
+  if (token_str(tk) == intern_lit(str))
     return;
-  error("%s expected, but got %s: line %d", str, tk->str, tk->line);
+  error("%s expected, but got %s: line %d", str, token_str(tk), token_line(tk));
 }
 
-static bool is_typename(token_t *tk) {
-  if (map_find(types, peek(0)->str) || type_equal(peek(0), TK_STRUCT) ||
-      type_equal(peek(0), TK_TYPEDEF) || type_equal(peek(0), TK_ENUM)) {
+static bool is_typename(int tk) {
+  if (map_find(ctx->types, token_str(peek(0))) ||
+      type_equal(peek(0), TK_STRUCT) || type_equal(peek(0), TK_TYPEDEF) ||
+      type_equal(peek(0), TK_ENUM)) {
     return true;
   }
   return false;
 }
 
 node_t *new_node(int ty) {
-  node_t *node = calloc(1, sizeof(node_t));
+  node_t *node = arena_alloc(ctx->ast_arena, sizeof(node_t));
   node->ty = ty;
+  ctx->nnodes++;
   return node;
 }
 
+node_t *child(node_t *node, int i) {
+  return ctx->node_lists->data[node->list + i];
+}
+
+// The children of a node are gathered on node_stack while it is parsed and
+// moved to node_lists in one piece at the end. Lists nested in it are
+// finished before it goes on, so they never interleave with its children.
+static int begin_list() { return vec_len(ctx->node_stack); }
+
+static void push_child(node_t *node) { vec_push(ctx->node_stack, node); }
+
+static void end_list(node_t *node, int base) {
+  node->list = vec_len(ctx->node_lists);
+  node->nlist = vec_len(ctx->node_stack) - base;
+  grow_vec(ctx->node_lists, node->nlist);
+  for (int i = base; i < vec_len(ctx->node_stack); i++)
+    ctx->node_lists->data[ctx->node_lists->len++] = ctx->node_stack->data[i];
+  ctx->node_stack->len = base;
+}
+
 type_t *new_type(int size, int ty) {
-  type_t *type = calloc(1, sizeof(type_t));
+  type_t *type = arena_alloc(ctx->ast_arena, sizeof(type_t));
   type->size = size;
+  type->align = size;
   type->ty = ty;
   return type;
 }
 
+// Derived types are made once and kept on the type they derive from, so
+// each one exists only once and types can be compared by pointer.
+type_t *pointer_to(type_t *base) {
+  if (!base->pointer) {
+    base->pointer = new_type(8, TY_PTR);
+    base->pointer->ptr = base;
+    base->pointer->size_deref = base->size;
+  }
+  return base->pointer;
+}
+
+// `len` is -1 for an array whose size comes from its initializer.
+type_t *array_of(type_t *elem, int len) {
+  for (type_t *ty = elem->arrays; ty; ty = ty->next) {
+    if (ty->array_size == len)
+      return ty;
+  }
+  type_t *ty;
+  if (len < 0) {
+    ty = new_type(elem->size, TY_ARRAY_NOSIZE);
+  } else {
+    ty = new_type(elem->size * len, TY_ARRAY);
+  }
+  ty->align = elem->align;
+  ty->ptr = elem;
+  ty->size_deref = elem->size;
+  ty->array_size = len;
+  ty->next = elem->arrays;
+  elem->arrays = ty;
+  return ty;
+}
+
 void init_parser() {
-  types = new_map();
-  enum_list = new_map();
-  map_put(types, "int", new_type(4, TY_INT));
-  map_put(types, "char", new_type(1, TY_CHAR));
-  map_put(types, "void", new_type(1, TY_VOID));
-  map_put(types, "long", new_type(8, TY_LONG));
+  ctx->types = new_map();
+  ctx->enum_list = new_map();
+  map_put(ctx->types, intern("int"), new_type(4, TY_INT));
+  map_put(ctx->types, intern("char"), new_type(1, TY_CHAR));
+  map_put(ctx->types, intern("void"), new_type(1, TY_VOID));
+  map_put(ctx->types, intern("long"), new_type(8, TY_LONG));
+  for (int i = 0; ctx->pch && i < map_len(ctx->pch->types); i++)
+    map_put(ctx->types, vec_get(ctx->pch->types->keys, i),
+            vec_get(ctx->pch->types->items, i));
+  for (int i = 0; ctx->pch && i < map_len(ctx->pch->enum_list); i++)
+    map_put(ctx->enum_list, vec_get(ctx->pch->enum_list->keys, i),
+            vec_get(ctx->pch->enum_list->items, i));
+  ctx->int_type = map_get(ctx->types, intern_lit("int"));
+  ctx->char_type = map_get(ctx->types, intern_lit("char"));
 }
 
 static node_t *params();
@@ -88,7 +148,7 @@ static void storage_class(node_t *node);
 static type_t *type();
 static node_t *init();
 static node_t *decl(type_t *ty);
-static member_t *struct_declarator();
+static void struct_declarator(type_t *ty);
 static type_t *struct_spec();
 static type_t *typedef_spec();
 static void enum_declarator();
@@ -101,15 +161,16 @@ static node_t *function(type_t *ty);
 
 static node_t *params() {
   node_t *node = new_node(ND_PARAMS);
-  node->params = new_vec();
+  int base = begin_list();
   expect(eat(), "(");
   while (!equal(peek(0), ")")) {
-    vec_push(node->params, assign_expr());
+    push_child(assign_expr());
     if (equal(peek(0), ")"))
       break;
     expect(eat(), ",");
   }
   eat();
+  end_list(node, base);
   return node;
 }
 
@@ -121,27 +182,27 @@ static node_t *primary() {
     return expr;
   } else if (type_equal(peek(0), TK_NUM)) {
     node_t *node = new_node(ND_NUM);
-    node->num = atoi(eat()->str);
+    node->num = atoi(token_str(eat()));
     return node;
   } else if (type_equal(peek(0), TK_IDENT)) {
-    if (map_find(enum_list, peek(0)->str)) {
+    if (map_find(ctx->enum_list, token_str(peek(0)))) {
       node_t *node = new_node(ND_NUM);
-      node->num = (int)(intptr_t)map_get(enum_list, eat()->str);
+      node->num = (int)(intptr_t)map_get(ctx->enum_list, token_str(eat()));
       return node;
     }
     node_t *node = new_node(ND_IDENT);
-    node->str = eat()->str;
+    node->str = token_str(eat());
     return node;
   } else if (type_equal(peek(0), TK_STRING)) {
     node_t *node = new_node(ND_STRING);
-    node->str = eat()->str;
+    node->str = token_str(eat());
     return node;
   } else if (type_equal(peek(0), TK_CHARACTER)) {
     node_t *node = new_node(ND_CHARACTER);
-    node->str = eat()->str;
+    node->str = token_str(eat());
     return node;
   }
-  error_at(peek(0), "Unknown identifier: %s", peek(0)->str);
+  error_at(peek(0), "Unknown identifier: %s", token_str(peek(0)));
   return NULL;
 }
 
@@ -167,22 +228,22 @@ static node_t *postfix() {
       eat();
       node_t *t = new_node(ND_DOT);
       t->lhs = node;
-      token_t *name = eat();
-      if (name->ty != TK_IDENT) {
-        error_at(name, "Identifier expected but got %s: line %s", name->str, name->line);
+      int name = eat();
+      if (token_ty(name) != TK_IDENT) {
+        error_at(name, "Identifier expected but got %s: line %s", token_str(name), token_line(name));
       }
-      t->str = name->str;
+      t->str = token_str(name);
       node = t;
       continue;
     } else if (equal(peek(0), "->")) {
       eat();
       node_t *t = new_node(ND_ARROW);
       t->lhs = node;
-      token_t *name = eat();
-      if (name->ty != TK_IDENT) {
-        error_at(name, "Identifier expected but got %s: line %s", name->str, name->line);
+      int name = eat();
+      if (token_ty(name) != TK_IDENT) {
+        error_at(name, "Identifier expected but got %s: line %s", token_str(name), token_line(name));
       }
-      t->str = name->str;
+      t->str = token_str(name);
       node = t;
       continue;
     } else if (equal(peek(0), "++")) {
@@ -213,7 +274,6 @@ static node_t *unary() {
     eat();
     node_t *node = new_node(ND_REF);
     node->lhs = unary();
-    node->type = new_type(8, TY_PTR);
     return node;
   } else if (equal(peek(0), "!")) {
     eat();
@@ -249,7 +309,7 @@ static node_t *cast_expr() {
     eat();
     type_t *ty = type();
     if (!ty) {
-      cur--;
+      ctx->cur--;
       return unary();
     }
     expect(eat(), ")");
@@ -439,17 +499,14 @@ static node_t *assign_expr() {
 static node_t *const_expr() { return logic_and_expr(); }
 
 static void storage_class(node_t *node) {
-  if (!node->flag)
-    node->flag = calloc(1, sizeof(flag_t));
-
   if (equal(peek(0), "static")) {
     eat();
-    node->flag->is_node_static = true;
+    node->flags |= NF_STATIC;
     return;
   }
   if (equal(peek(0), "extern")) {
     eat();
-    node->flag->is_node_extern = true;
+    node->flags |= NF_EXTERN;
     return;
   }
   if (equal(peek(0), "typedef")) {
@@ -458,7 +515,7 @@ static void storage_class(node_t *node) {
   }
   if (equal(peek(0), "const")) {
     eat();
-    node->flag->is_node_const = true;
+    node->flags |= NF_CONST;
     return;
   }
 }
@@ -470,21 +527,16 @@ static type_t *type() {
   } else if (equal(peek(0), "enum")) {
     return enum_spec();
   } else {
-    token_t *name = peek(0);
-    type_t *ty = map_get(types, name->str);
-    if (!ty)
+    int name = peek(0);
+    type = map_get(ctx->types, token_str(name));
+    if (!type)
       return NULL;
-    type = new_type(ty->size, ty->ty);
-    type->member = ty->member;
     eat();
   }
 
   while (equal(peek(0), "*")) {
     eat();
-    type_t *ptr_type = new_type(8, TY_PTR);
-    ptr_type->ptr = type;
-    ptr_type->size_deref = type->size;
-    type = ptr_type;
+    type = pointer_to(type);
   }
   return type;
 }
@@ -493,16 +545,17 @@ static node_t *init() {
   if (equal(peek(0), "{")) {
     eat();
     node_t *node = new_node(ND_INITIALIZER);
-    node->initializer = new_vec();
+    int base = begin_list();
     while (!equal(peek(0), "}")) {
       node_t *nexpr = init();
-      vec_push(node->initializer, nexpr);
+      push_child(nexpr);
       if (!equal(peek(0), ","))
         break;
       else
         eat();
     }
     expect(eat(), "}");
+    end_list(node, base);
     return node;
   } else {
     return assign_expr();
@@ -510,28 +563,21 @@ static node_t *init() {
 }
 
 static void decl_init(node_t *node) {
-  token_t *tk = peek(0);
+  int tk = peek(0);
   if (!type_equal(tk, TK_IDENT))
-    error_at(peek(0), "Var name expected but got %s", peek(0)->str);
-  node->str = eat()->str;
+    error_at(peek(0), "Var name expected but got %s", token_str(peek(0)));
+  node->str = token_str(eat());
   type_t *array_elem = node->type;
   for (; equal(peek(0), "["); array_elem = node->type) {
     eat();
     if (equal(peek(0), "]")) {
-      node->type = new_type(array_elem->size, TY_ARRAY_NOSIZE);
-      node->type->size_deref = array_elem->size;
-      node->type->ptr = array_elem;
+      node->type = array_of(array_elem, -1);
       eat();
     } else {
       node_t *expr = assign_expr();
       if (expr->ty != ND_NUM)
         error_at(peek(0), "Specify an array size with expr is not implemented yet");
-      int size = array_elem->size;
-      node->type = new_type(size, TY_ARRAY);
-      node->type->size_deref = array_elem->size;
-      node->type->array_size = expr->num;
-      node->type->size = array_elem->size * expr->num;
-      node->type->ptr = array_elem;
+      node->type = array_of(array_elem, expr->num);
       expect(eat(), "]");
     }
   }
@@ -542,18 +588,18 @@ static node_t *decl(type_t *ty) {
 
   if (!ty) {
     storage_class(node);
-    if (peek(0)->ty == TK_SEMICOLON) {
+    if (token_ty(peek(0)) == TK_SEMICOLON) {
       return new_node(ND_NOP);
     }
     node->type = type();
   } else
     node->type = ty;
-  if (peek(0)->ty == TK_SEMICOLON) {
+  if (token_ty(peek(0)) == TK_SEMICOLON) {
     return new_node(ND_NOP);
   }
-  if (peek(1)->ty == TK_LPAREN) {
+  if (token_ty(peek(1)) == TK_LPAREN) {
     node_t *func = function(node->type);
-    func->flag = node->flag;
+    func->flags = node->flags;
     return func;
   }
   decl_init(node);
@@ -573,79 +619,99 @@ static node_t *decl_list() {
   }
 
   node_t *node = new_node(ND_VAR_DECL_LIST);
-  node->vars = new_vec();
-  vec_push(node->vars, first);
+  int base = begin_list();
+  push_child(first);
   for (; equal(peek(0), ",");) {
     eat();
     node_t *tmp = new_node(ND_VAR_DECL);
-    tmp->type = calloc(1, sizeof(type_t));
-    memcpy(tmp->type, first->type, sizeof(type_t));
+    tmp->type = first->type;
     decl_init(tmp);
     if (equal(peek(0), "=")) {
       eat();
       tmp->lhs = init();
       tmp->ty = ND_VAR_DEF;
     }
-    vec_push(node->vars, tmp);
+    push_child(tmp);
   }
-
+  end_list(node, base);
   return node;
 }
 
-static member_t *struct_declarator() {
+// Members are laid out as the System V ABI does: each at the next offset
+// aligned for its type, the struct aligned for its most aligned member and
+// padded to a multiple of that.
+static void add_member(type_t *ty, char *name, type_t *mty) {
+  member_t *m = ty->member;
+  m->size = align_to(m->size, mty->align);
+  map_put(m->data, name, mty);
+  map_put(m->offset, name, (void *)(intptr_t)m->size);
+  m->size += mty->size;
+  if (ty->align < mty->align)
+    ty->align = mty->align;
+}
+
+// Bytes of padding after the i-th member of a struct.
+int padding_after(type_t *ty, int i) {
+  member_t *m = ty->member;
+  type_t *mty = vec_get(m->data->items, i);
+  int end = (intptr_t)vec_get(m->offset->items, i) + mty->size;
+  if (i + 1 < map_len(m->data))
+    return (intptr_t)vec_get(m->offset->items, i + 1) - end;
+  return ty->size - end;
+}
+
+static void struct_declarator(type_t *ty) {
   expect(eat(), "{");
-  member_t *m = calloc(1, sizeof(member_t));
+  member_t *m = arena_alloc(ctx->ast_arena, sizeof(member_t));
   m->data = new_map();
   m->offset = new_map();
+  ty->member = m;
+  ty->align = 1;
   while (!equal(peek(0), "}")) {
     node_t *node = decl(NULL);
     if (node->ty != ND_VAR_DECL && node->ty != ND_VAR_DECL_LIST) {
-      error_at(peek(0), "Variable declaration expected: line %d", peek(0)->line);
+      error_at(peek(0), "Variable declaration expected: line %d", token_line(peek(0)));
     }
     if (node->ty == ND_VAR_DECL_LIST) {
-      int len = vec_len(node->vars);
-      for (int i = 0; i < len; i++) {
-        node_t *var = vec_get(node->vars, i);
-        map_put(m->data, var->str, var->type);
-        map_put(m->offset, var->str, (void *)(intptr_t)m->size);
-        m->size += var->type->size;
+      for (int i = 0; i < node->nlist; i++) {
+        node_t *var = child(node, i);
+        add_member(ty, var->str, var->type);
       }
     } else {
-      map_put(m->data, node->str, node->type);
-      map_put(m->offset, node->str, (void *)(intptr_t)m->size);
-      m->size += node->type->size;
+      add_member(ty, node->str, node->type);
     }
 
     expect(eat(), ";");
   }
 
   expect(eat(), "}");
-  return m;
+  m->size = align_to(m->size, ty->align);
+  ty->size = m->size;
 }
 
 static type_t *struct_spec() {
   expect(eat(), "struct");
-  token_t *tk = peek(0);
-  if (tk->ty == TK_IDENT) {
-    if (peek(1)->ty != TK_LBRACE) {
-      token_t *name = eat();
-      type_t *ty = map_get(types, name->str);
+  int tk = peek(0);
+  if (token_ty(tk) == TK_IDENT) {
+    if (token_ty(peek(1)) != TK_LBRACE) {
+      int name = eat();
+      type_t *ty = map_get(ctx->types, token_str(name));
       return ty;
     }
     eat();
     type_t *ty = new_type(0, TY_STRUCT);
-    map_put(types, tk->str, ty);
-    member_t *m = struct_declarator();
-    ty->size = m->size;
-    ty->member = m;
+    map_put(ctx->types, token_str(tk), ty);
+    struct_declarator(ty);
+    // A member pointing to the struct itself was made while it had no size.
+    if (ty->pointer)
+      ty->pointer->size_deref = ty->size;
     return ty;
-  } else if (tk->ty == TK_LBRACE) {
-    member_t *m = struct_declarator();
-    type_t *ty = new_type(m->size, TY_STRUCT);
-    ty->member = m;
+  } else if (token_ty(tk) == TK_LBRACE) {
+    type_t *ty = new_type(0, TY_STRUCT);
+    struct_declarator(ty);
     return ty;
   } else {
-    error_at(tk, "Variable name expected but got %s", tk->str);
+    error_at(tk, "Variable name expected but got %s", token_str(tk));
     return NULL;
   }
 }
@@ -655,9 +721,7 @@ static type_t *typedef_spec() {
   node_t *node = decl(NULL);
   if (node->str == NULL)
     return node->type;
-  type_t *ty = new_type(node->type->size, node->type->ty);
-  ty->member = node->type->member;
-  map_put(types, node->str, ty);
+  map_put(ctx->types, node->str, node->type);
   return node->type;
 }
 
@@ -665,18 +729,18 @@ static void enum_declarator() {
   expect(eat(), "{");
   int iota = 0;
   while (!equal(peek(0), "}")) {
-    token_t *tk = eat();
-    if (tk->ty != TK_IDENT)
-      error_at(tk, "Identifier expected but got %s: line %d", tk->str, tk->line);
+    int tk = eat();
+    if (token_ty(tk) != TK_IDENT)
+      error_at(tk, "Identifier expected but got %s: line %d", token_str(tk), token_line(tk));
     if (equal(peek(0), "=")) {
       eat();
-      token_t *num = eat();
-      if (num->ty != TK_NUM)
-        error_at(num, "Number expected but got %s: line %d", num->str, num->line);
-      iota = atoi(num->str);
+      int num = eat();
+      if (token_ty(num) != TK_NUM)
+        error_at(num, "Number expected but got %s: line %d", token_str(num), token_line(num));
+      iota = atoi(token_str(num));
     }
 
-    map_put(enum_list, tk->str, (void *)(intptr_t)iota++);
+    map_put(ctx->enum_list, token_str(tk), (void *)(intptr_t)iota++);
     if (!equal(peek(0), ","))
       break;
     eat();
@@ -687,16 +751,15 @@ static void enum_declarator() {
 
 static type_t *enum_spec() {
   expect(eat(), "enum");
-  type_t *ty = map_get(types, "int");
-  type_t *type = new_type(ty->size, ty->ty);
+  type_t *ty = map_get(ctx->types, intern_lit("int"));
   if (type_equal(peek(0), TK_IDENT)) {
-    map_put(types, eat()->str, ty);
+    map_put(ctx->types, token_str(eat()), ty);
   }
   if (equal(peek(0), "{")) {
     enum_declarator();
   }
 
-  return type;
+  return ty;
 }
 
 static node_t *ext_decl(type_t *ty) {
@@ -712,7 +775,7 @@ static node_t *stmt() {
   if (type_equal(peek(0), TK_RETURN)) {
     eat();
     node_t *node = new_node(ND_RETURN);
-    if (peek(0)->ty == TK_SEMICOLON) {
+    if (token_ty(peek(0)) == TK_SEMICOLON) {
       expect(eat(), ";");
       node->lhs = NULL;
       return node;
@@ -729,7 +792,9 @@ static node_t *stmt() {
     node->lhs = stmt();
     if (type_equal(peek(0), TK_ELSE)) {
       eat();
-      node->else_stmt = stmt();
+      int base = begin_list();
+      push_child(stmt());
+      end_list(node, base);
       node->ty = ND_IF_ELSE;
     }
     return node;
@@ -750,11 +815,11 @@ static node_t *stmt() {
     node_t *loop = NULL;
     node_t *body;
 
-    token_t *tk = peek(0);
+    int tk = peek(0);
     // for (init; cond; loop) body
-    if (map_find(types, tk->str)) {
+    if (map_find(ctx->types, token_str(tk))) {
       init = decl_list();
-    } else if (tk->ty == TK_SEMICOLON) {
+    } else if (token_ty(tk) == TK_SEMICOLON) {
       init = new_node(ND_NOP);
     } else {
       init = assign_expr();
@@ -772,11 +837,12 @@ static node_t *stmt() {
     expect(eat(), ")");
     body = stmt();
 
-    node->init = init;
-    node->cond = cond;
-    node->loop = loop;
-    node->body = body;
-
+    int base = begin_list();
+    push_child(init);
+    push_child(cond);
+    push_child(loop);
+    push_child(body);
+    end_list(node, base);
     return node;
   } else if (type_equal(peek(0), TK_SWITCH)) {
     node_t *node = new_node(ND_SWITCH);
@@ -788,19 +854,19 @@ static node_t *stmt() {
     return node;
   } else if (type_equal(peek(0), TK_LBRACE)) {
     return compound_stmt();
-  } else if (type_equal(peek(0), TK_IDENT) && peek(1)->ty == TK_COLON) {
+  } else if (type_equal(peek(0), TK_IDENT) && token_ty(peek(1)) == TK_COLON) {
     node_t *node = new_node(ND_LABEL);
-    node->str = eat()->str;
+    node->str = token_str(eat());
     eat();
     return node;
   } else if (type_equal(peek(0), TK_GOTO)) {
     eat();
     node_t *node = new_node(ND_GOTO);
     if (!type_equal(peek(0), TK_IDENT)) {
-      token_t *tk = peek(0);
-      error_at(tk, "Identifier expected but got %s: line %d\n", tk->str, tk->line);
+      int tk = peek(0);
+      error_at(tk, "Identifier expected but got %s: line %d\n", token_str(tk), token_line(tk));
     }
-    node->str = eat()->str;
+    node->str = token_str(eat());
     expect(eat(), ";");
     return node;
   } else if (type_equal(peek(0), TK_CASE)) {
@@ -824,7 +890,7 @@ static node_t *stmt() {
     eat();
     expect(eat(), ";");
     return node;
-  } else if (peek(0)->ty == TK_SEMICOLON) {
+  } else if (token_ty(peek(0)) == TK_SEMICOLON) {
     eat();
     return new_node(ND_NOP);
   } else {
@@ -836,46 +902,45 @@ static node_t *stmt() {
 
 static node_t *compound_stmt() {
   node_t *node = new_node(ND_STMTS);
-  node->stmts = new_vec();
+  int base = begin_list();
   expect(eat(), "{");
   while (!equal(peek(0), "}")) {
     if (is_typename(peek(0))) {
       node_t *decls = decl_list();
       expect(eat(), ";");
-      vec_push(node->stmts, decls);
+      push_child(decls);
     } else {
       node_t *st = stmt();
-      vec_push(node->stmts, st);
+      push_child(st);
     }
   }
   expect(eat(), "}");
+  end_list(node, base);
   return node;
 }
 
 static node_t *arguments() {
   node_t *node = new_node(ND_ARGS);
-  node->args = new_vec();
+  int base = begin_list();
   expect(eat(), "(");
   while (!equal(peek(0), ")")) {
     if (type_equal(peek(0), TK_VA_SPEC)) {
       eat();
-      expect(eat(), ")");
-      return node;
+      break;
     }
     node_t *arg = new_node(ND_VAR_DECL);
     type_t *ty = type();
-    if (ty->ty == TY_VOID && equal(peek(0), ")")) {
-      eat();
-      return node;
-    }
+    if (ty->ty == TY_VOID && equal(peek(0), ")"))
+      break;
     arg->type = ty;
     decl_init(arg);
-    vec_push(node->args, arg);
+    push_child(arg);
     if (equal(peek(0), ")"))
       break;
     expect(eat(), ",");
   }
-  eat();
+  expect(eat(), ")");
+  end_list(node, base);
   return node;
 }
 
@@ -886,14 +951,16 @@ static node_t *function(type_t *ty) {
   } else
     node->type = ty;
   if (!type_equal(peek(0), TK_IDENT))
-    error_at(peek(0), "Function name expected, but got %s", peek(0)->str);
-  node->str = eat()->str;
+    error_at(peek(0), "Function name expected, but got %s", token_str(peek(0)));
+  node->str = token_str(eat());
   node_t *args = arguments();
   if (equal(peek(0), ";")) {
     eat();
     return new_node(ND_FUNC_DECL);
   }
+  func_begin(node->str);
   node_t *prog = compound_stmt();
+  func_end();
   node->lhs = prog;
   node->rhs = args;
   return node;
@@ -902,18 +969,27 @@ static node_t *function(type_t *ty) {
 node_t *parse() {
   init_parser();
   node_t *node = new_node(ND_EXTERNAL);
-  node->funcs = new_vec();
-  node->decl_list = new_vec();
+  node->rhs = new_node(ND_FUNCS);
+  vec_t *funcs = new_vec();
+  int base = begin_list();
+  for (int i = 0; ctx->pch && i < vec_len(ctx->pch->decls); i++)
+    push_child(vec_get(ctx->pch->decls, i));
 
   while (!type_equal(peek(0), TK_EOF)) {
     node_t *d = ext_decl(NULL);
     if (d->ty == ND_FUNC || d->ty == ND_FUNC_DECL)
-      vec_push(node->funcs, d);
+      vec_push(funcs, d);
     else {
-      vec_push(node->decl_list, d);
+      push_child(d);
       expect(eat(), ";");
     }
   }
+  end_list(node, base);
 
+  base = begin_list();
+  for (int i = 0; i < vec_len(funcs); i++)
+    push_child(vec_get(funcs, i));
+  end_list(node->rhs, base);
+  free_vec(funcs);
   return node;
 }
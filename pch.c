@@ -0,0 +1,442 @@
+#include "sicc.h"
+
+#include <limits.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+// A precompiled header holds what a translation unit knows after including
+// the header: its macros, named types, enum constants and global variable
+// declarations. The file is the magic, then 32-bit little-endian ints, then
+// the NUL-terminated strings they refer to, so loading it is one mmap and a
+// pass over the ints.
+//
+//   version, string table offset
+//   source:  path, size, mtime (low and high half), hash of the text
+//   type count, member count
+//   types:   size align ty name ptr size_deref array_size member
+//   members: size nfields, then nfields times (name type offset)
+//   named types, enum constants, macros and declarations: a count, then
+//   (name type), (name value), (name nparams params ntokens tokens) and
+//   (name type flags). An object-like macro has -1 parameters; a token is
+//   (spelling param space).
+//
+// Strings are offsets into the string table; types and members are indexes.
+// -1 stands for NULL. The source is checked when the file is loaded, so that
+// a header changed since is not replaced by its old definitions.
+
+#define PCH_MAGIC "SICCPCH"
+#define PCH_VERSION 4
+
+#define DECL_STATIC 1
+#define DECL_EXTERN 2
+#define DECL_CONST 4
+
+typedef struct {
+  buf_t *ints;
+  buf_t *strs;
+  map_t *str_index;    // string -> offset in strs
+  map_t *type_index;   // address -> index in types
+  vec_t *types;
+  map_t *member_index; // address -> index in members
+  vec_t *members;
+} pch_writer_t;
+
+static void put_int(pch_writer_t *w, int n) {
+  for (int i = 0; i < 4; i++)
+    buf_push(w->ints, (n >> (i * 8)) & 0xff);
+}
+
+static void put_str(pch_writer_t *w, char *s) {
+  if (!s) {
+    put_int(w, -1);
+    return;
+  }
+  if (!map_find(w->str_index, s)) {
+    map_put(w->str_index, s, (void *)(intptr_t)w->strs->len);
+    buf_appendn(w->strs, s, strlen(s) + 1);
+  }
+  put_int(w, (intptr_t)map_get(w->str_index, s));
+}
+
+// Types and members form a graph, cycles included, so each one is numbered
+// the first time it is reached.
+static int index_of(map_t *index, vec_t *list, void *p) {
+  if (!p)
+    return -1;
+  char *key = format("%p", p);
+  if (!map_find(index, key)) {
+    map_put(index, key, (void *)(intptr_t)vec_len(list));
+    vec_push(list, p);
+  }
+  return (intptr_t)map_get(index, key);
+}
+
+static int type_index(pch_writer_t *w, type_t *ty) {
+  return index_of(w->type_index, w->types, ty);
+}
+
+static int member_index(pch_writer_t *w, member_t *m) {
+  return index_of(w->member_index, w->members, m);
+}
+
+static void add_decl(pch_writer_t *w, vec_t *decls, node_t *node, int flags) {
+  if (node->ty == ND_EXT_VAR_DEF || node->ty == ND_VAR_DEF)
+    error("A precompiled header cannot define %s", node->str);
+  node->flags = flags;
+  vec_push(decls, node);
+  type_index(w, node->type);
+}
+
+void emit_pch(char *filename, char *outfile) {
+  char *text = read_file(filename);
+  char real[PATH_MAX];
+  struct stat st;
+  if (!realpath(filename, real) || stat(real, &st))
+    error("Can't stat the file: %s", filename);
+  char *p = preprocess(text, filename, NULL);
+  tokenize(p);
+  node_t *node = parse();
+  for (int i = 0; i < node->rhs->nlist; i++) {
+    if (child(node->rhs, i)->ty == ND_FUNC)
+      error("A precompiled header cannot define functions");
+  }
+
+  pch_writer_t *w = arena_alloc(ctx->heap, sizeof(pch_writer_t));
+  w->ints = new_buf();
+  w->strs = new_buf();
+  w->str_index = new_map();
+  w->type_index = new_map();
+  w->types = new_vec();
+  w->member_index = new_map();
+  w->members = new_vec();
+
+  vec_t *decls = new_vec();
+  for (int i = 0; i < node->nlist; i++) {
+    node_t *d = child(node, i);
+    if (d->ty != ND_VAR_DECL_LIST) {
+      if (d->ty != ND_NOP)
+        add_decl(w, decls, d, d->flags);
+      continue;
+    }
+    // Every name of `int a, b;` gets the storage class of the first.
+    node_t *first = child(d, 0);
+    for (int j = 0; j < d->nlist; j++)
+      add_decl(w, decls, child(d, j), first->flags);
+  }
+  for (int i = 0; i < map_len(ctx->types); i++)
+    type_index(w, vec_get(ctx->types->items, i));
+
+  // Number everything reachable before writing any of it.
+  for (int ti = 0, mi = 0; ti < vec_len(w->types) || mi < vec_len(w->members);) {
+    if (ti < vec_len(w->types)) {
+      type_t *ty = vec_get(w->types, ti++);
+      type_index(w, ty->ptr);
+      member_index(w, ty->member);
+      continue;
+    }
+    member_t *m = vec_get(w->members, mi++);
+    for (int i = 0; i < map_len(m->data); i++)
+      type_index(w, vec_get(m->data->items, i));
+  }
+
+  put_str(w, intern(real));
+  put_int(w, st.st_size);
+  put_int(w, st.st_mtime);
+  put_int(w, (long)st.st_mtime >> 32);
+  put_int(w, fnv1a(text, strlen(text)));
+  put_int(w, vec_len(w->types));
+  put_int(w, vec_len(w->members));
+  for (int i = 0; i < vec_len(w->types); i++) {
+    type_t *ty = vec_get(w->types, i);
+    put_int(w, ty->size);
+    put_int(w, ty->align);
+    put_int(w, ty->ty);
+    put_str(w, ty->name);
+    put_int(w, type_index(w, ty->ptr));
+    put_int(w, ty->size_deref);
+    put_int(w, ty->array_size);
+    put_int(w, member_index(w, ty->member));
+  }
+  for (int i = 0; i < vec_len(w->members); i++) {
+    member_t *m = vec_get(w->members, i);
+    put_int(w, m->size);
+    put_int(w, map_len(m->data));
+    for (int j = 0; j < map_len(m->data); j++) {
+      char *name = vec_get(m->data->keys, j);
+      put_str(w, name);
+      put_int(w, type_index(w, vec_get(m->data->items, j)));
+      put_int(w, (intptr_t)map_get(m->offset, name));
+    }
+  }
+
+  put_int(w, map_len(ctx->types));
+  for (int i = 0; i < map_len(ctx->types); i++) {
+    put_str(w, vec_get(ctx->types->keys, i));
+    put_int(w, type_index(w, vec_get(ctx->types->items, i)));
+  }
+  put_int(w, map_len(ctx->enum_list));
+  for (int i = 0; i < map_len(ctx->enum_list); i++) {
+    put_str(w, vec_get(ctx->enum_list->keys, i));
+    put_int(w, (intptr_t)vec_get(ctx->enum_list->items, i));
+  }
+  put_int(w, map_len(ctx->macros));
+  for (int i = 0; i < map_len(ctx->macros); i++) {
+    macro_t *m = vec_get(ctx->macros->items, i);
+    put_str(w, m->name);
+    put_int(w, m->params ? vec_len(m->params) : -1);
+    for (int j = 0; m->params && j < vec_len(m->params); j++)
+      put_str(w, vec_get(m->params, j));
+    put_int(w, vec_len(m->body));
+    for (int j = 0; j < vec_len(m->body); j++) {
+      pp_token_t *t = vec_get(m->body, j);
+      put_str(w, t->str);
+      put_int(w, t->param);
+      put_int(w, t->space);
+    }
+  }
+  put_int(w, vec_len(decls));
+  for (int i = 0; i < vec_len(decls); i++) {
+    node_t *d = vec_get(decls, i);
+    int flags = 0;
+    if (d->flags & NF_STATIC)
+      flags |= DECL_STATIC;
+    if (d->flags & NF_EXTERN)
+      flags |= DECL_EXTERN;
+    if (d->flags & NF_CONST)
+      flags |= DECL_CONST;
+    put_str(w, d->str);
+    put_int(w, type_index(w, d->type));
+    put_int(w, flags);
+  }
+
+  out_t *out = out_open(outfile);
+  char header[16];
+  memcpy(header, PCH_MAGIC, 8);
+  int strtab = 16 + w->ints->len;
+  for (int i = 0; i < 4; i++) {
+    header[8 + i] = (PCH_VERSION >> (i * 8)) & 0xff;
+    header[12 + i] = (strtab >> (i * 8)) & 0xff;
+  }
+  out_putn(out, header, 16);
+  out_putn(out, w->ints->data, w->ints->len);
+  out_putn(out, w->strs->data, w->strs->len);
+  out_close(out);
+}
+
+// Every count, index and offset read from the file is checked against its
+// size, so a truncated or damaged file is an error rather than a read past
+// its end.
+typedef struct {
+  char *path;
+  int *p;
+  int *end;    // end of the ints, where the string table starts
+  char *strs;
+  int nstrs;   // size of the string table
+  int *recs;   // type records
+  int ntypes;
+  int nmembers;
+  type_t **types;
+} pch_reader_t;
+
+static void corrupt(pch_reader_t *r) {
+  error("Corrupt precompiled header: %s", r->path);
+}
+
+static int get_int(pch_reader_t *r) {
+  if (r->p >= r->end)
+    corrupt(r);
+  return *r->p++;
+}
+
+// A count of records of `size` ints each, all of which must be in the file.
+static int get_count(pch_reader_t *r, int size) {
+  int n = get_int(r);
+  if (n < 0 || (long)n * size > r->end - r->p)
+    corrupt(r);
+  return n;
+}
+
+// `i` must index one of `n` things, or be -1 if `null` is allowed.
+static int check_index(pch_reader_t *r, int i, int n, bool null) {
+  if (i < (null ? -1 : 0) || i >= n)
+    corrupt(r);
+  return i;
+}
+
+// The string table is NUL-terminated, and read_file() terminates the file,
+// so a string that starts in the table ends before the end of the mapping.
+static char *str_at(pch_reader_t *r, int off) {
+  return check_index(r, off, r->nstrs, true) < 0 ? NULL
+                                                  : intern(r->strs + off);
+}
+
+static char *get_str(pch_reader_t *r) { return str_at(r, get_int(r)); }
+
+static char *get_name(pch_reader_t *r) {
+  char *s = get_str(r);
+  if (!s)
+    corrupt(r);
+  return s;
+}
+
+static type_t *get_type(pch_reader_t *r) {
+  return r->types[check_index(r, get_int(r), r->ntypes, false)];
+}
+
+// Pointers and arrays are made with pointer_to() and array_of(), so they are
+// the same objects the parser gets for them. A chain longer than the number
+// of types has a cycle.
+static type_t *load_type(pch_reader_t *r, int i, int depth) {
+  int *rec = r->recs + i * 8;
+  if (r->types[i])
+    return r->types[i];
+  if (depth > r->ntypes)
+    corrupt(r);
+  type_t *base = load_type(r, rec[4], depth + 1);
+  if (rec[2] == TY_PTR)
+    r->types[i] = pointer_to(base);
+  else
+    r->types[i] = array_of(base, rec[2] == TY_ARRAY ? rec[6] : -1);
+  return r->types[i];
+}
+
+// Rejects the file if the header it was made from has changed: its size or
+// mtime differ and so does the hash of its text.
+static void check_source(pch_reader_t *r) {
+  char *source = get_str(r);
+  long size = get_int(r);
+  long mtime = (unsigned int)get_int(r);
+  mtime |= (long)get_int(r) << 32;
+  int hash = get_int(r);
+  struct stat st;
+  if (!source || stat(source, &st))
+    error("Precompiled header %s: can't find its source", r->path);
+  if (st.st_size == size && st.st_mtime == mtime)
+    return;
+  char *text = read_file(source);
+  if (fnv1a(text, strlen(text)) != hash)
+    error("Precompiled header %s is out of date: %s has changed", r->path,
+          source);
+}
+
+// The file stays mapped for the rest of the compilation; the loaded state
+// is built in the context's AST arena.
+pch_t *load_pch(char *path) {
+  struct stat st;
+  if (stat(path, &st))
+    error("Can't open the file: %s", path);
+  char *s = read_file(path);
+  long size = st.st_size;
+  if (size < 16 || strncmp(s, PCH_MAGIC, 8))
+    error("Not a precompiled header: %s", path);
+  int *p = (int *)(s + 8);
+  if (*p++ != PCH_VERSION)
+    error("Precompiled header from another version of sicc: %s", path);
+  pch_reader_t *r = calloc(1, sizeof(pch_reader_t));
+  r->path = path;
+  int strtab = *p++;
+  if (strtab < 16 || strtab > size || strtab % 4)
+    corrupt(r);
+  r->p = p;
+  r->end = (int *)(s + strtab);
+  r->strs = s + strtab;
+  r->nstrs = size - strtab;
+  check_source(r);
+
+  r->ntypes = get_int(r);
+  r->nmembers = get_int(r);
+  if (r->ntypes < 0 || r->nmembers < 0 ||
+      (long)r->ntypes * 8 + (long)r->nmembers * 2 > r->end - r->p)
+    corrupt(r);
+  r->recs = r->p;
+  r->p += r->ntypes * 8;
+  r->types = calloc(r->ntypes + 1, sizeof(type_t *));
+  member_t **members = calloc(r->nmembers + 1, sizeof(member_t *));
+  for (int i = 0; i < r->nmembers; i++)
+    members[i] = arena_alloc(ctx->ast_arena, sizeof(member_t));
+  for (int i = 0; i < r->ntypes; i++) {
+    int *rec = r->recs + i * 8;
+    bool derived = rec[2] == TY_PTR || rec[2] == TY_ARRAY ||
+                   rec[2] == TY_ARRAY_NOSIZE;
+    check_index(r, rec[4], r->ntypes, !derived);
+    check_index(r, rec[7], r->nmembers, true);
+    if (derived)
+      continue;
+    type_t *ty = arena_alloc(ctx->ast_arena, sizeof(type_t));
+    ty->size = rec[0];
+    ty->align = rec[1];
+    ty->ty = rec[2];
+    ty->name = str_at(r, rec[3]);
+    ty->size_deref = rec[5];
+    ty->array_size = rec[6];
+    ty->member = rec[7] < 0 ? NULL : members[rec[7]];
+    r->types[i] = ty;
+  }
+  for (int i = 0; i < r->ntypes; i++)
+    load_type(r, i, 0);
+  for (int i = 0; i < r->nmembers; i++) {
+    member_t *m = members[i];
+    m->size = get_int(r);
+    m->data = new_map();
+    m->offset = new_map();
+    for (int nfields = get_count(r, 3); nfields > 0; nfields--) {
+      char *name = get_name(r);
+      map_put(m->data, name, get_type(r));
+      map_put(m->offset, name, (void *)(intptr_t)get_int(r));
+    }
+  }
+
+  pch_t *pch = arena_alloc(ctx->heap, sizeof(pch_t));
+  pch->types = new_map();
+  pch->enum_list = new_map();
+  pch->macros = new_map();
+  pch->decls = new_vec();
+  for (int n = get_count(r, 2); n > 0; n--) {
+    char *name = get_name(r);
+    map_put(pch->types, name, get_type(r));
+  }
+  for (int n = get_count(r, 2); n > 0; n--) {
+    char *name = get_name(r);
+    map_put(pch->enum_list, name, (void *)(intptr_t)get_int(r));
+  }
+  for (int n = get_count(r, 3); n > 0; n--) {
+    macro_t *m = arena_alloc(ctx->heap, sizeof(macro_t));
+    m->name = get_name(r);
+    int nparams = get_int(r);
+    if (nparams < -1 || nparams > r->end - r->p)
+      corrupt(r);
+    if (nparams >= 0)
+      m->params = new_vec();
+    for (int i = 0; i < nparams; i++)
+      vec_push(m->params, get_name(r));
+    m->body = new_vec();
+    for (int ntokens = get_count(r, 3); ntokens > 0; ntokens--) {
+      pp_token_t *t = arena_alloc(ctx->heap, sizeof(pp_token_t));
+      t->str = get_name(r);
+      // A parameter slot indexes the arguments of a call.
+      t->param = check_index(r, get_int(r), nparams > 0 ? nparams : 0, true);
+      t->space = get_int(r);
+      vec_push(m->body, t);
+    }
+    map_put(pch->macros, m->name, m);
+  }
+  for (int n = get_count(r, 3); n > 0; n--) {
+    node_t *node = new_node(ND_EXT_VAR_DECL);
+    node->str = get_name(r);
+    node->type = get_type(r);
+    int flags = get_int(r);
+    if (flags & DECL_STATIC)
+      node->flags |= NF_STATIC;
+    if (flags & DECL_EXTERN)
+      node->flags |= NF_EXTERN;
+    if (flags & DECL_CONST)
+      node->flags |= NF_CONST;
+    vec_push(pch->decls, node);
+  }
+  free(r->types);
+  free(r);
+  free(members);
+  return pch;
+}
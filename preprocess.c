@@ -1,37 +1,29 @@
 #include "sicc.h"
 
 #include <ctype.h>
+#include <dirent.h>
+#include <limits.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #define SKIP_SPACE(e)                                                          \
   while (isspace(peek(e, 0)))                                                  \
   eat(e)
 
-map_t *macros;
-
-typedef struct _macro {
-  char *name;
-  buf_t *macro_buf;
-  int macro_size;
-  int args_len;
-} macro_t;
-
 static char peek(pp_env_t *e, int offset);
 static char eat(pp_env_t *e);
 static bool is_eof(pp_env_t *e);
 static pp_env_t *new_env(char *s);
-static macro_t *new_macro(char *name);
+static macro_t *new_macro(char *name, arena_t *a);
 static char *get_string(pp_env_t *e);
-static char *peek_string(pp_env_t *e, int offset);
-static bool cmp_string(pp_env_t *e, char *str, int offset);
 static macro_t *parse_macro(pp_env_t *e);
-static map_t *parse_args(pp_env_t *e);
-static vec_t *parse_params(pp_env_t *e, char *name);
 static void replace_macro(pp_env_t *e, buf_t *b);
-static void parse_include(pp_env_t *e, buf_t *b);
-static void parse_if_section(pp_env_t *e, buf_t *b, char *directive);
-static void pp_next(pp_env_t *e, buf_t *b);
+static void parse_include(pp_t *pp, pp_env_t *e);
+static void pp_next(pp_t *pp, buf_t *b);
 
 static char peek(pp_env_t *e, int offset) { return e->s[e->cur_p + offset]; }
 
@@ -43,236 +35,933 @@ static bool is_eof(pp_env_t *e) {
 }
 
 static pp_env_t *new_env(char *s) {
-  pp_env_t *e = calloc(1, sizeof(pp_env_t));
+  pp_env_t *e = arena_alloc(ctx->heap, sizeof(pp_env_t));
   e->s = s;
   e->cur_p = 0;
   return e;
 }
 
-static macro_t *new_macro(char *name) {
-  macro_t *macro = calloc(1, sizeof(macro_t));
+static pp_t *new_pp(pp_env_t *e) {
+  pp_t *pp = arena_alloc(ctx->heap, sizeof(pp_t));
+  pp->env = e;
+  pp->conds = new_vec();
+  return pp;
+}
+
+// A conditional stack entry records whether its current branch is skipped
+// and whether an enclosing one is.
+#define COND_SKIP 1
+#define COND_PARENT_SKIP 2
+
+static bool is_skipping(pp_t *pp) {
+  int len = vec_len(pp->conds);
+  if (len == 0)
+    return false;
+  return (intptr_t)vec_get(pp->conds, len - 1) != 0;
+}
+
+static void push_cond(pp_t *pp, bool skip) {
+  int cond = skip ? COND_SKIP : 0;
+  if (is_skipping(pp))
+    cond |= COND_PARENT_SKIP;
+  vec_push(pp->conds, (void *)(intptr_t)cond);
+}
+
+static void else_cond(pp_t *pp) {
+  int len = vec_len(pp->conds);
+  if (len == 0)
+    return;
+  intptr_t cond = (intptr_t)vec_get(pp->conds, len - 1);
+  vec_set(pp->conds, len - 1, (void *)(cond ^ COND_SKIP));
+}
+
+// A NULL arena makes a macro that is malloc'd to outlive the context.
+static macro_t *new_macro(char *name, arena_t *a) {
+  macro_t *macro =
+      a ? arena_alloc(a, sizeof(macro_t)) : calloc(1, sizeof(macro_t));
   macro->name = name;
+  macro->body = arena_vec(a);
   return macro;
 }
 
 static char *get_string(pp_env_t *e) {
-  buf_t *b = new_buf();
+  int start = e->cur_p;
   if (!(isalpha(peek(e, 0)) || peek(e, 0) == '_')) {
-    buf_push(b, eat(e));
-    return buf_str(b);
+    eat(e);
+    return intern_n(e->s + start, 1);
   }
 
   while (isalnum(peek(e, 0)) || peek(e, 0) == '_') {
-    buf_push(b, eat(e));
+    eat(e);
   }
-  return buf_str(b);
+  return intern_n(e->s + start, e->cur_p - start);
 }
 
-static char *peek_string(pp_env_t *e, int offset) {
-  buf_t *b = new_buf();
-  int i = offset;
-  if (!isalpha(peek(e, i)))
+// Punctuators of more than one character, longest first.
+static char *puncts[] = {"<<=", ">>=", "...", "->", "++", "--", "<<", ">>",
+                         "<=",  ">=",  "==",  "!=", "&&", "||", "+=", "-=",
+                         "*=",  "/=",  "%=",  "&=", "^=", "|=", "##"};
+
+static bool is_ident_char(char c) { return isalnum(c) || c == '_'; }
+
+// Whether `a` written right before `b` would read as one token, or start a
+// comment.
+static bool pastes(char a, char b) {
+  if (is_ident_char(a) && (is_ident_char(b) || b == '.'))
+    return true;
+  if (a == '/' && (b == '/' || b == '*'))
+    return true;
+  for (int i = 0; i < sizeof(puncts) / sizeof(*puncts); i++) {
+    if (puncts[i][0] == a && puncts[i][1] == b)
+      return true;
+  }
+  return false;
+}
+
+static pp_token_t *new_token(char *str, bool space) {
+  pp_token_t *t = arena_alloc(ctx->token_arena, sizeof(pp_token_t));
+  t->str = str;
+  t->param = -1;
+  t->space = space;
+  return t;
+}
+
+// Skips white space and comments. Newlines are only skipped if `lines` is
+// set; each one skipped is counted in `*newlines`.
+static bool skip_space(pp_env_t *e, bool lines, int *newlines) {
+  bool space = false;
+  for (;;) {
+    char c = peek(e, 0);
+    if (c == '\\' && peek(e, 1) == '\n') {
+      e->cur_p += 2;
+      (*newlines)++;
+    } else if (c == '\n' && lines) {
+      eat(e);
+      (*newlines)++;
+    } else if (c == '/' && peek(e, 1) == '/') {
+      while ((c = peek(e, 0)) && c != '\n')
+        eat(e);
+    } else if (c == '/' && peek(e, 1) == '*') {
+      e->cur_p += 2;
+      while ((c = peek(e, 0)) && !(c == '*' && peek(e, 1) == '/')) {
+        if (eat(e) == '\n')
+          (*newlines)++;
+      }
+      if (c)
+        e->cur_p += 2;
+    } else if (c != '\n' && isspace(c)) {
+      eat(e);
+    } else {
+      return space;
+    }
+    space = true;
+  }
+}
+
+// Reads the next preprocessing token, or returns NULL at the end of the line
+// (with `lines`, only at the end of the input).
+static pp_token_t *read_token(pp_env_t *e, bool lines, int *newlines) {
+  bool space = skip_space(e, lines, newlines);
+  char c = peek(e, 0);
+  if (!c || c == '\n')
     return NULL;
-  while (peek(e, i) == ' ')
-    i++;
-  for (; isalnum(peek(e, i)) || peek(e, i) == '_'; i++) {
-    buf_push(b, peek(e, i));
+  int start = e->cur_p;
+  if (is_ident_char(c) || (c == '.' && isdigit(peek(e, 1)))) {
+    // Identifiers and numbers, exponent signs included.
+    while (is_ident_char(c = peek(e, 0)) || c == '.' ||
+           ((c == '+' || c == '-') && strchr("eEpP", peek(e, -1)) &&
+            isdigit(e->s[start])))
+      eat(e);
+  } else if (c == '"' || c == '\'') {
+    eat(e);
+    char d;
+    while ((d = peek(e, 0)) && d != c && d != '\n') {
+      if (eat(e) == '\\' && peek(e, 0))
+        eat(e);
+    }
+    if (d == c)
+      eat(e);
+  } else {
+    int len = 1;
+    for (int i = 0; i < sizeof(puncts) / sizeof(*puncts); i++) {
+      if (!strncmp(e->s + start, puncts[i], strlen(puncts[i]))) {
+        len = strlen(puncts[i]);
+        break;
+      }
+    }
+    e->cur_p += len;
   }
-  return buf_str(b);
+  return new_token(intern_n(e->s + start, e->cur_p - start), space);
 }
 
-static bool cmp_string(pp_env_t *e, char *str, int offset) {
-  char *comp = peek_string(e, offset);
-  if (!comp)
-    return false;
-  if (!strcmp(comp, str))
-    return true;
-  return false;
+// Token strings are interned, so punctuators compare by address.
+static bool is_punct(pp_token_t *t, char *s) {
+  return t->str == intern_lit(s);
 }
 
+// The body is read into tokens once, with each use of a parameter replaced
+// by a slot for the argument, so that an expansion only splices tokens.
 static macro_t *parse_macro(pp_env_t *e) {
   char *name = get_string(e);
-  macro_t *m = new_macro(name);
-  map_t *args = parse_args(e);
-  buf_t *buf = new_buf();
-  int args_len = map_len(args);
-  char c;
-  while ((c = peek(e, 0)) != '\n') {
-    if (c == '\\') {
-      eat(e);
-      SKIP_SPACE(e);
-    } else if (isalpha(c) && args_len) {
-      // if an argument is used in macro
-      char *str = get_string(e);
-      if (map_find(args, str)) {
-        buf_append(buf, "%s");
-      } else {
-        buf_append(buf, str);
+  macro_t *m = new_macro(name, ctx->heap);
+  int newlines = 0;
+  if (peek(e, 0) == '(') {
+    eat(e);
+    m->params = new_vec();
+    pp_token_t *t;
+    while ((t = read_token(e, false, &newlines)) && !is_punct(t, ")")) {
+      if (!is_punct(t, ","))
+        vec_push(m->params, t->str);
+    }
+  }
+
+  pp_token_t *t;
+  while ((t = read_token(e, false, &newlines))) {
+    pp_token_t *b = arena_alloc(ctx->heap, sizeof(pp_token_t));
+    *b = *t;
+    for (int i = 0; m->params && i < vec_len(m->params); i++) {
+      if (vec_get(m->params, i) == t->str)
+        b->param = i;
+    }
+    vec_push(m->body, b);
+  }
+  if (vec_len(m->body))
+    ((pp_token_t *)vec_get(m->body, 0))->space = false;
+  return m;
+}
+
+static bool is_active(vec_t *active, macro_t *m) {
+  for (int i = 0; i < vec_len(active); i++) {
+    if (vec_get(active, i) == m)
+      return true;
+  }
+  return false;
+}
+
+static macro_t *lookup_macro(char *name);
+
+static macro_t *find_macro(pp_token_t *t) {
+  return t->param < 0 && is_ident_start(t->str[0]) ? lookup_macro(t->str)
+                                                  : NULL;
+}
+
+// Splits the arguments of the call whose '(' is at in[*pos] at the commas
+// outside of nested parentheses, and leaves *pos after the ')'.
+static vec_t *read_args(vec_t *in, int *pos, macro_t *m) {
+  vec_t *args = arena_vec(ctx->token_arena);
+  vec_t *arg = arena_vec(ctx->token_arena);
+  int depth = 0;
+  for (int i = *pos + 1; i < vec_len(in); i++) {
+    pp_token_t *t = vec_get(in, i);
+    if (depth == 0 && (is_punct(t, ",") || is_punct(t, ")"))) {
+      vec_push(args, arg);
+      arg = arena_vec(ctx->token_arena);
+      if (is_punct(t, ")")) {
+        *pos = i + 1;
+        // f() passes no arguments rather than one empty one.
+        if (vec_len(m->params) == 0 && vec_len(args) == 1 &&
+            vec_len(vec_get(args, 0)) == 0)
+          vec_pop(args);
+        if (vec_len(args) != vec_len(m->params))
+          error("%s macro takes %d arguments, but got %d", m->name,
+                vec_len(m->params), vec_len(args));
+        return args;
       }
+      continue;
+    }
+    if (is_punct(t, "("))
+      depth++;
+    else if (is_punct(t, ")"))
+      depth--;
+    vec_push(arg, t);
+  }
+  error("Unterminated arguments of %s macro", m->name);
+  return NULL;
+}
+
+static vec_t *expand(vec_t *in, vec_t *active);
+
+// Replaces the parameter slots of the body with the arguments, each expanded
+// once however often it is used, then expands the result again with the
+// macro itself turned off.
+static vec_t *subst(macro_t *m, vec_t *args, vec_t *active, bool space) {
+  vec_t *expanded = arena_vec(ctx->token_arena);
+  for (int i = 0; args && i < vec_len(args); i++)
+    vec_push(expanded, NULL);
+  vec_t *out = arena_vec(ctx->token_arena);
+  for (int i = 0; i < vec_len(m->body); i++) {
+    pp_token_t *t = vec_get(m->body, i);
+    if (t->param < 0) {
+      vec_push(out, t);
+      continue;
+    }
+    vec_t *arg = vec_get(expanded, t->param);
+    if (!arg) {
+      arg = expand(vec_get(args, t->param), active);
+      vec_set(expanded, t->param, arg);
+    }
+    for (int j = 0; j < vec_len(arg); j++) {
+      pp_token_t *a = vec_get(arg, j);
+      if (j == 0 && a->space != t->space) {
+        a = new_token(a->str, t->space);
+      }
+      vec_push(out, a);
+    }
+  }
+  if (vec_len(out) && ((pp_token_t *)vec_get(out, 0))->space != space) {
+    pp_token_t *t = vec_get(out, 0);
+    vec_set(out, 0, new_token(t->str, space));
+  }
+
+  vec_push(active, m);
+  out = expand(out, active);
+  vec_pop(active);
+  return out;
+}
+
+// Expands every macro in `in`, except for those in `active`, which are being
+// expanded already.
+static vec_t *expand(vec_t *in, vec_t *active) {
+  vec_t *out = arena_vec(ctx->token_arena);
+  for (int i = 0; i < vec_len(in);) {
+    pp_token_t *t = vec_get(in, i);
+    macro_t *m = find_macro(t);
+    if (!m || is_active(active, m)) {
+      vec_push(out, t);
+      i++;
+      continue;
+    }
+    vec_t *args = NULL;
+    if (m->params) {
+      // A function-like macro's name without arguments is left alone.
+      if (i + 1 == vec_len(in) || !is_punct(vec_get(in, i + 1), "(")) {
+        vec_push(out, t);
+        i++;
+        continue;
+      }
+      i++;
+      args = read_args(in, &i, m);
     } else {
-      buf_push(buf, eat(e));
+      i++;
     }
+    vec_t *r = subst(m, args, active, t->space);
+    for (int j = 0; j < vec_len(r); j++)
+      vec_push(out, vec_get(r, j));
   }
-  m->macro_buf = buf;
-  m->macro_size = buf_len(buf);
-  m->args_len = args_len;
-  return m;
+  return out;
 }
 
-static map_t *parse_args(pp_env_t *e) {
-  map_t *args = new_map();
-  if (peek(e, 0) != '(')
-    return args;
-  eat(e);
-  while (peek(e, 0) != ')') {
-    map_put(args, get_string(e), NULL);
-    char c;
-    while ((c = peek(e, 0)) && (isspace(c) || c == ','))
-      eat(e);
+static void put_token(buf_t *b, pp_token_t *t) {
+  if (t->space || (b->len && pastes(b->data[b->len - 1], t->str[0])))
+    buf_push(b, ' ');
+  buf_append(b, t->str);
+}
+
+// Reads the call of the function-like macro `name` from the input, from its
+// '(' to the matching ')'. Returns NULL, reading nothing, if no '(' follows.
+static vec_t *read_call(pp_env_t *e, pp_token_t *name, int *newlines) {
+  int p = e->cur_p;
+  int n = 0;
+  pp_token_t *t = read_token(e, true, &n);
+  if (!t || !is_punct(t, "(")) {
+    e->cur_p = p;
+    return NULL;
   }
-  eat(e);
-  return args;
+  *newlines += n;
+  vec_t *call = arena_vec(ctx->token_arena);
+  vec_push(call, name);
+  vec_push(call, t);
+  for (int depth = 1; depth > 0;) {
+    if (!(t = read_token(e, true, newlines)))
+      error("Unterminated arguments of %s macro", name->str);
+    if (is_punct(t, "("))
+      depth++;
+    else if (is_punct(t, ")"))
+      depth--;
+    vec_push(call, t);
+  }
+  return call;
 }
 
-static vec_t *parse_params(pp_env_t *e, char *name) {
-  vec_t *params = new_vec();
-  SKIP_SPACE(e);
-  if (eat(e) != '(')
-    error("%s macro requires arguments", name);
+// Expands the macro whose name starts at the current position of the input.
+// A function-like macro's expansion may end in the name of another one
+// whose arguments follow in the input.
+static void replace_macro(pp_env_t *e, buf_t *b) {
+  int newlines = 0;
+  pp_token_t *name = read_token(e, false, &newlines);
+  for (;;) {
+    vec_t *call;
+    macro_t *m = find_macro(name);
+    if (!m->params) {
+      call = arena_vec(ctx->token_arena);
+      vec_push(call, name);
+    } else if (!(call = read_call(e, name, &newlines))) {
+      put_token(b, name);
+      break;
+    }
+    vec_t *r = expand(call, arena_vec(ctx->token_arena));
+    int len = vec_len(r);
+    pp_token_t *last = len ? vec_get(r, len - 1) : NULL;
+    macro_t *next = last ? find_macro(last) : NULL;
+    if (next && next->params)
+      len--;
+    for (int i = 0; i < len; i++)
+      put_token(b, vec_get(r, i));
+    if (len == vec_len(r))
+      break;
+    name = last;
+  }
+  if (b->len && pastes(b->data[b->len - 1], peek(e, 0)))
+    buf_push(b, ' ');
+  // Arguments spread over several lines keep the line count.
+  for (; newlines > 0; newlines--)
+    buf_push(b, '\n');
+}
 
-  char c;
+// Expanded headers kept by the compile server across compilations. A header
+// is expanded on its own, starting with an empty macro table, and the names
+// it looks up before defining them are recorded. The expansion is only used
+// where none of those names is a macro, so it is what the header would have
+// expanded to in place; anywhere else the header is expanded in place.
+typedef struct {
+  char *path;
+  long mtime;
+  long size;
+  int hash;
+  char *text;      // expansion
+  vec_t *macros;   // macro_t copies left defined at the end of the header
+  vec_t *includes; // cache keys of headers it includes
+  map_t *uses;     // names looked up while not defined
+} include_entry_t;
+
+static map_t *include_cache;
+static vec_t *recording; // entries being expanded, innermost last
+
+int include_cache_hits = 0;
+int include_cache_misses = 0;
+
+// Called before each compilation. The cache is kept; a compilation that
+// failed may have left entries in `recording`.
+void enable_include_cache() {
+  if (!include_cache)
+    include_cache = arena_map(NULL);
+  if (recording)
+    free_vec(recording);
+  recording = arena_vec(NULL);
+}
+
+// Hashes the file into a buffer freed right after, so that nothing is kept
+// after the check.
+static bool hash_file(char *path, int *hash) {
+  int fd = open(path, O_RDONLY);
+  if (fd == -1)
+    return false;
   buf_t *b = new_buf();
-  while ((c = peek(e, 0)) != ')') {
-    while ((c = peek(e, 0)) != ',' && c != ')')
-      buf_push(b, eat(e));
-    vec_push(params, buf_str(b));
-    b = new_buf();
-    while ((c = peek(e, 0)) && (isspace(c) || c == ','))
-      eat(e);
+  char chunk[4096];
+  ssize_t nread;
+  while ((nread = read(fd, chunk, sizeof(chunk))) > 0)
+    buf_appendn(b, chunk, nread);
+  close(fd);
+  *hash = fnv1a(b->data, b->len);
+  free_buf(b);
+  return nread == 0;
+}
+
+static char *dup_str(char *s) { return strdup(s); }
+
+// Records that the header being expanded for the cache depends on `name` not
+// being a macro.
+static void note_use(char *name) {
+  int len = recording ? vec_len(recording) : 0;
+  if (!len)
+    return;
+  include_entry_t *ent = vec_get(recording, len - 1);
+  if (!map_find(ent->uses, name))
+    map_put(ent->uses, strdup(name), NULL);
+}
+
+static macro_t *lookup_macro(char *name) {
+  macro_t *m = map_get(ctx->macros, name);
+  if (!m)
+    note_use(name);
+  return m;
+}
+
+// The copy belongs to the current context, or with `keep` is malloc'd and
+// owns its strings, to outlive it.
+static macro_t *copy_macro(macro_t *m, bool keep) {
+  char *(*str)(char *) = keep ? dup_str : intern;
+  arena_t *a = keep ? NULL : ctx->heap;
+  macro_t *c = new_macro(str(m->name), a);
+  if (m->params) {
+    c->params = arena_vec(a);
+    for (int i = 0; i < vec_len(m->params); i++)
+      vec_push(c->params, str(vec_get(m->params, i)));
   }
-  eat(e);
-  return params;
+  for (int i = 0; i < vec_len(m->body); i++) {
+    pp_token_t *t = vec_get(m->body, i);
+    pp_token_t *u =
+        a ? arena_alloc(a, sizeof(pp_token_t)) : malloc(sizeof(pp_token_t));
+    *u = *t;
+    u->str = str(t->str);
+    vec_push(c->body, u);
+  }
+  return c;
 }
 
-static void replace_macro(pp_env_t *e, buf_t *b) {
-  char *str = get_string(e);
-  if (map_find(macros, str)) {
-    macro_t *m = map_get(macros, str);
-    int src_len = buf_len(m->macro_buf);
-    char *orig_buf = buf_str(m->macro_buf);
-    if (m->args_len) {
-      vec_t *params = parse_params(e, str);
-      char *src = calloc(1, sizeof(char) * src_len);
-      for (int i = 0; i < vec_len(params); i++) {
-        write_one_fmt(src, orig_buf, (char *)vec_get(params, i));
-        strcpy(orig_buf, src);
-      }
-      buf_append(b, src);
+// Frees a copy made with `keep`.
+static void free_macro(macro_t *m) {
+  free(m->name);
+  for (int i = 0; m->params && i < vec_len(m->params); i++)
+    free(vec_get(m->params, i));
+  if (m->params)
+    free_vec(m->params);
+  for (int i = 0; i < vec_len(m->body); i++) {
+    pp_token_t *t = vec_get(m->body, i);
+    free(t->str);
+    free(t);
+  }
+  free_vec(m->body);
+  free(m);
+}
+
+static void free_entry(include_entry_t *ent) {
+  free(ent->path);
+  free(ent->text);
+  for (int i = 0; i < vec_len(ent->macros); i++)
+    free_macro(vec_get(ent->macros, i));
+  free_vec(ent->macros);
+  for (int i = 0; i < vec_len(ent->includes); i++)
+    free(vec_get(ent->includes, i));
+  free_vec(ent->includes);
+  for (int i = 0; i < map_len(ent->uses); i++)
+    free(vec_get(ent->uses->keys, i));
+  free_map(ent->uses);
+  free(ent);
+}
+
+// An entry is fresh if neither it nor anything it includes has changed. A
+// file whose mtime or size changed is still fresh if its text hashes the same.
+static bool is_fresh(include_entry_t *ent) {
+  struct stat st;
+  if (stat(ent->path, &st))
+    return false;
+  if (st.st_mtime != ent->mtime || st.st_size != ent->size) {
+    int hash;
+    if (!hash_file(ent->path, &hash) || hash != ent->hash)
+      return false;
+    ent->mtime = st.st_mtime;
+    ent->size = st.st_size;
+  }
+  for (int i = 0; i < vec_len(ent->includes); i++) {
+    include_entry_t *inc = map_get(include_cache, vec_get(ent->includes, i));
+    if (!inc || !is_fresh(inc))
+      return false;
+  }
+  return true;
+}
+
+static char *skip_blank(char *p) {
+  for (;;) {
+    while (isspace(*p))
+      p++;
+    if (p[0] == '/' && p[1] == '/') {
+      while (*p && *p != '\n')
+        p++;
+    } else if (p[0] == '/' && p[1] == '*') {
+      char *end = strstr(p + 2, "*/");
+      if (!end)
+        return p + strlen(p);
+      p = end + 2;
     } else {
-      buf_append(b, orig_buf);
+      return p;
     }
+  }
+}
+
+// Returns the text after `#name` if the line at `p` is that directive.
+static char *directive(char *p, char *name) {
+  while (*p == ' ' || *p == '\t')
+    p++;
+  if (*p++ != '#')
+    return NULL;
+  while (*p == ' ' || *p == '\t')
+    p++;
+  int len = strlen(name);
+  if (strncmp(p, name, len) || isalnum(p[len]) || p[len] == '_')
+    return NULL;
+  p += len;
+  while (*p == ' ' || *p == '\t')
+    p++;
+  return p;
+}
+
+static char *directive_name(char *p) {
+  int len = 0;
+  while (isalnum(p[len]) || p[len] == '_')
+    len++;
+  return len ? intern_n(p, len) : NULL;
+}
+
+static char *next_line(char *p) {
+  while (*p && *p != '\n')
+    p++;
+  return *p ? p + 1 : p;
+}
+
+// Looks for pragma once and for an include guard: an #ifndef X, #define X
+// section that holds the whole file, with only blank lines and comments
+// outside it.
+static void scan_header(include_file_t *f, char *s) {
+  char *p = skip_blank(s);
+  char *q = directive(p, "ifndef");
+  char *guard = q ? directive_name(q) : NULL;
+  if (guard) {
+    p = skip_blank(next_line(q));
+    q = directive(p, "define");
+    if (!q || directive_name(q) != guard)
+      guard = NULL;
+  }
+
+  // Only #ifndef opens a section in this preprocessor.
+  int depth = guard ? 1 : 0;
+  if (guard)
+    p = next_line(q);
+  for (; *p; p = next_line(p)) {
+    if (directive(p, "ifndef")) {
+      depth++;
+    } else if (directive(p, "else")) {
+      if (depth == 1)
+        guard = NULL;
+    } else if (directive(p, "endif")) {
+      if (depth > 0 && --depth == 0 && *skip_blank(next_line(p)))
+        guard = NULL;
+    } else if ((q = directive(p, "pragma")) && directive_name(q) ==
+               intern_lit("once")) {
+      f->once = true;
+    }
+  }
+  if (depth != 0)
+    guard = NULL;
+  f->guard = guard;
+}
+
+static vec_t *include_paths;
+static char *include_key = ""; // the paths joined, part of cache keys
+
+// The compile server sets the paths before each command, outside of any
+// context, so the previous ones are freed here.
+void set_include_paths(vec_t *paths) {
+  if (include_paths) {
+    free_vec(include_paths);
+    free(include_key);
+  }
+  include_paths = paths;
+  buf_t *b = new_buf();
+  for (int i = 0; i < vec_len(paths); i++) {
+    buf_push(b, '\n');
+    buf_append(b, vec_get(paths, i));
+  }
+  include_key = strdup(buf_str(b));
+  free_buf(b);
+}
+
+// Directories are read once per compilation, so finding a header takes a
+// lookup per search path instead of a failed open.
+static bool file_exists(char *path) {
+  char *slash = strrchr(path, '/');
+  char *dir = slash ? intern_n(path, slash - path) : ".";
+  char *base = slash ? slash + 1 : path;
+  if (slash == path)
+    dir = "/";
+  map_t *entries = map_get(ctx->include_dirs, dir);
+  if (!entries) {
+    entries = new_map();
+    DIR *d = opendir(dir);
+    struct dirent *ent;
+    while (d && (ent = readdir(d)))
+      map_put(entries, intern(ent->d_name), NULL);
+    if (d)
+      closedir(d);
+    map_put(ctx->include_dirs, dir, entries);
+  }
+  return map_find(entries, base);
+}
+
+// "name" is looked up relative to the current directory and then on the
+// include paths, <name> on the include paths only. Returns NULL if the
+// header is not found.
+static include_file_t *find_include(char *name, bool angled) {
+  char *key = angled ? format("<%s>", name) : name;
+  include_file_t *f = map_get(ctx->include_files, key);
+  if (f)
+    return f;
+
+  char *path = NULL;
+  if (name[0] == '/' || !angled) {
+    if (file_exists(name))
+      path = name;
+  }
+  for (int i = 0; !path && name[0] != '/' && i < vec_len(include_paths); i++) {
+    char *cand = format("%s/%s", vec_get(include_paths, i), name);
+    if (file_exists(cand))
+      path = cand;
+  }
+  if (!path)
+    return NULL;
+
+  // Different names for the same file share its entry.
+  char real[PATH_MAX];
+  if (!realpath(path, real))
+    return NULL;
+  f = map_get(ctx->include_files, real);
+  if (!f) {
+    f = arena_alloc(ctx->heap, sizeof(include_file_t));
+    f->path = format("%s", real);
+    map_put(ctx->include_files, f->path, f);
+  }
+  map_put(ctx->include_files, key, f);
+  return f;
+}
+
+// Expands the header on its own and caches the result under `key`.
+static include_entry_t *cache_header(include_file_t *f, char *key) {
+  include_entry_t *ent = calloc(1, sizeof(include_entry_t));
+  ent->path = strdup(f->path);
+  ent->macros = arena_vec(NULL);
+  ent->includes = arena_vec(NULL);
+  ent->uses = arena_map(NULL);
+  char *s = f->text;
+  struct stat st;
+  stat(f->path, &st);
+  ent->mtime = st.st_mtime;
+  ent->size = st.st_size;
+  ent->hash = fnv1a(s, strlen(s));
+
+  // The header is expanded as if nothing had been included before it, so
+  // that the expansion can be reused by any includer that leaves the names
+  // it uses undefined.
+  map_t *files = ctx->include_files;
+  pch_t *pch = ctx->pch;
+  map_t *macros = ctx->macros;
+  ctx->include_files = new_map();
+  ctx->pch = NULL;
+  vec_push(recording, ent);
+  ent->text = strdup(preprocess(s, f->path, NULL));
+  vec_pop(recording);
+
+  // The context's interned names die with it, so the copies own theirs.
+  for (int i = 0; i < map_len(ctx->macros); i++) {
+    macro_t *m = vec_get(ctx->macros->items, i);
+    vec_push(ent->macros, copy_macro(m, true));
+  }
+  ctx->include_files = files;
+  ctx->pch = pch;
+  ctx->macros = macros;
+  include_entry_t *old = map_get(include_cache, key);
+  if (old) {
+    map_set(include_cache, key, ent);
+    free_entry(old);
   } else {
-    buf_append(b, str);
+    map_put(include_cache, strdup(key), ent);
+  }
+  return ent;
+}
+
+// Returns the cached expansion of the header, or NULL if it has to be
+// expanded in place because the includer defines a name it uses.
+static include_entry_t *cached_include(include_file_t *f) {
+  char *key = format("%s%s", f->path, include_key);
+  int len = vec_len(recording);
+  if (len)
+    vec_push(((include_entry_t *)vec_get(recording, len - 1))->includes,
+             strdup(key));
+
+  include_entry_t *ent = map_get(include_cache, key);
+  bool fresh = ent && is_fresh(ent);
+  if (!fresh)
+    ent = cache_header(f, key);
+  for (int i = 0; i < map_len(ent->uses); i++) {
+    if (map_find(ctx->macros, vec_get(ent->uses->keys, i))) {
+      include_cache_misses++;
+      return NULL;
+    }
   }
+  // A header being cached that includes this one uses the same names.
+  for (int i = 0; i < map_len(ent->uses); i++)
+    note_use(vec_get(ent->uses->keys, i));
+  if (fresh)
+    include_cache_hits++;
+  else
+    include_cache_misses++;
+  return ent;
 }
 
-static void parse_include(pp_env_t *e, buf_t *b) {
+static void parse_include(pp_t *pp, pp_env_t *e) {
   SKIP_SPACE(e);
+  char open = peek(e, 0);
+  if (open != '\"' && open != '<')
+    return;
+  char close = open == '<' ? '>' : '\"';
+  eat(e);
+  buf_t *name = new_buf();
   char c;
-  if ((c = peek(e, 0)) == '\"') {
-    eat(e);
-    buf_t *name = new_buf();
-    while ((c = peek(e, 0)) && c != '\"')
-      buf_push(name, eat(e));
-    eat(e);
-    char *filename = buf_str(name);
-    char *s = read_file(filename);
-    char *pp_s = preprocess(s, filename, NULL);
-    buf_append(b, pp_s);
-  } else if (c == '<') {
-    eat(e);
-    // ignore
-    while (peek(e, 0) != '>' && peek(e, 0))
-      eat(e);
+  while ((c = peek(e, 0)) && c != close && c != '\n')
+    buf_push(name, eat(e));
+  if (c == close)
     eat(e);
-  }
-}
+  char *filename = buf_str(name);
 
-static void parse_if_section(pp_env_t *e, buf_t *b, char *directive) {
-  if (!strcmp(directive, "ifndef")) {
-    SKIP_SPACE(e);
-    char *name = get_string(e);
-    if (!map_find(macros, name)) {
-      while (!is_eof(e)) {
-        if (peek(e, 0) == '#' && cmp_string(e, "endif", 1)) {
-          eat(e);
-          get_string(e);
-          return;
-        }
-        pp_next(e, b);
-      }
+  include_file_t *f = find_include(filename, open == '<');
+  if (!f) {
+    // There are no system headers; <...> not on the include path is ignored.
+    if (open == '<')
       return;
-    } else {
-      buf_t *tmp = new_buf();
-      while (!is_eof(e)) {
-        if (peek(e, 0) == '#' && cmp_string(e, "endif", 1)) {
-          eat(e);
-          get_string(e);
-          return;
-        } else if (peek(e, 0) == '#' && cmp_string(e, "else", 1)) {
-          pp_next(e, b);
-          return;
-        }
-        pp_next(e, tmp);
-      }
-      return;
-    }
-  } else if (!strcmp(directive, "else")) {
-    while (!is_eof(e)) {
-      if (peek(e, 0) == '#' && cmp_string(e, "endif", 1)) {
-        eat(e);
-        get_string(e);
-        return;
-      }
-      pp_next(e, b);
+    error("Can't open the file: %s", filename);
+  }
+  if (!f->text) {
+    f->text = read_file(f->path);
+    scan_header(f, f->text);
+  }
+  // Skipped without being read again when it would expand to nothing.
+  if (f->included && f->once)
+    return;
+  if (f->guard && lookup_macro(f->guard))
+    return;
+  f->included = true;
+
+  // The header is read before the rest of the including file, and what it
+  // defines stays defined for the rest of the translation unit. A cached
+  // header is already expanded, so only its macros are added.
+  pp_env_t *inc;
+  include_entry_t *ent = include_cache ? cached_include(f) : NULL;
+  if (ent) {
+    inc = new_env(ent->text);
+    inc->expanded = true;
+    for (int i = 0; i < vec_len(ent->macros); i++) {
+      macro_t *m = copy_macro(vec_get(ent->macros, i), false);
+      map_put(ctx->macros, m->name, m);
     }
+  } else {
+    inc = new_env(f->text);
   }
+  inc->next = e;
+  inc->cond_depth = vec_len(pp->conds);
+  pp->env = inc;
 }
 
-static void pp_next(pp_env_t *e, buf_t *b) {
+static void pp_next(pp_t *pp, buf_t *b) {
+  pp_env_t *e = pp->env;
   char c = peek(e, 0);
+  if (e->expanded) {
+    int len = 0;
+    while ((c = peek(e, len)) && c != '\n')
+      len++;
+    if (c)
+      len++;
+    buf_appendn(b, e->s + e->cur_p, len);
+    e->cur_p += len;
+    return;
+  }
   if (c == '#') {
     eat(e);
     char *ident = get_string(e);
+    if (ident == intern_lit("endif")) {
+      if (vec_len(pp->conds) > e->cond_depth)
+        vec_pop(pp->conds);
+      return;
+    }
     SKIP_SPACE(e);
-    if (!strcmp(ident, "define")) {
+    if (ident == intern_lit("ifndef")) {
+      char *name = get_string(e);
+      push_cond(pp, lookup_macro(name));
+    } else if (ident == intern_lit("else")) {
+      else_cond(pp);
+    } else if (is_skipping(pp)) {
+      return;
+    } else if (ident == intern_lit("define")) {
       macro_t *m = parse_macro(e);
-      map_put(macros, m->name, m);
-    } else if (!strcmp(ident, "include")) {
-      parse_include(e, b);
-    } else if (!strcmp(ident, "ifndef") || !strcmp(ident, "else")) {
-      parse_if_section(e, b, ident);
+      map_put(ctx->macros, m->name, m);
+    } else if (ident == intern_lit("include")) {
+      parse_include(pp, e);
+    } else if (ident == intern_lit("pragma")) {
+      // pragma once is found when the header is first read.
+      while ((c = peek(e, 0)) && c != '\n')
+        eat(e);
     }
-  } else if (isalpha(c)) {
-    if (map_find(macros, peek_string(e, 0)))
+  } else if (is_skipping(pp)) {
+    while ((c = peek(e, 0)) && c != '#')
+      eat(e);
+  } else if (is_ident_start(c)) {
+    int len = 0;
+    while (isalnum(peek(e, len)) || peek(e, len) == '_')
+      len++;
+    if (lookup_macro(intern_n(e->s + e->cur_p, len))) {
       replace_macro(e, b);
-    else {
-      char *s = get_string(e);
-      buf_appendn(b, s, strlen(s));
+    } else {
+      buf_appendn(b, e->s + e->cur_p, len);
+      e->cur_p += len;
     }
   } else {
-    buf_push(b, eat(e));
+    // Copy everything up to the next directive, identifier or line end at
+    // once.
+    int len = 1;
+    while ((c = peek(e, len)) && c != '#' && !is_ident_start(c) &&
+           peek(e, len - 1) != '\n')
+      len++;
+    buf_appendn(b, e->s + e->cur_p, len);
+    e->cur_p += len;
+  }
+}
+
+// A translation unit starts with the macros of its precompiled header.
+static map_t *initial_macros() {
+  map_t *macros = new_map();
+  for (int i = 0; ctx->pch && i < map_len(ctx->pch->macros); i++) {
+    macro_t *m = vec_get(ctx->pch->macros->items, i);
+    map_put(macros, m->name, copy_macro(m, false));
+  }
+  return macros;
+}
+
+pp_t *pp_open(char *s, char *filename) {
+  ctx->macros = initial_macros();
+  return new_pp(new_env(s));
+}
+
+// Appends the expansion of the input up to the end of the next output line.
+// Returns false once everything has been read.
+bool pp_read(pp_t *pp, buf_t *b) {
+  int len = b->len;
+  while (pp->env) {
+    pp_env_t *e = pp->env;
+    if (is_eof(e)) {
+      // Conditionals left open by an included file end with it.
+      while (vec_len(pp->conds) > e->cond_depth)
+        vec_pop(pp->conds);
+      pp->env = e->next;
+      continue;
+    }
+    pp_next(pp, b);
+    if (b->len > len && b->data[b->len - 1] == '\n')
+      return true;
   }
+  return b->len > len;
 }
 
 char *preprocess(char *s, char *filename, pp_env_t *e) {
   if (!e)
     e = new_env(s);
-  macros = new_map();
+  ctx->macros = initial_macros();
+  // Without directives or macros there is nothing to expand, so the input is
+  // used as is. A header being cached is read anyway for the names it uses.
+  if (!map_len(ctx->macros) && !strchr(e->s + e->cur_p, '#') &&
+      !(recording && vec_len(recording)))
+    return e->s + e->cur_p;
+  pp_t *pp = new_pp(e);
   buf_t *b = new_buf();
-  while (!is_eof(e)) {
-    pp_next(e, b);
-  }
+  while (pp_read(pp, b))
+    ;
 
   return buf_str(b);
 }
@@ -1,5 +1,6 @@
 #include "sicc.h"
 
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -13,31 +14,35 @@ static enum {
   STAT_EXPR,
 } _sema_stat;
 
-// Map of global variable types
-static map_t *gvar_types;
-// Map of global function types
-static map_t *gfuncs;
-// Map of Local varialbe types
-static map_t *var_types;
-// static map_t *var_types;
+// Looks a variable up, locals first.
+static symbol_t *find_symbol(char *str) {
+  symbol_t *sym = map_get(ctx->var_syms, str);
+  return sym ? sym : map_get(ctx->gvar_syms, str);
+}
 
-// Searching Global/Local Variable types
-// If the variable is local, that returns 1
-// If the variable is global, that returns 2
-static int find_var_types(char *str) {
-  if (map_find(var_types, str))
-    return 1;
-  if (map_find(gvar_types, str))
-    return 2;
-  return 0;
+// Creates the symbol of a variable definition or declaration and binds it to
+// the node, so nothing after sema has to look the name up again.
+static void define_symbol(node_t *node, bool is_global) {
+  if (find_symbol(node->str))
+    error("Variable redefinition is not allowed: %s", node->str);
+  symbol_t *sym = arena_alloc(ctx->ast_arena, sizeof(symbol_t));
+  sym->name = node->str;
+  sym->type = node->type;
+  sym->is_global = is_global;
+  sym->is_static = node->flags & NF_STATIC;
+  sym->is_extern = node->flags & NF_EXTERN;
+  node->sym = sym;
+  map_put(is_global ? ctx->gvar_syms : ctx->var_syms, node->str, sym);
 }
 
-static type_t *get_var_types(char *str) {
-  if (find_var_types(str) == 1)
-    return map_get(var_types, str);
-  if (find_var_types(str) == 2)
-    return map_get(gvar_types, str);
-  return NULL;
+// An array defined without a size takes it from its initializer.
+static void size_array(node_t *node) {
+  if (node->type->ty != TY_ARRAY_NOSIZE)
+    return;
+  if (node->lhs->ty != ND_INITIALIZER)
+    error("An array without size requires initializer");
+  node->type = array_of(node->type->ptr, node->lhs->nlist);
+  node->sym->type = node->type;
 }
 
 // Walking of Semantic Phase
@@ -45,66 +50,54 @@ static type_t *get_var_types(char *str) {
 void sema_walk(node_t *node, int stat) {
   if (!node)
     return;
-  if (!node->flag)
-    node->flag = calloc(1, sizeof(flag_t));
   switch (node->ty) {
   case ND_EXTERNAL:
-    for (int i = 0; i < vec_len(node->decl_list); i++) {
-      sema_walk(vec_get(node->decl_list, i), STAT_EXTERNAL);
-    }
-    for (int i = 0; i < vec_len(node->funcs); i++) {
-      sema_walk(vec_get(node->funcs, i), STAT_EXTERNAL);
+    for (int i = 0; i < node->nlist; i++) {
+      sema_walk(child(node, i), STAT_EXTERNAL);
     }
+    sema_walk(node->rhs, STAT_EXTERNAL);
     break;
   case ND_FUNC:
     if (stat != STAT_EXTERNAL)
       error("Cannot declare function in here");
-    map_put(gfuncs, node->str, node->type);
+    map_put(ctx->func_types, node->str, node->type);
+    func_begin(node->str);
     sema_walk(node->rhs, STAT_FUNC);
     sema_walk(node->lhs, STAT_FUNC);
-    free(var_types);
-    var_types = new_map();
+    func_end();
+    free_map(ctx->var_syms);
+    ctx->var_syms = new_map();
     break;
   case ND_FUNCS:
-    for (int i = 0; i < vec_len(node->funcs); i++) {
-      sema_walk(vec_get(node->funcs, i), stat);
-    }
-    break;
   case ND_ARGS:
-    for (int i = 0; i < vec_len(node->args); i++) {
-      sema_walk(vec_get(node->args, i), stat);
-    }
-    break;
   case ND_PARAMS:
-    for (int i = 0; i < vec_len(node->params); i++) {
-      sema_walk(vec_get(node->params, i), stat);
+    for (int i = 0; i < node->nlist; i++) {
+      sema_walk(child(node, i), stat);
     }
     break;
   case ND_STMTS: {
-    int var_length_before = map_len(var_types);
-    for (int i = 0; i < vec_len(node->stmts); i++) {
-      sema_walk(vec_get(node->stmts, i), stat);
+    int var_length_before = map_len(ctx->var_syms);
+    for (int i = 0; i < node->nlist; i++) {
+      sema_walk(child(node, i), stat);
     }
-    int var_len_after = map_len(var_types);
+    int var_len_after = map_len(ctx->var_syms);
     for (int i = var_length_before; i < var_len_after; i++)
-      map_pop(var_types);
-  } break;
-  case ND_NUM: {
-    type_t *ty = map_get(types, "int");
-    node->type = new_type(ty->size, ty->ty);
+      map_pop(ctx->var_syms);
   } break;
+  case ND_NUM:
+    node->type = ctx->int_type;
+    break;
   case ND_IDENT:
-    if (!find_var_types(node->str))
+    node->sym = find_symbol(node->str);
+    if (!node->sym)
       error("Can't use not defined variable");
-    node->type = get_var_types(node->str);
+    node->type = node->sym->type;
     break;
   case ND_FUNC_CALL:
     sema_walk(node->rhs, STAT_EXPR);
     if (stat == STAT_EXPR)
-      node->flag->should_save = true;
-    else
-      node->flag->should_save = false;
-    node->type = map_get(gfuncs, node->str);
+      node->flags |= NF_SHOULD_SAVE;
+    node->type = map_get(ctx->func_types, node->str);
     break;
   case ND_EXPR:
     sema_walk(node->lhs, STAT_EXPR);
@@ -123,55 +116,31 @@ void sema_walk(node_t *node, int stat) {
   case ND_IF_ELSE:
     sema_walk(node->rhs, STAT_EXPR);
     sema_walk(node->lhs, stat);
-    sema_walk(node->else_stmt, stat);
+    sema_walk(child(node, 0), stat);
     break;
   case ND_VAR_DEF:
-    if (find_var_types(node->str))
-      error("Variable redefinition is not allowed: %s", node->str);
-    map_put(var_types, node->str, node->type);
+    define_symbol(node, false);
     sema_walk(node->lhs, STAT_EXPR);
-    if (node->type->ty == TY_ARRAY_NOSIZE) {
-      if (node->lhs->ty != ND_INITIALIZER) {
-        error("An array without size requires initializer");
-      } else {
-        node->type->array_size = vec_len(node->lhs->initializer);
-        node->type->size = node->type->array_size * node->type->size_deref;
-        node->type->ty = TY_ARRAY;
-      }
-    }
+    size_array(node);
     break;
   case ND_VAR_DECL:
-    if (find_var_types(node->str))
-      error("Variable redefinition is not allowed: %s", node->str);
-    map_put(var_types, node->str, node->type);
+    define_symbol(node, false);
     if (node->type->ty == TY_ARRAY_NOSIZE) {
       error("An array without size requires initializer");
     }
     break;
   case ND_EXT_VAR_DEF:
-    if (find_var_types(node->str))
-      error("Variabe redefinition is not allowed: %s", node->str);
-    map_put(gvar_types, node->str, node->type);
+    define_symbol(node, true);
     sema_walk(node->lhs, STAT_EXPR);
-    if (node->type->ty == TY_ARRAY_NOSIZE) {
-      if (node->lhs->ty != ND_INITIALIZER) {
-        error("An array without size requires initializer");
-      } else {
-        node->type->array_size = vec_len(node->lhs->initializer);
-        node->type->size = node->type->array_size * node->type->size_deref;
-        node->type->ty = TY_ARRAY;
-      }
-    }
+    size_array(node);
     break;
   case ND_VAR_DECL_LIST:
-    for (int i = 0, len = vec_len(node->vars); i < len; i++) {
-      sema_walk(vec_get(node->vars, i), stat);
+    for (int i = 0; i < node->nlist; i++) {
+      sema_walk(child(node, i), stat);
     }
     break;
   case ND_EXT_VAR_DECL:
-    if (find_var_types(node->str))
-      error("Variable redefinition is not allowed: %s", node->str);
-    map_put(gvar_types, node->str, node->type);
+    define_symbol(node, true);
     if (node->type->ty == TY_ARRAY_NOSIZE) {
       error("An array without size requires initializer");
     }
@@ -183,57 +152,50 @@ void sema_walk(node_t *node, int stat) {
     break;
   case ND_REF:
     sema_walk(node->lhs, STAT_EXPR);
-    node->type->ptr = node->lhs->type;
-    node->type->size_deref = node->lhs->type->size;
+    if (node->lhs->ty == ND_IDENT)
+      node->lhs->sym->addr_taken = true;
+    node->type = pointer_to(node->lhs->type);
     break;
   case ND_STRING:
-    node->type = new_type(8, TY_PTR);
-    {
-      type_t *ty = map_get(types, "char");
-      node->type->ptr = new_type(ty->size, ty->ty);
-    }
-    node->type->size_deref = 1;
+    node->type = pointer_to(ctx->char_type);
     break;
   case ND_CHARACTER:
     node->num = *node->str;
-    {
-      type_t *ty = map_get(types, "char");
-      node->type = new_type(ty->size, ty->ty);
-    }
+    node->type = ctx->char_type;
     break;
   case ND_SIZEOF:
     if (!node->type) {
       node->ty = ND_NUM;
       sema_walk(node->lhs, stat);
       node->num = node->lhs->type->size;
-      node->type = new_type(4, TY_INT);
+      node->type = ctx->int_type;
     } else {
       node->ty = ND_NUM;
       node->num = node->type->size;
-      node->type = new_type(4, TY_INT);
+      node->type = ctx->int_type;
     }
     break;
   case ND_WHILE:
     sema_walk(node->rhs, STAT_EXPR);
     sema_walk(node->lhs, STAT_WHILE);
     break;
-  case ND_FOR:
-    sema_walk(node->init, STAT_EXPR);
-    sema_walk(node->cond, STAT_EXPR);
-    sema_walk(node->loop, STAT_EXPR);
-    sema_walk(node->body, STAT_FOR);
+  case ND_FOR: {
+    node_t *init = child(node, FOR_INIT);
+    sema_walk(init, STAT_EXPR);
+    sema_walk(child(node, FOR_COND), STAT_EXPR);
+    sema_walk(child(node, FOR_LOOP), STAT_EXPR);
+    sema_walk(child(node, FOR_BODY), STAT_FOR);
 
-    if (node->init->ty >= ND_VAR_DEF && node->init->ty <= ND_EXT_VAR_DECL) {
-      if (node->init->ty == ND_VAR_DECL_LIST) {
-        int len = vec_len(node->init->vars);
-        for (int i = 0; i < len; i++) {
-          map_pop(var_types);
+    if (init->ty >= ND_VAR_DEF && init->ty <= ND_EXT_VAR_DECL) {
+      if (init->ty == ND_VAR_DECL_LIST) {
+        for (int i = 0; i < init->nlist; i++) {
+          map_pop(ctx->var_syms);
         }
       } else {
-        map_pop(var_types);
+        map_pop(ctx->var_syms);
       }
     }
-    break;
+  } break;
   case ND_DEREF_INDEX:
     sema_walk(node->lhs, stat);
     sema_walk(node->rhs, STAT_EXPR);
@@ -245,31 +207,30 @@ void sema_walk(node_t *node, int stat) {
     node->type = is_left_ptr ? node->lhs->type->ptr : node->rhs->type->ptr;
     break;
   case ND_INITIALIZER:
-    for (int i = 0; i < node->initializer->len; i++) {
-      sema_walk(vec_get(node->initializer, i), STAT_EXPR);
+    for (int i = 0; i < node->nlist; i++) {
+      sema_walk(child(node, i), STAT_EXPR);
     }
     break;
   case ND_INC_L:
     sema_walk(node->lhs, STAT_EXPR);
     node->type = node->lhs->type;
     if (stat == STAT_EXPR)
-      node->flag->should_save = true;
-    else
-      node->flag->should_save = false;
+      node->flags |= NF_SHOULD_SAVE;
     break;
   case ND_DEC_L:
     sema_walk(node->lhs, STAT_EXPR);
     node->type = node->lhs->type;
     if (stat == STAT_EXPR)
-      node->flag->should_save = true;
-    else
-      node->flag->should_save = false;
+      node->flags |= NF_SHOULD_SAVE;
     break;
   case ND_DOT:
     sema_walk(node->lhs, stat);
     if (node->lhs->type->ty != TY_STRUCT)
       error("Dot operator cannot be used for what a type that's not a struct.");
     node->type = map_get(node->lhs->type->member->data, node->str);
+    // The member's offset goes in num, so irgen need not look it up.
+    node->num =
+        (int)(intptr_t)map_get(node->lhs->type->member->offset, node->str);
     break;
   case ND_ARROW:
     sema_walk(node->lhs, stat);
@@ -278,6 +239,8 @@ void sema_walk(node_t *node, int stat) {
       error("Arrow operator cannot be used for what a type that's not a pointer which references to struct.");
     }
     node->type = map_get(node->lhs->type->ptr->member->data, node->str);
+    node->num =
+        (int)(intptr_t)map_get(node->lhs->type->ptr->member->offset, node->str);
     break;
   case ND_SWITCH:
     sema_walk(node->lhs, STAT_EXPR);
@@ -326,9 +289,9 @@ void sema_walk(node_t *node, int stat) {
 }
 
 void sema(node_t *node) {
-  gvar_types = new_map();
-  var_types = new_map();
-  gfuncs = new_map();
+  ctx->gvar_syms = new_map();
+  ctx->var_syms = new_map();
+  ctx->func_types = new_map();
   sema_walk(node, STAT_NONE);
   return;
 }
@@ -0,0 +1,247 @@
+#ifndef __APPLE__
+#define _GNU_SOURCE // struct ucred
+#endif
+#include "sicc.h"
+
+#include <errno.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// A request is its length as 4 little-endian bytes, then the client's working
+// directory and the command's arguments, each NUL-terminated. The reply is a
+// series of frames (see write_frame): 'o' for the output, 'e' for errors and
+// a final 'x' holding the exit status.
+
+// A client that sends nothing or stops reading is dropped after this long,
+// so that it cannot hold up the clients behind it.
+#define SERVE_TIMEOUT 10 // seconds
+
+// Only the user can enter the directory, so no one else can put a socket of
+// their own in place of the server's.
+static bool is_private(char *dir) {
+  struct stat st;
+  return !lstat(dir, &st) && S_ISDIR(st.st_mode) && st.st_uid == getuid() &&
+         !(st.st_mode & 077);
+}
+
+// The socket is in $XDG_RUNTIME_DIR, or else in /tmp/sicc-<uid>, which the
+// server makes. SICC_SOCKET overrides both. Returns NULL on the client side
+// if the directory is not private.
+static char *socket_path(bool server) {
+  char *path = getenv("SICC_SOCKET");
+  if (path && *path)
+    return path;
+  char *dir = getenv("XDG_RUNTIME_DIR");
+  char tmp[64];
+  if (!dir || !*dir) {
+    snprintf(tmp, sizeof(tmp), "/tmp/sicc-%d", (int)getuid());
+    if (server && mkdir(tmp, 0700) && errno != EEXIST)
+      error("Cannot create %s", tmp);
+    dir = tmp;
+  }
+  if (!is_private(dir)) {
+    if (server)
+      error("%s must be a directory of yours that only you can access", dir);
+    return NULL;
+  }
+  return format("%s/sicc.sock", dir);
+}
+
+// Returns the uid of the process at the other end of the socket, or -1.
+static long peer_uid(int fd) {
+#ifdef __APPLE__
+  uid_t uid;
+  gid_t gid;
+  if (getpeereid(fd, &uid, &gid))
+    return -1;
+  return uid;
+#else
+  struct ucred cred;
+  socklen_t len = sizeof(cred);
+  if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len))
+    return -1;
+  return cred.uid;
+#endif
+}
+
+static struct sockaddr_un socket_addr(char *path) {
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr.sun_path))
+    error("Socket path is too long: %s", path);
+  strcpy(addr.sun_path, path);
+  return addr;
+}
+
+// Returns false if the peer closed the connection first.
+static bool read_all(int fd, char *p, int n) {
+  while (n > 0) {
+    ssize_t r = read(fd, p, n);
+    if (r <= 0)
+      return false;
+    p += r;
+    n -= r;
+  }
+  return true;
+}
+
+static int get_int(char *p) {
+  unsigned char *u = (unsigned char *)p;
+  return u[0] | u[1] << 8 | u[2] << 16 | u[3] << 24;
+}
+
+static void put_int(char *p, int n) {
+  for (int i = 0; i < 4; i++)
+    p[i] = (n >> (i * 8)) & 0xff;
+}
+
+static void serve(int fd) {
+  struct timeval tv = {SERVE_TIMEOUT, 0};
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+  setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+  char header[4];
+  if (!read_all(fd, header, 4))
+    return;
+  int len = get_int(header);
+  if (len <= 0 || len > (1 << 20))
+    return;
+  char *req = malloc(len + 1);
+  if (!read_all(fd, req, len)) {
+    free(req);
+    return;
+  }
+  req[len] = '\0';
+
+  // The working directory comes first; argv[0] is the command's own name.
+  char *cwd = req;
+  vec_t *args = new_vec();
+  for (char *p = cwd + strlen(cwd) + 1; p < req + len; p += strlen(p) + 1)
+    vec_push(args, p);
+
+  jmp_buf jb;
+  int status = 1;
+  if (!setjmp(jb)) {
+    set_error_handler(&jb, fd);
+    if (chdir(cwd))
+      error("Cannot change directory to %s", cwd);
+    status = run_command(vec_len(args), (char **)args->data, fd);
+  } else if (ctx) {
+    // An error unwound the compilation midway.
+    free_ctx(ctx);
+    ctx = NULL;
+  }
+
+  // A client that has gone away fails the write, which must unwind here
+  // rather than exit.
+  char code[4];
+  put_int(code, status);
+  if (!setjmp(jb))
+    write_frame(fd, 'x', code, 4);
+  set_error_handler(NULL, -1);
+  free_vec(args);
+  free(req);
+}
+
+// Serves compile requests one at a time. Headers stay cached between
+// requests.
+void run_server() {
+  // A client that goes away must not take the server down with it.
+  signal(SIGPIPE, SIG_IGN);
+  char *path = socket_path(true);
+  struct sockaddr_un addr = socket_addr(path);
+  int s = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (s < 0)
+    error("Cannot create a socket");
+  unlink(path);
+  if (bind(s, (struct sockaddr *)&addr, sizeof(addr)) || listen(s, 64))
+    error("Cannot listen on %s", path);
+  fprintf(stderr, "sicc: serving on %s\n", path);
+
+  for (;;) {
+    int fd = accept(s, NULL, NULL);
+    if (fd < 0)
+      continue;
+    // Commands run with the server's rights, so only its user may send them.
+    if (peer_uid(fd) != getuid()) {
+      close(fd);
+      continue;
+    }
+    enable_include_cache();
+    serve(fd);
+    close(fd);
+  }
+}
+
+// Runs the command on the server and returns its exit status, or -1 if no
+// server is listening.
+int run_client(int argc, char **argv) {
+  char *path = socket_path(false);
+  if (!path)
+    return -1;
+  struct sockaddr_un addr = socket_addr(path);
+  int s = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (s < 0)
+    return -1;
+  if (connect(s, (struct sockaddr *)&addr, sizeof(addr))) {
+    close(s);
+    return -1;
+  }
+  // The sources and the output must not go to another user's process.
+  if (peer_uid(s) != getuid())
+    error("The compile server at %s is run by another user", path);
+
+  char *cwd = getcwd(NULL, 0);
+  if (!cwd)
+    error("Cannot get the working directory");
+  buf_t *b = new_buf();
+  buf_appendn(b, "\0\0\0\0", 4);
+  buf_appendn(b, cwd, strlen(cwd) + 1);
+  for (int i = 0; i < argc; i++)
+    buf_appendn(b, argv[i], strlen(argv[i]) + 1);
+  put_int(b->data, b->len - 4);
+  for (int off = 0; off < b->len;) {
+    ssize_t w = write(s, b->data + off, b->len - off);
+    if (w < 0)
+      error("Cannot send the request to the compile server");
+    off += w;
+  }
+  free_buf(b);
+  free(cwd);
+
+  char header[5];
+  while (read_all(s, header, 5)) {
+    int n = get_int(header + 1);
+    if (n < 0 || n > FRAME_MAX || (header[0] == 'x' && n != 4))
+      break;
+    char *data = malloc(n);
+    if (!read_all(s, data, n)) {
+      free(data);
+      break;
+    }
+    if (header[0] == 'x') {
+      int status = get_int(data);
+      free(data);
+      close(s);
+      return status;
+    }
+    int out = header[0] == 'e' ? 2 : 1;
+    for (int off = 0; off < n;) {
+      ssize_t w = write(out, data + off, n - off);
+      if (w < 0)
+        error("Cannot write output");
+      off += w;
+    }
+    free(data);
+  }
+  error("Lost connection to the compile server");
+  return 1;
+}
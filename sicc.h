@@ -8,7 +8,7 @@
 #define NULL (void *)0
 #endif
 
-#ifndef __STDBOOL_H
+#if !defined(__STDBOOL_H) && !defined(_STDBOOL_H)
 #define __STDBOOL_H
 typedef enum {
   false = 0,
@@ -21,6 +21,12 @@ typedef enum {
 typedef long size_t;
 #endif
 
+#ifndef __GNUC__
+#define THREAD_LOCAL
+#else
+#define THREAD_LOCAL _Thread_local
+#endif
+
 enum _token_enum {
   TK_EOF = 256,
   TK_NUM,
@@ -172,27 +178,14 @@ enum _ir_enum {
   IR_STORE,      // Store register to var
   IR_LOAD,       // Load var to register
   IR_CALL,       // Call function
-  IR_FUNC,       // Function
-  IR_LABEL,      // Label
-  IR_LABEL_BB,
-  IR_LABEL_BBEND,
-  IR_LABEL_BBSTART,
-  IR_ALLOC,    // Alloc vars
   IR_FREE,     // Free vars
   IR_RET,      // Return register
   IR_RET_NONE, // Return none
   // IR_SAVE_REG,      Save register
   // IR_REST_REG,      Restore register
-  IR_JMP, // Jmp
-  IR_JMP_BB,
-  IR_JMP_BBEND,
-  IR_JMP_BBSTART,
-  IR_JTRUE, // Jmp if true(1)
-  IR_JTRUE_BB,
-  IR_JTRUE_BBEND,
-  IR_JZERO, // Jmp if zero
-  IR_JZERO_BB,
-  IR_JZERO_BBEND,
+  IR_JMP,   // Jmp to block lhs
+  IR_JTRUE, // Jmp to block rhs if true(1)
+  IR_JZERO, // Jmp to block rhs if zero
   IR_STORE_VAR, // Store reg to var
   IR_LOAD_VAR,  // Load var to reg
   IR_LOAD_ADDR,
@@ -222,31 +215,110 @@ typedef struct _vec {
   int cap;
   int len;
   void **data;
+  struct _arena *arena; // owns data if set; see arena_vec()
 } vec_t;
 
 typedef struct _map {
   int len;
   vec_t *keys;
   vec_t *items;
+  int *slots; // open addressing table of (key index + 1), 0 means empty
+  int nslots;
+  int nused; // live slots and tombstones
 } map_t;
 
 typedef struct _buf {
   int len;
   int cap;
   char *data;
+  struct _arena *arena; // owns data if set
 } buf_t;
 
+// Longer output is split over several frames.
+#define FRAME_MAX (1 << 20)
+
+// Buffered output written with write(2) when full or closed.
+typedef struct _out {
+  int fd;
+  int len;
+  char *buf;
+  char frame; // nonzero: written as frames of this channel, see write_frame()
+  buf_t *mem; // collects the output instead, see out_mem()
+} out_t;
+
+typedef struct _arena {
+  char *name;
+  void *chunk;     // current chunk, chained to older ones
+  size_t used;     // bytes handed out in total
+  size_t reserved; // bytes currently held in chunks
+  size_t peak;     // largest `reserved` ever seen
+  int nallocs;
+  int nchunks;
+} arena_t;
+
 typedef struct _pp_env {
   char *s;
   int cur_p;
+  struct _pp_env *next; // file that included this one
+  int cond_depth;       // conditional stack depth when the file was entered
+  bool expanded;        // already preprocessed text, copied as is
 } pp_env_t;
 
-typedef struct _token {
-  int ty;
-  char *str;
+// A preprocessing token of a macro body or of a macro call.
+typedef struct {
+  char *str;  // spelling
+  int param;  // index of the parameter a body token stands for, or -1
+  bool space; // preceded by white space
+} pp_token_t;
+
+typedef struct _macro {
+  char *name;
+  vec_t *params; // parameter names; NULL for an object-like macro
+  vec_t *body;   // pp_token_t
+} macro_t;
+
+// A header found on the include path, shared by every name that reaches it.
+typedef struct _include_file {
+  char *path;    // where it was found
+  char *text;    // contents, read on first use
+  char *guard;   // macro of its include guard, if it has one
+  bool once;     // has pragma once
+  bool included; // already included in this translation unit
+} include_file_t;
+
+typedef struct _pp {
+  pp_env_t *env; // innermost file being read
+  vec_t *conds;  // open conditional sections
+} pp_t;
+
+// Tokens are stored as parallel arrays and addressed by index. Spellings are
+// slices of `src`; line/column are recovered from the line start table.
+#define TOKEN_RING 16
+
+typedef struct _token_stream {
+  int len;
+  int cap;
+  char *src;
+  char *kind;  // TK_* - TK_EOF
+  int *offset; // start of the spelling in `src`
+  int *length; // length of the spelling
+  int *lines;  // offset of the first character of each line
+  int nlines;
+  int lines_cap;
+  int memo; // last token whose spelling was interned
+  char *memo_str;
+
+  // When streaming, only the last TOKEN_RING tokens are kept.
+  pp_t *pp;
+  buf_t *window; // preprocessed text not yet lexed
+  char *cur;
   int line;
-  int pos;
-} token_t;
+  int line_start; // offset of the current line in `window`
+  char ring_kind[TOKEN_RING];
+  char *ring_str[TOKEN_RING];
+  int ring_line[TOKEN_RING];
+  int ring_col[TOKEN_RING];
+} token_stream_t;
 
 typedef struct _member {
   map_t *data;
@@ -260,49 +332,83 @@ typedef struct _member {
 //   int ty;
 // } type_info_t;
 
+// Types are made once: a named type or struct tag has one type_t, and
+// pointer_to() and array_of() return the same derived type each time.
 typedef struct _type {
   int size;
+  int align;
   struct _type *ptr;
   int ty;
   char *name;
   int size_deref;
   int array_size;
   member_t *member;
+  struct _type *pointer; // pointer to this type, once made
+  struct _type *arrays;  // arrays of this type, chained by next
+  struct _type *next;
 } type_t;
 
-typedef struct _flag {
-  bool should_save;
-  bool is_node_static;
-  bool is_node_extern;
-  bool is_node_const;
-} flag_t;
+// Bits of node_t's flags.
+enum _node_flag_enum {
+  NF_SHOULD_SAVE = 1, // the value of a call or of ++/-- is used
+  NF_STATIC = 2,
+  NF_EXTERN = 4,
+  NF_CONST = 8,
+};
 
+// A variable as sema resolved it. The definition and every use of the
+// variable point to the same record.
+typedef struct _symbol {
+  char *name;
+  type_t *type;
+  bool is_global;
+  bool is_static;
+  bool is_extern;
+  bool addr_taken; // & is applied to it somewhere
+  int offset; // frame slot of a local, assigned by irgen at its definition
+} symbol_t;
+
+// Fields a kind of node has no use for are left out rather than kept NULL:
+// what other kinds need beyond lhs and rhs goes in the node's children, a
+// range of the context's node_lists read with child().
+//
+//   ND_EXTERNAL            the declarations; rhs is an ND_FUNCS
+//   ND_FUNCS, ND_STMTS,    the functions, statements, parameters,
+//   ND_ARGS, ND_PARAMS,    arguments, variables or elements
+//   ND_VAR_DECL_LIST,
+//   ND_INITIALIZER
+//   ND_FOR                 the parts, indexed by FOR_INIT to FOR_BODY
+//   ND_IF_ELSE             the else branch; rhs is the condition and lhs
+//                          the then branch
 typedef struct _node {
   int ty;
+  int op;
   struct _node *lhs;
   struct _node *rhs;
-  int op;
   char *str;
-  int num;
-  int size;
   type_t *type;
-  token_t *tk;
-  struct _node *else_stmt;
-  struct _node *init;
-  struct _node *cond;
-  struct _node *loop;
-  struct _node *body;
-  vec_t *decl_list; // declaration of type/variable
-  vec_t *vars;
-  vec_t *stmts;
-  vec_t *funcs;
-  vec_t *args;
-  vec_t *params;
-  vec_t *initializer;
-
-  flag_t *flag;
+  symbol_t *sym; // variable a definition or ND_IDENT stands for (sema)
+  int num;
+  char flags; // NF_* bits
+  int list;   // first child in node_lists
+  int nlist;  // number of children
 } node_t;
 
+enum {
+  FOR_INIT,
+  FOR_COND,
+  FOR_LOOP,
+  FOR_BODY,
+};
+
+// The state a translation unit has after including a precompiled header.
+typedef struct _pch {
+  map_t *macros;
+  map_t *types;
+  map_t *enum_list;
+  vec_t *decls; // ND_EXT_VAR_DECL nodes
+} pch_t;
+
 typedef struct _ins {
   int op;
   int lhs;
@@ -312,14 +418,33 @@ typedef struct _ins {
   char *name;
 } ins_t;
 
-typedef struct _var {
-  int offset;
-  int size;
-} var_t;
+// A basic block: instructions that run straight through, kept in one array.
+// Only the last one can jump or return; a block that does neither falls
+// through to the next block of its function.
+typedef struct _bb {
+  int label; // index in its function's blocks, which jumps refer to
+  ins_t *ins;
+  int nins;
+  struct _bb *succ[2]; // the jump target first, then the next block
+  int nsucc;
+  struct _bb **preds;
+  int npreds;
+} bb_t;
+
+typedef struct _func {
+  char *name;
+  vec_t *bbs;     // bb_t list in layout order; the first is the entry
+  int stack_size; // frame size, a multiple of 16
+  int nregs;      // registers regs[0..nregs) the function writes
+  int save_offset; // the callee-saved ones among them are kept from here up
+  char *cached;   // assembly from the codegen cache, instead of bbs
+} func_t;
 
 typedef struct _gvar {
   char *name;
+  type_t *type;
   int size;
+  int align;
   int is_null;
   node_t *init;
   bool external;
@@ -327,31 +452,118 @@ typedef struct _gvar {
 } gvar_t;
 
 typedef struct _ir_env {
-  node_t *before_continue;
+  bb_t *break_bb;
+  bb_t *continue_bb;
+  vec_t *cases; // (value node, bb_t) pairs of the innermost switch
+  bb_t *default_bb;
   int final_arg;
 } ir_env_t;
 
 typedef struct _ir {
-  vec_t *code; // ins_t list
-  map_t *gvars;
-  map_t *vars;      // var_t map
+  vec_t *funcs; // func_t list
+  map_t *gvars;     // gvar_t map
   vec_t *gfuncs;    // char * list
   vec_t *const_str; // char * list
-  map_t *labels;
+  map_t *labels;    // goto label -> bb_t of the current function
   map_t *builtins;
+  map_t *func_keys; // function name -> codegen cache key, if not cached yet
   int len;        // code length
   int stack_size; // max stack size in function
   ir_env_t *env;
+
+  // The function being generated
+  func_t *func;
+  vec_t *vars;   // symbol_t list of the locals mem2reg may promote
+  bb_t *bb;      // block being filled; NULL after a jump or return
+  vec_t *blocks; // the function's blocks in the order they were made
+  ins_t *buf;    // instructions of bb until it is closed
+  int nbuf;
+  int capbuf;
 } ir_t;
 
-extern vec_t *tokens;
-extern map_t *types;
+// Everything one compilation needs. Each thread compiles with its own
+// context, so translation units can be compiled concurrently.
+typedef struct _ctx {
+  // Per-phase arenas. Tokens die after parsing; AST, types and IR live until
+  // the output has been written.
+  arena_t *token_arena;
+  arena_t *ast_arena;
+  arena_t *ir_arena;
+  // Vectors, maps, buffers and format() strings made while the context is
+  // current. Anything that must outlive it is made with arena_vec(NULL) or
+  // arena_map(NULL).
+  arena_t *heap;
+
+  // String intern pool (util.c)
+  char **intern_strs;
+  int *intern_hashes;
+  int intern_nslots;
+  int intern_count;
+  char *lit_keys[256]; // intern_lit() cache by literal address
+  char *lit_strs[256];
+  int intern_hits;
+  int intern_misses;
+
+  vec_t *files; // input files read, with their mapped sizes
+
+  // Timed phases and spans of this compilation (debug.c)
+  vec_t *events;
+  vec_t *open_events;
+  int ntokens;
+  long lex_bytes; // text lexed by tokenize(), for its throughput
+  int nnodes; // AST nodes
+  int nins;   // IR instructions
+
+  pch_t *pch;   // precompiled header the translation unit starts from
+
+  // preprocess.c
+  map_t *macros;
+  map_t *include_files; // include name or real path -> include_file_t
+  map_t *include_dirs;  // directory -> map of its entries
+
+  // tokenize.c
+  token_stream_t *tokens;
+  char **keywords;   // interned keyword spellings
+  char **spellings;  // interned fixed spellings by token kind
+
+  // parse.c
+  int cur;
+  map_t *types;      // type_info_t map
+  type_t *int_type;
+  type_t *char_type;
+  map_t *enum_list;  // intptr_t map
+  vec_t *node_lists; // children of every node, see node_t
+  vec_t *node_stack; // children of the lists being parsed
+
+  // sema.c
+  map_t *gvar_syms; // symbol_t map
+  map_t *func_types;
+  map_t *var_syms; // symbol_t map of the locals in scope
+
+  // irgen.c
+  int nreg;
+  int narg;
+  int stack_size;
+  int cur_stack;
+
+  // cache.c
+  int cache_hits;
+  int cache_misses;
+} ctx_t;
+
+// The context of the compilation running on this thread.
+extern THREAD_LOCAL ctx_t *ctx;
 
 /* util.c */
+ctx_t *new_ctx();
+void free_ctx(ctx_t *c);
+
 char *read_file(char *name);
-void write_one_fmt(char *dst, char *orig, char *str);
+unsigned int fnv1a(const char *s, size_t len);
 
 vec_t *new_vec();
+vec_t *arena_vec(struct _arena *a);
+void free_vec(vec_t *v);
 void grow_vec(vec_t *v, int len);
 void vec_push(vec_t *v, void *p);
 void vec_pop(vec_t *v);
@@ -361,6 +573,8 @@ void *vec_get(vec_t *v, int pos);
 size_t vec_len(vec_t *v);
 
 map_t *new_map();
+map_t *arena_map(struct _arena *a);
+void free_map(map_t *m);
 void map_put(map_t *m, char *key, void *item);
 void map_set(map_t *m, char *key, void *item);
 void *map_get(map_t *m, char *key);
@@ -369,7 +583,17 @@ int map_index(map_t *m, char *key);
 void map_pop(map_t *m);
 size_t map_len(map_t *m);
 
+char *intern(char *s);
+char *intern_n(char *s, int len);
+char *intern_lit(char *s);
+int intern_len();
+
+arena_t *new_arena(char *name);
+void *arena_alloc(arena_t *a, size_t size);
+void arena_release(arena_t *a);
+
 buf_t *new_buf();
+void free_buf(buf_t *b);
 void grow_buf(buf_t *b, int len);
 void buf_push(buf_t *b, char c);
 void buf_append(buf_t *b, char *str);
@@ -377,24 +601,72 @@ void buf_appendn(buf_t *b, char *str, int n);
 char buf_get(buf_t *b, int offset);
 size_t buf_len(buf_t *b);
 char *buf_str(buf_t *b);
+char *format(char *fmt, ...);
+int align_to(int n, int align);
+
+out_t *out_open(char *path);
+out_t *out_frames(int fd, char channel);
+out_t *out_mem();
+void write_frame(int fd, char channel, char *p, int n);
+void out_close(out_t *o);
+void out_flush(out_t *o);
+void out_putn(out_t *o, char *s, int n);
+void out_puts(out_t *o, char *s);
+void out_putc(out_t *o, char c);
+void out_int(out_t *o, long n);
+
+/* cache.c */
+void set_cache_dir(char *dir);
+char *cache_key(node_t *func);
+char *cache_load(char *key);
+void cache_store(char *key, char *text, int len);
 
 /* debug.c */
-void debug_tokens(vec_t *tokens);
+void debug_tokens();
 void debug_node(node_t *node);
 void debug_ir(char *filename);
 void debug(char *s);
+void print_stats(out_t *out);
+void set_tracing(bool on);
+void file_begin(char *filename);
+void phase_begin(char *name);
+void func_begin(char *name);
+void event_end();
+void func_end();
+void flush_trace();
+void write_trace(char *path);
 
 /* preprocess.c */
-extern map_t *macros;
+extern int include_cache_hits;
+extern int include_cache_misses;
 
+void enable_include_cache();
+void set_include_paths(vec_t *paths);
 char *preprocess(char *s, char *filename, pp_env_t *e);
+pp_t *pp_open(char *s, char *filename);
+bool pp_read(pp_t *pp, buf_t *b);
+
+/* pch.c */
+void emit_pch(char *filename, char *outfile);
+pch_t *load_pch(char *path);
 
 /* tokenize.c */
+char get_escape_char(char c, char **s);
 void tokenize(char *s);
+bool is_ident_start(char c);
+void tokenize_stream(pp_t *pp);
+int token_ty(int i);
+char *token_str(int i);
+int token_line(int i);
+int token_col(int i);
 
 /* parse.c */
 node_t *new_node(int ty);
+node_t *child(node_t *node, int i);
 type_t *new_type(int size, int ty);
+type_t *pointer_to(type_t *base);
+type_t *array_of(type_t *elem, int len);
+int padding_after(type_t *ty, int i);
 void init_parser();
 node_t *parse();
 
@@ -407,11 +679,26 @@ ir_t *new_ir();
 int gen_ir(ir_t *ir, node_t *node);
 void print_ir(ir_t *ir);
 
+/* ssa.c */
+void mem2reg(func_t *func, vec_t *vars);
+
 /* asmgen.c */
-void gen_asm(ir_t *ir);
+void gen_asm(ir_t *ir, out_t *o);
+
+/* objgen.c */
+void gen_obj(ir_t *ir, out_t *out);
+int run_jit(ir_t *ir, int argc, char **argv);
+
+/* server.c */
+void run_server();
+int run_client(int argc, char **argv);
+
+/* main.c */
+int run_command(int argc, char **argv, int client);
 
 /* error.c */
+void set_error_handler(void *jmp, int fd);
 void error(char *fmt, ...);
-void error_at(token_t *tk, char *fmt, ...);
+void error_at(int tk, char *fmt, ...);
 
 #endif
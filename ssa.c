@@ -0,0 +1,662 @@
+#include "sicc.h"
+
+#include <stdlib.h>
+
+// mem2reg moves the locals irgen found promotable out of the frame and into
+// registers. Such a local is a scalar whose address is never taken, so its
+// slot is only ever read by IR_LOAD_VAR and written by IR_STORE_VAR or, for
+// a parameter, IR_LOAD_ARG.
+//
+// The function is first put in SSA form for those variables: every store
+// defines a new value, phis merge the values of a variable at the iterated
+// dominance frontier of its stores, and every load is renamed to the one
+// value that reaches it. A store whose value no load can see is dropped.
+//
+// Each variable then gets one register, its home, for all of its values.
+// The values of one variable are never live at the same time, so leaving SSA
+// form takes no copies: the phis go away, and the loads and stores become
+// moves from and to the home. sicc has no register allocator, so the homes
+// are the callee-saved registers the function's expressions do not reach;
+// the variables used most, by loop depth, get them and the rest stay in
+// memory.
+//
+// A switch makes a chain of blocks as long as its cases, so nothing here
+// walks up the dominator tree or builds dominance frontiers, which would be
+// quadratic in it.
+
+#define MAX_HOMES 5
+#define NO_VALUE -1
+
+typedef struct {
+  int var;   // index in homed
+  int value;
+  int *args; // the value coming from each predecessor
+  int nargs;
+} phi_t;
+
+typedef struct {
+  symbol_t *sym;
+  int weight; // uses weighted by loop depth; -1 if it must stay in memory
+  int home;   // register, or -1
+  int *defs;  // blocks that store it
+  int ndefs;
+  int *stack; // values of the variable, the one that reaches on top
+  int depth;
+} var_t;
+
+typedef struct {
+  phi_t *phi; // the phi defining the value, if one does
+  ins_t *def; // the store defining the value, if one does
+  bool live;
+} value_t;
+
+typedef struct {
+  int b;
+  int child; // next child to visit
+  int depth[MAX_HOMES];
+} frame_t;
+
+typedef struct {
+  func_t *func;
+  int nbbs;
+
+  // Depth-first numbering of the blocks reachable from the entry
+  int *pre;    // number of each block, -1 if it is unreachable
+  int *vertex; // block of each number
+  int *parent; // in the depth-first tree
+  int nreach;
+  int (*pred_at)[2]; // index of each block in the preds of its successors
+
+  // Dominator tree
+  int *idom;
+  int *first_child;
+  int *next_sibling;
+  int *level;
+  int *enter; // a dominates b iff enter[a] <= enter[b] && leave[b] <= leave[a]
+  int *leave;
+  int max_level;
+
+  var_t *vars;
+  int nvars;
+  int *var_at; // frame offset -> index in vars, or -1
+  int max_offset;
+  var_t *homed[MAX_HOMES];
+  int nhomed;
+  vec_t **phis; // phi_t list of each block
+  value_t *values;
+  int nvalues;
+  int capvalues;
+} ssa_t;
+
+static bb_t *block(ssa_t *s, int i) { return vec_get(s->func->bbs, i); }
+
+static var_t *var_of(ssa_t *s, int offset) {
+  if (offset <= 0 || offset > s->max_offset || s->var_at[offset] < 0)
+    return NULL;
+  return &s->vars[s->var_at[offset]];
+}
+
+// The variable an instruction reads or writes the slot of, if any.
+static var_t *accessed_var(ssa_t *s, ins_t *ins) {
+  switch (ins->op) {
+  case IR_LOAD_VAR:
+  case IR_LOAD_ADDR_VAR:
+    return var_of(s, ins->rhs);
+  case IR_STORE_VAR:
+  case IR_LOAD_ARG:
+    return var_of(s, ins->lhs);
+  }
+  return NULL;
+}
+
+static void number_blocks(ssa_t *s) {
+  int *next = calloc(s->nbbs, sizeof(int)); // successor to visit next
+  int *stack = malloc(s->nbbs * sizeof(int));
+  int sp = 0;
+  s->pre = malloc(s->nbbs * sizeof(int));
+  s->vertex = malloc(s->nbbs * sizeof(int));
+  s->parent = malloc(s->nbbs * sizeof(int));
+  for (int i = 0; i < s->nbbs; i++)
+    s->pre[i] = -1;
+  s->pre[0] = 0;
+  s->vertex[s->nreach++] = 0;
+  stack[sp++] = 0;
+  while (sp) {
+    bb_t *bb = block(s, stack[sp - 1]);
+    if (next[bb->label] == bb->nsucc) {
+      sp--;
+      continue;
+    }
+    bb_t *succ = bb->succ[next[bb->label]++];
+    if (s->pre[succ->label] < 0) {
+      s->pre[succ->label] = s->nreach;
+      s->vertex[s->nreach++] = succ->label;
+      s->parent[succ->label] = bb->label;
+      stack[sp++] = succ->label;
+    }
+  }
+  free(next);
+  free(stack);
+
+  s->pred_at = malloc(s->nbbs * sizeof(*s->pred_at));
+  for (int i = 0; i < s->nbbs; i++) {
+    bb_t *bb = block(s, i);
+    for (int j = 0; j < bb->npreds; j++) {
+      bb_t *p = bb->preds[j];
+      s->pred_at[p->label][p->succ[0] == bb ? 0 : 1] = j;
+    }
+  }
+}
+
+typedef struct {
+  int *semi;
+  int *ancestor; // in the forest of blocks processed so far
+  int *label;    // block of least semidominator on the path to the ancestor
+  int *path;
+} forest_t;
+
+static int eval(forest_t *f, int v) {
+  if (f->ancestor[v] < 0)
+    return v;
+  int n = 0;
+  for (int u = v; f->ancestor[f->ancestor[u]] >= 0; u = f->ancestor[u])
+    f->path[n++] = u;
+  while (n--) {
+    int u = f->path[n];
+    int a = f->ancestor[u];
+    if (f->semi[f->label[a]] < f->semi[f->label[u]])
+      f->label[u] = f->label[a];
+    f->ancestor[u] = f->ancestor[a];
+  }
+  return f->label[v];
+}
+
+// Lengauer and Tarjan's algorithm, with path compression only.
+static void find_dominators(ssa_t *s) {
+  int n = s->nbbs;
+  forest_t f;
+  f.semi = malloc(n * sizeof(int));
+  f.ancestor = malloc(n * sizeof(int));
+  f.label = malloc(n * sizeof(int));
+  f.path = malloc(n * sizeof(int));
+  int *bucket = malloc(n * sizeof(int)); // a block semidominated by each
+  int *bucket_next = malloc(n * sizeof(int));
+  s->idom = malloc(n * sizeof(int));
+  for (int i = 0; i < n; i++) {
+    f.semi[i] = s->pre[i];
+    f.ancestor[i] = -1;
+    f.label[i] = i;
+    bucket[i] = -1;
+    s->idom[i] = -1;
+  }
+
+  for (int i = s->nreach - 1; i > 0; i--) {
+    int w = s->vertex[i];
+    bb_t *bb = block(s, w);
+    for (int j = 0; j < bb->npreds; j++) {
+      int v = bb->preds[j]->label;
+      if (s->pre[v] < 0)
+        continue;
+      int u = eval(&f, v);
+      if (f.semi[u] < f.semi[w])
+        f.semi[w] = f.semi[u];
+    }
+    int sdom = s->vertex[f.semi[w]];
+    bucket_next[w] = bucket[sdom];
+    bucket[sdom] = w;
+    int p = s->parent[w];
+    f.ancestor[w] = p;
+    for (int v = bucket[p]; v >= 0; v = bucket_next[v]) {
+      int u = eval(&f, v);
+      s->idom[v] = f.semi[u] < f.semi[v] ? u : p;
+    }
+    bucket[p] = -1;
+  }
+  for (int i = 1; i < s->nreach; i++) {
+    int w = s->vertex[i];
+    if (s->idom[w] != s->vertex[f.semi[w]])
+      s->idom[w] = s->idom[s->idom[w]];
+  }
+  s->idom[0] = 0;
+  free(f.semi);
+  free(f.ancestor);
+  free(f.label);
+  free(f.path);
+  free(bucket);
+  free(bucket_next);
+}
+
+// A dominator comes before the blocks it dominates in depth-first order.
+static void build_dom_tree(ssa_t *s) {
+  int n = s->nbbs;
+  s->first_child = malloc(n * sizeof(int));
+  s->next_sibling = malloc(n * sizeof(int));
+  s->level = calloc(n, sizeof(int));
+  s->enter = malloc(n * sizeof(int));
+  s->leave = malloc(n * sizeof(int));
+  for (int i = 0; i < n; i++)
+    s->first_child[i] = -1;
+  for (int i = s->nreach - 1; i > 0; i--) {
+    int b = s->vertex[i];
+    s->next_sibling[b] = s->first_child[s->idom[b]];
+    s->first_child[s->idom[b]] = b;
+  }
+  for (int i = 1; i < s->nreach; i++) {
+    int b = s->vertex[i];
+    s->level[b] = s->level[s->idom[b]] + 1;
+    if (s->max_level < s->level[b])
+      s->max_level = s->level[b];
+  }
+
+  int *stack = malloc(s->nreach * sizeof(int));
+  int *child = malloc(n * sizeof(int)); // next child to visit
+  int sp = 0;
+  int clock = 0;
+  stack[sp++] = 0;
+  child[0] = s->first_child[0];
+  s->enter[0] = clock++;
+  while (sp) {
+    int b = stack[sp - 1];
+    int c = child[b];
+    if (c < 0) {
+      s->leave[b] = clock++;
+      sp--;
+      continue;
+    }
+    child[b] = s->next_sibling[c];
+    child[c] = s->first_child[c];
+    s->enter[c] = clock++;
+    stack[sp++] = c;
+  }
+  free(stack);
+  free(child);
+}
+
+static bool dominates(ssa_t *s, int a, int b) {
+  return s->enter[a] <= s->enter[b] && s->leave[b] <= s->leave[a];
+}
+
+// A back edge goes to a block that dominates it; the blocks that reach the
+// back edge without passing its target are the loop.
+static int *loop_depths(ssa_t *s) {
+  int *depth = calloc(s->nbbs, sizeof(int));
+  int *seen = calloc(s->nbbs, sizeof(int));
+  int *work = malloc(s->nbbs * sizeof(int));
+  int nloops = 0;
+  for (int i = 0; i < s->nreach; i++) {
+    bb_t *bb = block(s, s->vertex[i]);
+    for (int j = 0; j < bb->nsucc; j++) {
+      int head = bb->succ[j]->label;
+      if (!dominates(s, head, bb->label))
+        continue;
+      nloops++;
+      seen[head] = nloops;
+      depth[head]++;
+      int n = 0;
+      if (seen[bb->label] != nloops) {
+        seen[bb->label] = nloops;
+        work[n++] = bb->label;
+      }
+      while (n) {
+        bb_t *b = block(s, work[--n]);
+        depth[b->label]++;
+        for (int k = 0; k < b->npreds; k++) {
+          int p = b->preds[k]->label;
+          if (s->pre[p] >= 0 && seen[p] != nloops) {
+            seen[p] = nloops;
+            work[n++] = p;
+          }
+        }
+      }
+    }
+  }
+  free(seen);
+  free(work);
+  return depth;
+}
+
+// Gives homes to the variables used most, in the registers above the ones
+// the function's expressions use.
+static void choose_homes(ssa_t *s) {
+  int *depth = loop_depths(s);
+  for (int i = 0; i < s->nbbs; i++) {
+    bb_t *bb = block(s, i);
+    int d = depth[i] < 5 ? depth[i] : 5;
+    for (int j = 0; j < bb->nins; j++) {
+      ins_t *ins = &bb->ins[j];
+      var_t *v = accessed_var(s, ins);
+      if (v && ins->op == IR_LOAD_ADDR_VAR)
+        v->weight = -1;
+      else if (v && v->weight >= 0)
+        v->weight += 1 << (3 * d);
+    }
+  }
+  free(depth);
+
+  int first = s->func->nregs > 2 ? s->func->nregs : 2;
+  while (first + s->nhomed < 7) {
+    var_t *best = NULL;
+    for (int i = 0; i < s->nvars; i++) {
+      var_t *v = &s->vars[i];
+      if (v->home < 0 && v->weight > 0 && (!best || v->weight > best->weight))
+        best = v;
+    }
+    if (!best)
+      break;
+    best->home = first + s->nhomed;
+    s->homed[s->nhomed++] = best;
+  }
+  if (s->nhomed)
+    s->func->nregs = first + s->nhomed;
+}
+
+static int new_value(ssa_t *s, phi_t *phi, ins_t *def) {
+  if (s->nvalues == s->capvalues) {
+    s->capvalues = s->capvalues ? s->capvalues * 2 : 64;
+    s->values = realloc(s->values, s->capvalues * sizeof(value_t));
+  }
+  s->values[s->nvalues] = (value_t){phi, def, false};
+  return s->nvalues++;
+}
+
+static var_t *homed_var(ssa_t *s, int offset) {
+  var_t *v = var_of(s, offset);
+  return v && v->home >= 0 ? v : NULL;
+}
+
+// Lists the blocks that store each variable with a home; a variable's values
+// are at most its stores and phis, so that sizes its stack.
+static int find_defs(ssa_t *s) {
+  int nstores = 0;
+  for (int k = 0; k < s->nhomed; k++)
+    s->homed[k]->defs = malloc(s->nreach * sizeof(int));
+  for (int i = 0; i < s->nreach; i++) {
+    bb_t *bb = block(s, s->vertex[i]);
+    for (int j = 0; j < bb->nins; j++) {
+      ins_t *ins = &bb->ins[j];
+      if (ins->op != IR_STORE_VAR && ins->op != IR_LOAD_ARG)
+        continue;
+      var_t *v = homed_var(s, ins->lhs);
+      if (!v)
+        continue;
+      nstores++;
+      if (!v->ndefs || v->defs[v->ndefs - 1] != bb->label)
+        v->defs[v->ndefs++] = bb->label;
+    }
+  }
+  return nstores;
+}
+
+static void add_phi(ssa_t *s, int b, int k) {
+  phi_t *phi = calloc(1, sizeof(phi_t));
+  phi->var = k;
+  phi->value = new_value(s, phi, NULL);
+  phi->nargs = block(s, b)->npreds;
+  phi->args = malloc(phi->nargs * sizeof(int));
+  for (int j = 0; j < phi->nargs; j++)
+    phi->args[j] = NO_VALUE;
+  if (!s->phis[b])
+    s->phis[b] = new_vec();
+  vec_push(s->phis[b], phi);
+}
+
+// Sreedhar and Gao's iterated dominance frontier: taking the stores deepest
+// in the dominator tree first, an edge that leaves the subtree of one for a
+// block no deeper than it leads to its frontier.
+static void insert_phis(ssa_t *s) {
+  int n = s->nbbs;
+  s->phis = calloc(n, sizeof(vec_t *));
+  int *head = malloc((s->max_level + 1) * sizeof(int)); // queue of each level
+  int *next = malloc(n * sizeof(int));
+  int *is_def = calloc(n, sizeof(int));
+  int *has_phi = calloc(n, sizeof(int));
+  int *visited = calloc(n, sizeof(int));
+  int *work = malloc(n * sizeof(int));
+
+  for (int k = 0; k < s->nhomed; k++) {
+    int stamp = k + 1;
+    var_t *v = s->homed[k];
+    for (int l = 0; l <= s->max_level; l++)
+      head[l] = -1;
+    for (int i = 0; i < v->ndefs; i++) {
+      int b = v->defs[i];
+      is_def[b] = stamp;
+      next[b] = head[s->level[b]];
+      head[s->level[b]] = b;
+    }
+    for (int l = s->max_level; l >= 0; l--) {
+      while (head[l] >= 0) {
+        int root = head[l];
+        head[l] = next[root];
+        int nwork = 0;
+        work[nwork++] = root;
+        visited[root] = stamp;
+        while (nwork) {
+          int x = work[--nwork];
+          bb_t *bb = block(s, x);
+          for (int i = 0; i < bb->nsucc; i++) {
+            int y = bb->succ[i]->label;
+            if (s->idom[y] == x || s->level[y] > l || has_phi[y] == stamp)
+              continue;
+            has_phi[y] = stamp;
+            add_phi(s, y, k);
+            if (is_def[y] != stamp) {
+              next[y] = head[s->level[y]];
+              head[s->level[y]] = y;
+            }
+          }
+          for (int c = s->first_child[x]; c >= 0; c = s->next_sibling[c]) {
+            if (visited[c] != stamp) {
+              visited[c] = stamp;
+              work[nwork++] = c;
+            }
+          }
+        }
+      }
+    }
+  }
+  free(head);
+  free(next);
+  free(is_def);
+  free(has_phi);
+  free(visited);
+  free(work);
+}
+
+static void push_value(var_t *v, int value) { v->stack[v->depth++] = value; }
+
+static int top_value(var_t *v) {
+  return v->depth ? v->stack[v->depth - 1] : NO_VALUE;
+}
+
+static void rename_block(ssa_t *s, int b) {
+  bb_t *bb = block(s, b);
+  for (int i = 0; s->phis[b] && i < vec_len(s->phis[b]); i++) {
+    phi_t *phi = vec_get(s->phis[b], i);
+    push_value(s->homed[phi->var], phi->value);
+  }
+  for (int i = 0; i < bb->nins; i++) {
+    ins_t *ins = &bb->ins[i];
+    var_t *v;
+    if (ins->op == IR_LOAD_VAR && (v = homed_var(s, ins->rhs))) {
+      if (top_value(v) != NO_VALUE)
+        s->values[top_value(v)].live = true;
+      ins->op = IR_MOV;
+      ins->rhs = v->home;
+    } else if (ins->op == IR_STORE_VAR && (v = homed_var(s, ins->lhs))) {
+      push_value(v, new_value(s, NULL, ins));
+      ins->op = IR_MOV;
+      ins->lhs = v->home;
+    } else if (ins->op == IR_LOAD_ARG && (v = homed_var(s, ins->lhs))) {
+      push_value(v, new_value(s, NULL, ins));
+      ins->op = IR_MOV_ARG;
+      ins->lhs = v->home;
+    }
+  }
+  for (int i = 0; i < bb->nsucc; i++) {
+    vec_t *phis = s->phis[bb->succ[i]->label];
+    for (int j = 0; phis && j < vec_len(phis); j++) {
+      phi_t *phi = vec_get(phis, j);
+      phi->args[s->pred_at[b][i]] = top_value(s->homed[phi->var]);
+    }
+  }
+}
+
+// Walks the dominator tree, so the value on top of a variable's stack is the
+// one that reaches the instruction being renamed.
+static void rename_values(ssa_t *s) {
+  frame_t *stack = malloc(s->nreach * sizeof(frame_t));
+  int sp = 0;
+  for (int b = 0; b >= 0;) {
+    frame_t *f = &stack[sp++];
+    f->b = b;
+    f->child = s->first_child[b];
+    for (int k = 0; k < s->nhomed; k++)
+      f->depth[k] = s->homed[k]->depth;
+    rename_block(s, b);
+
+    b = -1;
+    while (sp && b < 0) {
+      f = &stack[sp - 1];
+      if (f->child >= 0) {
+        b = f->child;
+        f->child = s->next_sibling[b];
+        continue;
+      }
+      for (int k = 0; k < s->nhomed; k++)
+        s->homed[k]->depth = f->depth[k];
+      sp--;
+    }
+  }
+  free(stack);
+}
+
+// A phi that is used makes the values it merges used too. The stores of
+// values nothing uses are removed.
+static void remove_dead_stores(ssa_t *s) {
+  int *work = malloc(s->nvalues * sizeof(int));
+  int n = 0;
+  for (int i = 0; i < s->nvalues; i++) {
+    if (s->values[i].live && s->values[i].phi)
+      work[n++] = i;
+  }
+  while (n) {
+    phi_t *phi = s->values[work[--n]].phi;
+    for (int j = 0; j < phi->nargs; j++) {
+      if (phi->args[j] == NO_VALUE)
+        continue;
+      value_t *arg = &s->values[phi->args[j]];
+      if (!arg->live) {
+        arg->live = true;
+        if (arg->phi)
+          work[n++] = phi->args[j];
+      }
+    }
+  }
+  free(work);
+
+  for (int i = 0; i < s->nvalues; i++) {
+    if (!s->values[i].live && s->values[i].def)
+      s->values[i].def->op = -1;
+  }
+  for (int i = 0; i < s->nreach; i++) {
+    bb_t *bb = block(s, s->vertex[i]);
+    int n = 0;
+    for (int j = 0; j < bb->nins; j++) {
+      if (bb->ins[j].op >= 0)
+        bb->ins[n++] = bb->ins[j];
+    }
+    bb->nins = n;
+  }
+}
+
+// No value reaches a block that cannot run; its loads and stores just use
+// the homes.
+static void rewrite_unreachable(ssa_t *s) {
+  for (int i = 0; i < s->nbbs; i++) {
+    if (s->pre[i] >= 0)
+      continue;
+    bb_t *bb = block(s, i);
+    for (int j = 0; j < bb->nins; j++) {
+      ins_t *ins = &bb->ins[j];
+      var_t *v;
+      if (ins->op == IR_LOAD_VAR && (v = homed_var(s, ins->rhs))) {
+        ins->op = IR_MOV;
+        ins->rhs = v->home;
+      } else if (ins->op == IR_STORE_VAR && (v = homed_var(s, ins->lhs))) {
+        ins->op = IR_MOV;
+        ins->lhs = v->home;
+      }
+    }
+  }
+}
+
+static void free_ssa(ssa_t *s) {
+  for (int i = 0; s->phis && i < s->nbbs; i++) {
+    if (!s->phis[i])
+      continue;
+    for (int j = 0; j < vec_len(s->phis[i]); j++) {
+      phi_t *phi = vec_get(s->phis[i], j);
+      free(phi->args);
+      free(phi);
+    }
+    free_vec(s->phis[i]);
+  }
+  for (int i = 0; i < s->nvars; i++) {
+    free(s->vars[i].defs);
+    free(s->vars[i].stack);
+  }
+  free(s->vars);
+  free(s->var_at);
+  free(s->pre);
+  free(s->vertex);
+  free(s->parent);
+  free(s->pred_at);
+  free(s->idom);
+  free(s->first_child);
+  free(s->next_sibling);
+  free(s->level);
+  free(s->enter);
+  free(s->leave);
+  free(s->phis);
+  free(s->values);
+}
+
+void mem2reg(func_t *func, vec_t *vars) {
+  if (!vec_len(vars) || func->nregs >= 7)
+    return;
+  ssa_t s = {0};
+  s.func = func;
+  s.nbbs = vec_len(func->bbs);
+  s.nvars = vec_len(vars);
+  s.vars = calloc(s.nvars, sizeof(var_t));
+  for (int i = 0; i < s.nvars; i++) {
+    s.vars[i].sym = vec_get(vars, i);
+    s.vars[i].home = -1;
+    if (s.max_offset < s.vars[i].sym->offset)
+      s.max_offset = s.vars[i].sym->offset;
+  }
+  s.var_at = malloc((s.max_offset + 1) * sizeof(int));
+  for (int i = 0; i <= s.max_offset; i++)
+    s.var_at[i] = -1;
+  for (int i = 0; i < s.nvars; i++) {
+    // Parameters passed on the stack are above rbp.
+    if (s.vars[i].sym->offset > 0)
+      s.var_at[s.vars[i].sym->offset] = i;
+  }
+
+  number_blocks(&s);
+  find_dominators(&s);
+  build_dom_tree(&s);
+  choose_homes(&s);
+  if (s.nhomed) {
+    int nstores = find_defs(&s);
+    insert_phis(&s);
+    for (int k = 0; k < s.nhomed; k++)
+      s.homed[k]->stack = malloc((nstores + s.nvalues + 1) * sizeof(int));
+    rename_values(&s);
+    remove_dead_stores(&s);
+    rewrite_unreachable(&s);
+  }
+  free_ssa(&s);
+}
@@ -3,17 +3,27 @@
 test () {
   expect="$1"
   arg="$2"
+  flags="$3"
 
-  ./sicc "$arg" > tst.s
   if [ "$(uname)" == 'Darwin' ]; then
+    ./sicc $flags "$arg" -o tst.s
     as -o tst.o tst.s
     ld -lSystem -w -e _main -o tst tst.o
+    ./tst
+    ret="$?"
   else
-    gcc -static -o tst tst.s
+    ./sicc $flags --run "$arg"
+    ret="$?"
+    # The same program as an object linked by gcc, so that the ELF writer
+    # is tested too.
+    ./sicc $flags -c "$arg" -o tst.o && gcc -static -o tst tst.o &&
+      ./tst > /dev/null
+    obj_ret="$?"
+    if [ "$ret" != "$obj_ret" ]; then
+      echo "--run returned $ret but the linked object $obj_ret: $arg"
+      exit 1
+    fi
   fi
-
-  ./tst
-  ret="$?"
   if [ "$expect" == "$ret" ]; then
     echo "$arg -> $ret"
   else
@@ -27,6 +37,7 @@ test 0 'test/fib.c'
 test 0 'test/while.c'
 test 10 'test/scope.c'
 test 19 'test/macro.c'
+test 29 'test/macro2.c'
 test 0 'test/sizeof.c'
 test 0 'test/strings.c'
 test 0 'test/operator.c'
@@ -49,6 +60,90 @@ test 6 'test/continue2.c'
 test 65 'test/cast.c'
 test 0 'test/not.c'
 test 0 'test/initializer.c'
+test 36 'test/align.c'
+test 42 'test/control.c'
+test 34 'test/mem2reg.c'
+test 11 'test/include2.c'
+test 33 'test/include3.c'
+test 6 'test/include4.c'
+test 56 'test/pch.c'
+./sicc --emit-pch test/pch.h -o tst.pch || exit 1
+test 56 'test/pch.c' '-include-pch tst.pch'
+# A truncated file, or one made from a header changed since, is an error.
+head -c 100 tst.pch > tst.cut.pch
+./sicc -include-pch tst.cut.pch -c test/pch.c -o tst.o 2> /dev/null
+[ "$?" == 1 ] || { echo "truncated pch not rejected"; exit 1; }
+cp test/pch.h tst.h && ./sicc --emit-pch tst.h -o tst.pch || exit 1
+echo '#define CHANGED 1' >> tst.h
+./sicc -include-pch tst.pch -c test/pch.c -o tst.o 2> /dev/null
+[ "$?" == 1 ] || { echo "stale pch not rejected"; exit 1; }
+
+# The compile server expands headers on its own and reuses the expansions, so
+# each file is compiled through it twice, cold and warm, and must return what
+# it returns compiled here.
+test_client () {
+  arg="$1"
+  ./sicc --run "$arg"
+  expect="$?"
+  for i in 1 2; do
+    ./sicc --client -c "$arg" -o tst.o && gcc -static -o tst tst.o &&
+      ./tst > /dev/null
+    ret="$?"
+    if [ "$expect" != "$ret" ]; then
+      echo "$expect expected from the compile server but got $ret: $arg"
+      exit 1
+    fi
+  done
+  echo "$arg --client -> $ret"
+}
+
+if [ "$(uname)" != 'Darwin' ]; then
+  # Without SICC_SOCKET the server only listens in a directory that no one
+  # else can enter.
+  mkdir -p tst.run && chmod 755 tst.run
+  env -u SICC_SOCKET XDG_RUNTIME_DIR="$PWD/tst.run" timeout 5 ./sicc --server \
+    2> /dev/null
+  [ "$?" == 1 ] ||
+    { echo "compile server listened in a shared directory"; exit 1; }
+
+  export SICC_SOCKET="$PWD/tst.sock"
+  rm -f tst.sock
+  ./sicc --server 2> /dev/null &
+  server=$!
+  trap 'kill $server; rm -f "$src"' EXIT
+  # --client compiles here when no server listens, so wait for the socket.
+  for i in $(seq 50); do
+    [ -S tst.sock ] && break
+    sleep 0.1
+  done
+  test_client 'test/include2.c'
+  test_client 'test/include3.c'
+  test_client 'test/include4.c'
+
+  # Each request's memory goes away with it, so after a few requests to warm
+  # up, the server's resident set stays where it is. The source is kept out of
+  # the tree, where make would take it for a source of sicc.
+  src=$(mktemp /tmp/sicc-rss-XXXXXX.c)
+  {
+    echo '#include "test/pch.h"'
+    for i in $(seq 1000); do
+      echo "int f$i(int x) { int y = add(x, $i); return y > TEN ? y * 2 : y; }"
+    done
+    echo 'int main() { return f1(2); }'
+  } > "$src"
+  rss () { awk '/^VmRSS/ { print $2 }' /proc/$server/status; }
+  for i in $(seq 25); do
+    ./sicc --client --stats -c "$src" -o tst.o 2> /dev/null ||
+      { echo "compile server failed on $src"; exit 1; }
+    [ "$i" == 5 ] && before=$(rss)
+  done
+  after=$(rss)
+  if [ $((after - before)) -gt 2048 ]; then
+    echo "compile server grew from $before KiB to $after KiB in 20 requests"
+    exit 1
+  fi
+  echo "compile server rss: $before KiB -> $after KiB"
+fi
 # test 0 'test/test.c'
 # test 0 'int main() { return 0; }'
 # test 15 'int main() { int a = 10; int b = 5; return a + b; }'
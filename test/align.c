@@ -0,0 +1,63 @@
+struct mixed {
+  char c;
+  long l;
+  int i;
+};
+
+struct small {
+  char a;
+  int b;
+  char c;
+};
+
+struct nested {
+  char c;
+  struct small s;
+};
+
+char gc;
+struct mixed gm;
+struct small gs = {1, 2, 3};
+struct init {
+  char c;
+  int i;
+  long l;
+} gi = {1, 2, 3};
+
+// Arguments passed on the stack take eight bytes each.
+int last(int a, int b, int c, int d, int e, int f, int g, int h) {
+  return g * 10 + h;
+}
+
+int main() {
+  struct mixed m;
+  m.c = 1;
+  m.l = 2;
+  m.i = 3;
+  long *lp = &m;
+  int *ip = &m;
+  if (*(lp + 1) != 2 || *(ip + 4) != 3)
+    return 1;
+  if (sizeof(struct mixed) != 24 || sizeof(struct small) != 12)
+    return 2;
+  if (sizeof(struct nested) != 16)
+    return 3;
+
+  struct nested n;
+  n.s.b = 5;
+  int *np = &n;
+  if (*(np + 2) != 5)
+    return 4;
+
+  gc = 7;
+  gm.l = 8;
+  long *gp = &gm;
+  if (*(gp + 1) != 8)
+    return 5;
+  if (last(1, 2, 3, 4, 5, 6, 7, 8) != 78)
+    return 6;
+  // Each initializer takes the size of its member.
+  if (gi.c != 1 || gi.i != 2 || gi.l != 3 || gs.b != 2 || gs.c != 3)
+    return 7;
+  return sizeof(struct mixed) + sizeof(struct small);
+}
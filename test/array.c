@@ -25,5 +25,12 @@ int main() {
     int f[2][2][2];
     f[0][1][0] = 10;
     printf("f[0][1][0] == %d\n", f[0][1][0]);
+    // A pointer is indexed from its value, not from where it is stored.
+    int *ep = e;
+    if (ep[9] != 42 || ep[2] != 10)
+        return 1;
+    int **pp = &ep;
+    if (pp[0][9] != 42)
+        return 2;
     return 0;
 }
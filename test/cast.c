@@ -1,9 +1,25 @@
 #include <stdio.h>
 
+char g = 3;
+
 int main(void) {
+  // A char compare is branched on as a whole register.
+  if (g != 3)
+    return 1;
   int a = 65;
   printf("%c\n", (char)a);
   char c = 10;
   printf("%d\n", (int)c);
+  // A char loaded through a pointer is tested as a whole register.
+  char s[3];
+  s[0] = 1;
+  s[1] = 2;
+  s[2] = 0;
+  char *p = s;
+  int n = 0;
+  for (; *p; p++)
+    n++;
+  if (n != 2)
+    return 2;
   return a;
 }
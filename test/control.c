@@ -0,0 +1,66 @@
+int classify(int n) {
+  if (n < 0)
+    return 1;
+  else if (n == 0)
+    return 2;
+  else
+    return 3;
+}
+
+int nested_break() {
+  int n = 0;
+  for (int i = 0; i < 3; i++) {
+    for (int j = 0; j < 3; j++) {
+      if (j > 1)
+        break;
+      n++;
+    }
+    if (i > 0)
+      break;
+  }
+  return n;
+}
+
+int skip_odd() {
+  int n = 0;
+  for (int i = 0; i < 10; i++) {
+    if (i == 1 || i == 3)
+      continue;
+    if (i == 5 || i == 7 || i == 9)
+      continue;
+    n = n + i;
+  }
+  return n;
+}
+
+int no_default(int a) {
+  int r = 7;
+  switch (a) {
+  case 1:
+    r = 10;
+    break;
+  }
+  return r;
+}
+
+int forward_goto() {
+  int n = 1;
+  goto out;
+  n = 2;
+out:
+  return n;
+}
+
+int main() {
+  if (classify(-5) != 1 || classify(0) != 2 || classify(5) != 3)
+    return 1;
+  if (nested_break() != 4)
+    return 2;
+  if (skip_odd() != 20)
+    return 3;
+  if (no_default(1) != 10 || no_default(2) != 7)
+    return 4;
+  if (forward_goto() != 1)
+    return 5;
+  return 42;
+}
@@ -3,9 +3,17 @@
 int a = 10;
 char *s;
 int b;
+int arr[4];
+
+int second(int *p) { return p[1]; }
 
 int main()
 {
   printf("%d\n", a);
+  // A global array decays to its address like a local one.
+  arr[1] = 5;
+  int *p = arr;
+  if (p[1] != 5 || second(arr) != 5)
+    return 1;
   return 0;
 }
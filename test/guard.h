@@ -0,0 +1,7 @@
+// Included twice by test/include2.c.
+#ifndef GUARD_H
+#define GUARD_H
+
+n = n + 10;
+
+#endif
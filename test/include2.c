@@ -0,0 +1,9 @@
+int main() {
+  int n = 0;
+#include "test/once.h"
+#include "test/once.h"
+#include "test/guard.h"
+#include "test/guard.h"
+#include "./test/once.h"
+  return n;
+}
@@ -0,0 +1,11 @@
+#define BASE 30
+#include "test/twice.h"
+
+int main() {
+  int n = BASE;
+#include "test/once.h"
+  twice_val = TWICE;
+  return n + twice_val;
+}
+
+#include "test/twice.h"
@@ -0,0 +1,5 @@
+#define N 3
+#include "test/scale.h"
+#include "test/twice.h"
+
+int main() { return scale(TWICE); }
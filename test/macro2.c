@@ -0,0 +1,24 @@
+int self = 2;
+
+#define TEN 10
+#define SQ(x) ((x) * (x))
+#define ADD(a, b) (a + b)
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+#define self self + 1 // a comment that must not eat the rest of the line
+#define F() 3
+#define ID(x) x
+#define CALL ID
+#define __ONE 1
+#define _TWICE(x) ((x) + (x))
+
+int main() {
+  int a = SQ(3);                 // 9
+  int b = SQ(TEN);               // 100
+  int c = ADD(SQ(2), ADD(1, 2)); // 7
+  int d = MAX(ADD(1, 1),
+              SQ(1));            // 2
+  int e = ADD(-1, -TEN) - -TEN;  // -1
+  int f = F() + CALL(4);         // 7
+  int g = _TWICE(__ONE);         // 2
+  return a + b + c + d + e + f + g + self - 100;
+}
@@ -0,0 +1,78 @@
+int fib(int n) {
+  if (n < 2)
+    return n;
+  return fib(n - 1) + fib(n - 2);
+}
+
+int sum_to(int n) {
+  int s = 0;
+  for (int i = 1; i <= n; i++)
+    s += i;
+  return s;
+}
+
+// More locals than there are registers to keep them in, live across calls.
+int many(int a, int b, int c, int d, int e, int f, int g) {
+  int t = 0;
+  int u = 1;
+  int v = 2;
+  int w = 3;
+  int x = 4;
+  int y = 5;
+  for (int i = 0; i < 3; i++) {
+    t = t + fib(a + i);
+    u = u * 2;
+    v--;
+    w += b;
+    x = x - c;
+    y = y + d + e + f + g;
+  }
+  return t + u + v + w + x + y;
+}
+
+int bump(int *p) {
+  *p = *p + 1;
+  return 0;
+}
+
+// The address of n is taken, so it stays in memory.
+int address_taken() {
+  int n = 5;
+  int k = 0;
+  while (k < 3) {
+    bump(&n);
+    k++;
+  }
+  return n;
+}
+
+int walk() {
+  int a[4] = {1, 2, 3, 4};
+  int *p = a;
+  int s = 0;
+  for (int i = 0; i < 4; i++) {
+    s = s * 10 + *p;
+    p = p + 1;
+  }
+  return s;
+}
+
+int unused(int a) {
+  int dead = a * 3;
+  dead = 7;
+  return a;
+}
+
+int main() {
+  if (sum_to(10) != 55)
+    return 1;
+  if (many(5, 1, 2, 3, 4, 5, 6) != 96)
+    return 2;
+  if (address_taken() != 8)
+    return 3;
+  if (walk() != 1234)
+    return 4;
+  if (unused(9) != 9)
+    return 5;
+  return fib(9);
+}
@@ -0,0 +1,11 @@
+#include "test/pch.h"
+
+int main() {
+  node_t n;
+  n.val = add(8, 2) + TEN;
+  struct pair p;
+  p.b = BLUE;
+  color_t c = GREEN;
+  shared = 1;
+  return n.val + p.b + c + shared + sizeof(node_t);
+}
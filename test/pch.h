@@ -0,0 +1,23 @@
+#ifndef PCH_H
+#define PCH_H
+
+#define TEN 10
+#define add(a, b) a + b
+
+typedef struct node {
+  int val;
+  struct node *next;
+  char tag[3];
+} node_t;
+
+struct pair {
+  int a;
+  long b;
+};
+
+enum color { RED, GREEN = 5, BLUE };
+typedef enum color color_t;
+
+int shared;
+
+#endif
@@ -0,0 +1,2 @@
+// Reads N, which test/include4.c defines before including it.
+int scale(int x) { return x * N; }
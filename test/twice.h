@@ -0,0 +1,8 @@
+// Included twice by test/include3.c, with another include in between.
+#ifndef TWICE_H
+#define TWICE_H
+
+int twice_val;
+#define TWICE 2
+
+#endif
@@ -1,36 +1,58 @@
 #include "sicc.h"
 
 #include <ctype.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
-vec_t *tokens = NULL;
-int pos = 0;
+// Keywords are found with a perfect hash of their first and last characters
+// and length. Each one sits at the index keyword_hash() gives it; a keyword
+// added here needs a hash that is still free of collisions.
+#define KEYWORD_SLOTS 32
+
+static int keyword_hash(char *s, int len) {
+  return ((unsigned char)s[0] + (unsigned char)s[len - 1] * 29 + len) &
+         (KEYWORD_SLOTS - 1);
+}
 
 static struct keyword {
   char *str;
   int ty;
-} keywords[] = {
-    {"return", TK_RETURN},     {"if", TK_IF},
-    {"else", TK_ELSE},         {"int", TK_INT},
-    {"char", TK_CHAR},         {"while", TK_WHILE},
-    {"sizeof", TK_SIZEOF},     {"for", TK_FOR},
-    {"struct", TK_STRUCT},     {"typedef", TK_TYPEDEF},
-    {"goto", TK_GOTO},         {"switch", TK_SWITCH},
-    {"case", TK_CASE},         {"default", TK_DEFAULT},
-    {"break", TK_BREAK},       {"enum", TK_ENUM},
-    {"continue", TK_CONTINUE}, {NULL, 0},
+} keywords[KEYWORD_SLOTS] = {
+    [1] = {"switch", TK_SWITCH},     [2] = {"enum", TK_ENUM},
+    [6] = {"break", TK_BREAK},       [7] = {"sizeof", TK_SIZEOF},
+    [9] = {"typedef", TK_TYPEDEF},   [13] = {"while", TK_WHILE},
+    [14] = {"return", TK_RETURN},    [15] = {"default", TK_DEFAULT},
+    [16] = {"int", TK_INT},          [17] = {"char", TK_CHAR},
+    [19] = {"for", TK_FOR},          [24] = {"case", TK_CASE},
+    [25] = {"if", TK_IF},            [26] = {"else", TK_ELSE},
+    [28] = {"continue", TK_CONTINUE}, [29] = {"struct", TK_STRUCT},
+    [30] = {"goto", TK_GOTO},
 };
 
-static int check_ident_type(char *str) {
-  for (int i = 0; keywords[i].ty != 0; i++) {
-    if (!strcmp(str, keywords[i].str))
-      return keywords[i].ty;
+static void init_keywords() {
+  ctx->keywords = arena_alloc(ctx->token_arena, KEYWORD_SLOTS * sizeof(char *));
+  for (int i = 0; i < KEYWORD_SLOTS; i++) {
+    char *str = keywords[i].str;
+    if (!str)
+      continue;
+    if (keyword_hash(str, strlen(str)) != i)
+      error("Keyword %s is in the wrong slot", str);
+    ctx->keywords[i] = intern(str);
   }
+}
+
+static int check_ident_type(char *s, int len) {
+  struct keyword *k = &keywords[keyword_hash(s, len)];
+  if (k->str && !strncmp(k->str, s, len) && !k->str[len])
+    return k->ty;
   return TK_IDENT;
 }
 
-static char get_escape_char(char c, char **s) {
+char get_escape_char(char c, char **s) {
   if (c == '\\') {
     if (**s == '0') {
       *s += 1;
@@ -50,7 +72,7 @@ static char get_escape_char(char c, char **s) {
     } else if (**s == 'r') {
       *s += 1;
       return '\r';
-    } else if (**s == '\t') {
+    } else if (**s == 't') {
       *s += 1;
       return '\t';
     } else if (**s == '\\') {
@@ -68,231 +90,432 @@ static char get_escape_char(char c, char **s) {
   return c;
 }
 
-static char next(char **s) {
-  pos++;
-  return *((*s)++);
+// Spellings of the tokens whose text never varies are kept in
+// ctx->spellings, indexed by kind.
+#define NSPELLINGS (TK_CHAR - TK_EOF + 1)
+
+static struct punct {
+  char *str;
+  int ty;
+} puncts[] = {
+    {"", TK_EOF},          {"+", TK_PLUS},         {"-", TK_MINUS},
+    {"*", TK_ASTERISK},    {"/", TK_SLASH},        {"=", TK_ASSIGN},
+    {"+=", TK_PLUS_ASSIGN}, {"-=", TK_MINUS_ASSIGN}, {"++", TK_PLUS_PLUS},
+    {"--", TK_MINUS_MINUS}, {">", TK_GREAT},        {"<", TK_LESS},
+    {">=", TK_GREAT_EQ},   {"<=", TK_LESS_EQ},     {"!=", TK_NOT_EQUAL},
+    {"==", TK_EQUAL},      {"!", TK_NOT},          {"&", TK_AND},
+    {"&&", TK_AND_AND},    {"|", TK_OR},           {"||", TK_OR_OR},
+    {".", TK_DOT},         {"->", TK_ARROW},       {"?", TK_QUESTION},
+    {"...", TK_VA_SPEC},   {"(", TK_LPAREN},       {")", TK_RPAREN},
+    {"{", TK_LBRACE},      {"}", TK_RBRACE},       {"[", TK_LBRACKET},
+    {"]", TK_RBRACKET},    {";", TK_SEMICOLON},    {":", TK_COLON},
+    {",", TK_COMMA},       {NULL, 0},
+};
+
+static void init_spellings() {
+  char **spellings = arena_alloc(ctx->token_arena, NSPELLINGS * sizeof(char *));
+  for (int i = 0; puncts[i].str; i++)
+    spellings[puncts[i].ty - TK_EOF] = intern(puncts[i].str);
+  for (int i = 0; i < KEYWORD_SLOTS; i++) {
+    if (keywords[i].str)
+      spellings[keywords[i].ty - TK_EOF] = ctx->keywords[i];
+  }
+  ctx->spellings = spellings;
 }
 
-token_t *make_token(int ty, char *str, int line) {
-  token_t *tk = malloc(sizeof(token_t));
-  tk->ty = ty;
-  tk->str = str;
-  tk->line = line;
-  tk->pos = pos;
-  return tk;
+static token_stream_t *new_token_stream(char *src) {
+  token_stream_t *ts = arena_alloc(ctx->heap, sizeof(token_stream_t));
+  ts->src = src;
+  // Dense C code has about one token per 2.5 bytes, so the arrays seldom
+  // have to grow.
+  ts->cap = src ? strlen(src) / 2 + 1024 : 1024;
+  ts->kind = arena_alloc(ctx->token_arena, ts->cap);
+  ts->offset = arena_alloc(ctx->token_arena, ts->cap * sizeof(int));
+  ts->length = arena_alloc(ctx->token_arena, ts->cap * sizeof(int));
+  ts->lines_cap = 256;
+  ts->lines = arena_alloc(ctx->token_arena, ts->lines_cap * sizeof(int));
+  ts->lines[ts->nlines++] = 0;
+  ts->memo = -1;
+  ts->line = 1;
+  return ts;
 }
 
-void tokenize(char *s) {
-  char c;
-  int n = 0, line = 1;
-  tokens = new_vec();
+// The stream arrays live in the token arena, so growing one copies it.
+static void *grow_array(void *p, int len, int cap, int size) {
+  void *np = arena_alloc(ctx->token_arena, cap * size);
+  memcpy(np, p, len * size);
+  return np;
+}
 
-  while ((c = *s)) {
-    next(&s);
+static char *escaped_str(char *s) {
+  char c = *s++;
+  char buf[2] = {get_escape_char(c, &s), '\0'};
+  return intern(buf);
+}
 
-    if (c == '\n') {
-      line++;
-      pos = 0;
-      continue;
-    }
-    if (isspace(c)) {
-      continue;
-    }
-    if (c == '+') {
-      if (*s == '=') {
-        vec_push(tokens, make_token(TK_PLUS_ASSIGN, "+=", line));
-        next(&s);
-      } else if (*s == '+') {
-        vec_push(tokens, make_token(TK_PLUS_PLUS, "++", line));
-        next(&s);
-      } else {
-        vec_push(tokens, make_token(TK_PLUS, "+", line));
-      }
-      continue;
-    }
-    if (c == '-') {
-      if (*s == '=') {
-        vec_push(tokens, make_token(TK_MINUS_ASSIGN, "-=", line));
-        next(&s);
-      } else if (*s == '-') {
-        vec_push(tokens, make_token(TK_MINUS_MINUS, "--", line));
-        next(&s);
-      } else if (*s == '>') {
-        vec_push(tokens, make_token(TK_ARROW, "->", line));
-        next(&s);
-      } else {
-        vec_push(tokens, make_token(TK_MINUS, "-", line));
-      }
-      continue;
-    }
-    if (c == '*') {
-      vec_push(tokens, make_token(TK_ASTERISK, "*", line));
-      continue;
-    }
-    if (c == '/') {
-      if (*s == '/') {
-        while (*s != '\n')
-          next(&s);
-        continue;
-      } else if (*s == '*') {
-        while (*s) {
-          s++;
-          if (*s == '*' && *(s + 1) == '/')
-            break;
-        }
-        if (*s == '\0')
-          error("Multiple line comments must be ending as '*/'");
-        next(&s);
-        next(&s); // skip '*' and '/'
-        continue;
-      }
-      vec_push(tokens, make_token(TK_SLASH, "/", line));
-      continue;
-    }
-    if (c == '=') {
-      if (*s == '=') {
-        next(&s);
-        vec_push(tokens, make_token(TK_EQUAL, "==", line));
-        continue;
-      } else {
-        vec_push(tokens, make_token(TK_ASSIGN, "=", line));
-        continue;
-      }
-    }
-    if (c == '>') {
-      if (*s == '=') {
-        s++;
-        vec_push(tokens, make_token(TK_GREAT_EQ, ">=", line));
-      } else {
-        vec_push(tokens, make_token(TK_GREAT, ">", line));
-      }
-      continue;
-    }
-    if (c == '<') {
-      if (*s == '=') {
-        s++;
-        vec_push(tokens, make_token(TK_LESS_EQ, "<=", line));
-      } else {
-        vec_push(tokens, make_token(TK_LESS, "<", line));
-      }
-      continue;
-    }
-    if (c == '(') {
-      vec_push(tokens, make_token(TK_LPAREN, "(", line));
-      continue;
-    }
-    if (c == ')') {
-      vec_push(tokens, make_token(TK_RPAREN, ")", line));
-      continue;
-    }
-    if (c == '{') {
-      vec_push(tokens, make_token(TK_LBRACE, "{", line));
-      continue;
-    }
-    if (c == '}') {
-      vec_push(tokens, make_token(TK_RBRACE, "}", line));
-      continue;
-    }
-    if (c == ';') {
-      vec_push(tokens, make_token(TK_SEMICOLON, ";", line));
-      continue;
-    }
-    if (c == ':') {
-      vec_push(tokens, make_token(TK_COLON, ":", line));
-      continue;
-    }
-    if (c == ',') {
-      vec_push(tokens, make_token(TK_COMMA, ",", line));
-      continue;
-    }
-    if (c == '.') {
-      if (*s == '.' && *(s+1) == '.') {
-        s += 2;
-        vec_push(tokens, make_token(TK_VA_SPEC, "...", line));
-      } else {
-        vec_push(tokens, make_token(TK_DOT, ".", line));
-      }
-      continue;
-    }
-    if (c == '\"') {
-      buf_t *b = new_buf();
-      while (*s != '\"')
-        buf_push(b, next(&s));
-      next(&s);
-      vec_push(tokens, make_token(TK_STRING, buf_str(b), line));
-      continue;
-    }
-    if (c == '\'') {
-      char ch = next(&s);
-      buf_t *b = new_buf();
-      buf_push(b, get_escape_char(ch, &s));
-      next(&s);
-      vec_push(tokens, make_token(TK_CHARACTER, buf_str(b), line));
-      continue;
-    }
-    if (c == '!') {
-      if (*s == '=') {
-        next(&s);
-        vec_push(tokens, make_token(TK_NOT_EQUAL, "!=", line));
-        continue;
-      } else {
-        vec_push(tokens, make_token(TK_NOT, "!", line));
-        continue;
-      }
-    }
-    if (c == '?') {
-      vec_push(tokens, make_token(TK_QUESTION, "?", line));
-      continue;
+static void push_token(int ty, char *start, int len) {
+  token_stream_t *ts = ctx->tokens;
+  if (ts->pp) {
+    int i = ts->len & (TOKEN_RING - 1);
+    char *fixed = ctx->spellings[ty - TK_EOF];
+    ts->ring_kind[i] = ty - TK_EOF;
+    if (fixed)
+      ts->ring_str[i] = fixed;
+    else if (ty == TK_CHARACTER)
+      ts->ring_str[i] = escaped_str(start);
+    else
+      ts->ring_str[i] = intern_n(start, len);
+    ts->ring_line[i] = ts->line;
+    ts->ring_col[i] = start - ts->window->data - ts->line_start;
+    ts->len++;
+    return;
+  }
+
+  if (ts->len == ts->cap) {
+    ts->kind = grow_array(ts->kind, ts->len, ts->cap * 2, 1);
+    ts->offset = grow_array(ts->offset, ts->len, ts->cap * 2, sizeof(int));
+    ts->length = grow_array(ts->length, ts->len, ts->cap * 2, sizeof(int));
+    ts->cap *= 2;
+  }
+  ts->kind[ts->len] = ty - TK_EOF;
+  ts->offset[ts->len] = start - ts->src;
+  ts->length[ts->len] = len;
+  ts->len++;
+}
+
+static void push_line(char *start) {
+  token_stream_t *ts = ctx->tokens;
+  if (ts->pp) {
+    ts->line++;
+    ts->line_start = start - ts->window->data;
+    return;
+  }
+
+  if (ts->nlines == ts->lines_cap) {
+    ts->lines = grow_array(ts->lines, ts->nlines, ts->lines_cap * 2, sizeof(int));
+    ts->lines_cap *= 2;
+  }
+  ts->lines[ts->nlines++] = start - ts->src;
+}
+
+// Pulls the next line of preprocessed text into the window, dropping what
+// precedes `s`. Returns where `s` now is, or NULL if the input is exhausted.
+static char *more(char *s) {
+  token_stream_t *ts = ctx->tokens;
+  if (!ts->pp)
+    return NULL;
+  buf_t *w = ts->window;
+  int keep = s - w->data;
+  memmove(w->data, s, w->len - keep);
+  w->len -= keep;
+  ts->line_start -= keep;
+  bool read = pp_read(ts->pp, w);
+  buf_str(w);
+  ts->cur = w->data;
+  return read ? w->data : NULL;
+}
+
+static char *lex(char *s);
+
+// Lexes until token `i` is in the ring.
+static int stream_slot(int i) {
+  token_stream_t *ts = ctx->tokens;
+  if (i < ts->len - TOKEN_RING)
+    error("Token %d has left the lookahead buffer", i);
+  while (ts->len <= i) {
+    char *s = ts->cur;
+    if (!strchr(s, '\n')) {
+      char *t = more(s);
+      s = t ? t : ts->cur;
     }
-    if (c == '&') {
-      if (*s == '&') {
-        next(&s);
-        vec_push(tokens, make_token(TK_AND_AND, "&&", line));
-      } else {
-        vec_push(tokens, make_token(TK_AND, "&", line));
-      }
+    if (*s == '\0') {
+      push_token(TK_EOF, s, 0);
       continue;
     }
-    if (c == '|') {
-      if (*s == '|') {
-        next(&s);
-        vec_push(tokens, make_token(TK_OR_OR, "||", line));
-      } else {
-        vec_push(tokens, make_token(TK_OR, "|", line));
+    ts->cur = lex(s);
+  }
+  return i & (TOKEN_RING - 1);
+}
+
+int token_ty(int i) {
+  token_stream_t *ts = ctx->tokens;
+  if (ts->pp)
+    return ts->ring_kind[stream_slot(i)] + TK_EOF;
+  return ts->kind[i] + TK_EOF;
+}
+
+char *token_str(int i) {
+  token_stream_t *ts = ctx->tokens;
+  if (ts->pp)
+    return ts->ring_str[stream_slot(i)];
+  char *fixed = ctx->spellings[(int)ts->kind[i]];
+  if (fixed)
+    return fixed;
+  if (ts->memo == i)
+    return ts->memo_str;
+
+  char *s = ts->src + ts->offset[i];
+  char *str;
+  if (token_ty(i) == TK_CHARACTER)
+    str = escaped_str(s);
+  else
+    str = intern_n(s, ts->length[i]);
+  ts->memo = i;
+  ts->memo_str = str;
+  return str;
+}
+
+// Line numbers start at 1.
+int token_line(int i) {
+  token_stream_t *ts = ctx->tokens;
+  if (ts->pp)
+    return ts->ring_line[stream_slot(i)];
+  int offset = ts->offset[i];
+  int lo = 0, hi = ts->nlines - 1;
+  while (lo < hi) {
+    int mid = (lo + hi + 1) / 2;
+    if (ts->lines[mid] <= offset)
+      lo = mid;
+    else
+      hi = mid - 1;
+  }
+  return lo + 1;
+}
+
+int token_col(int i) {
+  token_stream_t *ts = ctx->tokens;
+  if (ts->pp)
+    return ts->ring_col[stream_slot(i)];
+  return ts->offset[i] - ts->lines[token_line(i) - 1];
+}
+
+// Lexes the whole preprocessed text up front.
+void tokenize(char *s) {
+  init_keywords();
+  ctx->tokens = new_token_stream(s);
+  init_spellings();
+
+  char *start = s;
+  while (*s)
+    s = lex(s);
+  push_token(TK_EOF, s, 0);
+  ctx->lex_bytes = s - start;
+
+  return;
+}
+
+// Lexes on demand while the parser asks for tokens, pulling text from the
+// preprocessor one line at a time.
+void tokenize_stream(pp_t *pp) {
+  init_keywords();
+  ctx->tokens = new_token_stream(NULL);
+  init_spellings();
+  ctx->tokens->pp = pp;
+  ctx->tokens->window = new_buf();
+  ctx->tokens->cur = buf_str(ctx->tokens->window);
+  return;
+}
+
+// Character classes. Which of the punctuators a P starts is looked up in
+// punct_ty, and for the longer ones in long_puncts.
+enum {
+  CC_OTHER,
+  CC_SPACE,
+  CC_NEWLINE,
+  CC_IDENT,
+  CC_DIGIT,
+  CC_QUOTE,
+  CC_PUNCT,
+};
+
+#define X CC_OTHER
+#define S CC_SPACE
+#define N CC_NEWLINE
+#define I CC_IDENT
+#define D CC_DIGIT
+#define Q CC_QUOTE
+#define P CC_PUNCT
+static const char char_class[256] = {
+    X, X, X, X, X, X, X, X, X, S, N, S, S, S, X, X,
+    X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+    S, P, Q, X, X, X, P, Q, P, P, P, P, P, P, P, P,
+    D, D, D, D, D, D, D, D, D, D, P, P, P, P, P, P,
+    X, I, I, I, I, I, I, I, I, I, I, I, I, I, I, I,
+    I, I, I, I, I, I, I, I, I, I, I, P, X, P, X, I,
+    X, I, I, I, I, I, I, I, I, I, I, I, I, I, I, I,
+    I, I, I, I, I, I, I, I, I, I, I, P, P, P, X, X,
+};
+#undef X
+#undef S
+#undef N
+#undef I
+#undef D
+#undef Q
+#undef P
+
+static const short punct_ty[256] = {
+    ['+'] = TK_PLUS,      ['-'] = TK_MINUS,     ['*'] = TK_ASTERISK,
+    ['/'] = TK_SLASH,     ['='] = TK_ASSIGN,    ['>'] = TK_GREAT,
+    ['<'] = TK_LESS,      ['!'] = TK_NOT,       ['&'] = TK_AND,
+    ['|'] = TK_OR,        ['.'] = TK_DOT,       ['?'] = TK_QUESTION,
+    ['('] = TK_LPAREN,    [')'] = TK_RPAREN,    ['{'] = TK_LBRACE,
+    ['}'] = TK_RBRACE,    ['['] = TK_LBRACKET,  [']'] = TK_RBRACKET,
+    [';'] = TK_SEMICOLON, [':'] = TK_COLON,     [','] = TK_COMMA,
+};
+
+static struct punct long_puncts[] = {
+    {"+=", TK_PLUS_ASSIGN}, {"++", TK_PLUS_PLUS}, {"-=", TK_MINUS_ASSIGN},
+    {"--", TK_MINUS_MINUS}, {"->", TK_ARROW},     {">=", TK_GREAT_EQ},
+    {"<=", TK_LESS_EQ},     {"!=", TK_NOT_EQUAL}, {"==", TK_EQUAL},
+    {"&&", TK_AND_AND},     {"||", TK_OR_OR},     {"...", TK_VA_SPEC},
+    {NULL, 0},
+};
+
+static bool is_class(char c, int cc) {
+  return char_class[(unsigned char)c] == cc;
+}
+
+bool is_ident_start(char c) { return is_class(c, CC_IDENT); }
+
+// Runs of characters skipped at once. Identifiers are too short on average
+// for a vector scan to pay off, so they are scanned a byte at a time.
+#define RUN_BLANK 0   // white space other than newlines
+#define RUN_LINE 1    // up to a newline
+#define RUN_COMMENT 2 // up to a newline or '*'
+
+#ifdef __SSE2__
+static __m128i in_range(__m128i v, char lo, char hi) {
+  return _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8(lo - 1)),
+                       _mm_cmplt_epi8(v, _mm_set1_epi8(hi + 1)));
+}
+
+static __m128i is_byte(__m128i v, char c) {
+  return _mm_cmpeq_epi8(v, _mm_set1_epi8(c));
+}
+
+// The bytes of `v` that end a run.
+static unsigned run_ends(__m128i v, int run) {
+  __m128i m;
+  switch (run) {
+  case RUN_BLANK:
+    m = _mm_or_si128(is_byte(v, ' '), in_range(v, '\t', '\r'));
+    m = _mm_andnot_si128(is_byte(v, '\n'), m);
+    return ~_mm_movemask_epi8(m) & 0xffff;
+  case RUN_LINE:
+    m = _mm_or_si128(is_byte(v, '\n'), is_byte(v, '\0'));
+    return _mm_movemask_epi8(m);
+  default:
+    m = _mm_or_si128(_mm_or_si128(is_byte(v, '\n'), is_byte(v, '\0')),
+                     is_byte(v, '*'));
+    return _mm_movemask_epi8(m);
+  }
+}
+
+// Returns the end of the run that starts at `s`, 16 bytes at a time. The
+// loads are aligned, so they never cross into a page past the end of the
+// text.
+static char *scan(char *s, int run) {
+  char *p = (char *)((uintptr_t)s & ~(uintptr_t)15);
+  unsigned mask = run_ends(_mm_load_si128((__m128i *)p), run) & (0xffffu << (s - p));
+  while (!mask) {
+    p += 16;
+    mask = run_ends(_mm_load_si128((__m128i *)p), run);
+  }
+  return p + __builtin_ctz(mask);
+}
+#else
+static char *scan(char *s, int run) {
+  switch (run) {
+  case RUN_BLANK:
+    while (is_class(*s, CC_SPACE))
+      s++;
+    return s;
+  case RUN_LINE:
+    while (*s && *s != '\n')
+      s++;
+    return s;
+  default:
+    while (*s && *s != '\n' && *s != '*')
+      s++;
+    return s;
+  }
+}
+#endif
+
+// Skips a comment that starts at `s`, counting the lines it spans.
+static char *skip_comment(char *s) {
+  if (s[1] == '/')
+    return scan(s + 2, RUN_LINE);
+  for (s += 2;; s++) {
+    s = scan(s, RUN_COMMENT);
+    if (*s == '\0' && !(s = more(s)))
+      error("Multiple line comments must be ending as '*/'");
+    if (*s == '\n')
+      push_line(s + 1);
+    if (*s == '*' && s[1] == '/')
+      return s + 2;
+  }
+}
+
+static char *lex_punct(char *start) {
+  char c = *start;
+  char d = start[1];
+  if (c == '/' && (d == '/' || d == '*'))
+    return skip_comment(start);
+  // Only a punctuator character followed by another can start a longer one.
+  if (is_class(d, CC_PUNCT)) {
+    for (struct punct *p = long_puncts; p->str; p++) {
+      if (p->str[0] == c && p->str[1] == d &&
+          (!p->str[2] || p->str[2] == start[2])) {
+        int len = p->str[2] ? 3 : 2;
+        push_token(p->ty, start, len);
+        return start + len;
       }
-      continue;
-    }
-    if (c == '[') {
-      vec_push(tokens, make_token(TK_LBRACKET, "[", line));
-      continue;
-    }
-    if (c == ']') {
-      vec_push(tokens, make_token(TK_RBRACKET, "]", line));
-      continue;
     }
+  }
+  push_token(punct_ty[(unsigned char)c], start, 1);
+  return start + 1;
+}
 
-    if (isdigit(c)) {
-      buf_t *b = new_buf();
-      buf_push(b, c);
-      while (isdigit(*s))
-        buf_push(b, next(&s));
+// Scans one token, comment or blank at `s` and returns the position after it.
+static char *lex(char *s) {
+  char c = *s;
+  char *start = s++;
 
-      vec_push(tokens, make_token(TK_NUM, buf_str(b), line));
-      continue;
-    }
-    if (isalpha(c) || c == '_') {
-      buf_t *b = new_buf();
-      buf_push(b, c);
-      while (isalnum(*s) || *s == '_')
-        buf_push(b, next(&s));
-      char *str = buf_str(b);
-      vec_push(tokens, make_token(check_ident_type(str), str, line));
-      continue;
+  switch (char_class[(unsigned char)c]) {
+  case CC_NEWLINE:
+    push_line(s);
+    return s;
+  case CC_SPACE:
+    // Most blanks are a single space between tokens.
+    return is_class(*s, CC_SPACE) ? scan(s, RUN_BLANK) : s;
+  case CC_IDENT:
+    while (is_class(*s, CC_IDENT) || is_class(*s, CC_DIGIT))
+      s++;
+    push_token(check_ident_type(start, s - start), start, s - start);
+    return s;
+  case CC_DIGIT:
+    while (is_class(*s, CC_DIGIT))
+      s++;
+    push_token(TK_NUM, start, s - start);
+    return s;
+  case CC_PUNCT:
+    return lex_punct(start);
+  case CC_QUOTE:
+    // The spelling of a string or a character excludes the quotes.
+    if (c == '\"') {
+      while (*s != '\"') {
+        if (*s++ == '\\' && *s)
+          s++;
+      }
+      push_token(TK_STRING, start + 1, s - start - 1);
+      return s + 1;
     }
-
-    error("Unknown character: %c", c);
+    get_escape_char(*s++, &s);
+    push_token(TK_CHARACTER, start + 1, s - start - 1);
+    return s + 1;
   }
-  vec_push(tokens, make_token(TK_EOF, "\0", line));
 
-  return;
+  error("Unknown character: %c", c);
+  return s;
 }
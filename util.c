@@ -1,56 +1,111 @@
 #include "sicc.h"
 
 #include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
+// Remembers a file read during the current compilation, so that free_ctx()
+// can give it back. `size` is -1 for a malloc'd copy.
+static void keep_file(char *p, long size) {
+  if (!ctx)
+    return;
+  if (!ctx->files)
+    ctx->files = new_vec();
+  vec_push(ctx->files, p);
+  vec_push(ctx->files, (void *)(intptr_t)size);
+}
+
+// Maps a regular file read-only, or reads anything else into memory. The
+// result is NUL-terminated and must not be written to. It stays valid until
+// the current context is freed.
 char *read_file(char *name) {
-  buf_t *s = new_buf();
-  // FILE *f = fopen(name, "rb");
   int fd = open(name, O_RDONLY);
   if (fd == -1)
     error("Can't open the file: %s", name);
-  size_t size = 0;
+  struct stat st;
+  if (fstat(fd, &st) == -1)
+    error("Can't stat the file: %s", name);
+  size_t size = st.st_size;
+
+  // The bytes between the end of the file and the end of its last page read
+  // as zero, which terminates the string. A file that fills its last page
+  // exactly has no such byte and is read into memory instead.
+  long page = sysconf(_SC_PAGESIZE);
+  if (S_ISREG(st.st_mode) && size > 0 && size % page != 0) {
+    char *p = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (p != MAP_FAILED) {
+      close(fd);
+      keep_file(p, size);
+      return p;
+    }
+  }
+
+  // Pipes, /dev/stdin and the like have no size, so they are read until they
+  // end.
+  size_t cap = size + 4096;
+  char *p = malloc(cap);
+  size_t len = 0;
   for (;;) {
-    char buf[4096];
-    int nread = read(fd, buf, 4096);
-    size += nread;
-    buf_appendn(s, buf, nread);
-    if (nread < 4096)
+    if (len + 1 == cap)
+      p = realloc(p, cap *= 2);
+    ssize_t nread = read(fd, p + len, cap - 1 - len);
+    if (nread <= 0)
       break;
+    len += nread;
   }
+  p[len] = '\0';
   close(fd);
-  return buf_str(s);
+  keep_file(p, -1);
+  return p;
 }
 
-void write_one_fmt(char *dst, char *orig, char *str) {
-  buf_t *b = new_buf();
-  int i;
-  for (i = 0; (orig[i] != '%') && orig[i]; i++) {
-    buf_push(b, orig[i]);
-  }
-  buf_append(b, str);
-  buf_append(b, (orig + (i + 2)));
-  strcpy(dst, buf_str(b));
-  return;
+// Zeroed memory from `a`, or from the C heap if `a` is NULL.
+static void *alloc_in(arena_t *a, size_t size) {
+  return a ? arena_alloc(a, size) : calloc(1, size);
 }
 
-vec_t *new_vec() {
-  vec_t *v = malloc(sizeof(vec_t));
-  v->len = 0;
+// The heap of the current context, or NULL outside of a compilation.
+static arena_t *ctx_heap() { return ctx ? ctx->heap : NULL; }
+
+vec_t *new_vec() { return arena_vec(ctx_heap()); }
+
+// A vector that lives and dies with `a`, or that is malloc'd and lives until
+// free_vec() if `a` is NULL. Growing an arena vector leaves the old storage
+// behind in the arena.
+vec_t *arena_vec(arena_t *a) {
+  vec_t *v = alloc_in(a, sizeof(vec_t));
   v->cap = sizeof(void *);
-  v->data = malloc(sizeof(void *));
+  v->data = alloc_in(a, sizeof(void *));
+  v->arena = a;
   return v;
 }
 
+// Arena vectors are left to their arena.
+void free_vec(vec_t *v) {
+  if (v->arena)
+    return;
+  free(v->data);
+  free(v);
+}
+
 void grow_vec(vec_t *v, int len) {
   int size = sizeof(void *) * (v->len + len);
   if (size <= v->cap)
     return;
   while (size > v->cap)
     v->cap *= 2;
+  if (v->arena) {
+    void **data = arena_alloc(v->arena, v->cap);
+    memcpy(data, v->data, sizeof(void *) * v->len);
+    v->data = data;
+    return;
+  }
   v->data = realloc(v->data, v->cap);
   return;
 }
@@ -93,14 +148,74 @@ void *vec_get(vec_t *v, int pos) {
 
 size_t vec_len(vec_t *v) { return v->len; }
 
-map_t *new_map() {
-  map_t *m = malloc(sizeof(map_t));
+#define MAP_INIT_SLOTS 16
+#define MAP_TOMBSTONE -1
+
+map_t *new_map() { return arena_map(ctx_heap()); }
+
+// Like arena_vec(), the map and its table come from `a` unless it is NULL.
+map_t *arena_map(arena_t *a) {
+  map_t *m = alloc_in(a, sizeof(map_t));
   m->len = 0;
-  m->keys = new_vec();
-  m->items = new_vec();
+  m->keys = arena_vec(a);
+  m->items = arena_vec(a);
+  m->nslots = MAP_INIT_SLOTS;
+  m->nused = 0;
+  m->slots = alloc_in(a, m->nslots * sizeof(int));
   return m;
 }
 
+void free_map(map_t *m) {
+  if (m->keys->arena)
+    return;
+  free_vec(m->keys);
+  free_vec(m->items);
+  free(m->slots);
+  free(m);
+}
+
+// 32-bit FNV-1a, the hash of the maps, the intern pool and the file checks.
+unsigned int fnv1a(const char *s, size_t len) {
+  unsigned int h = 2166136261u;
+  for (size_t i = 0; i < len; i++) {
+    h ^= (unsigned char)s[i];
+    h *= 16777619u;
+  }
+  return h;
+}
+
+// Returns the slot that holds `key`, or the empty slot where it would go.
+static int map_probe(map_t *m, char *key) {
+  int mask = m->nslots - 1;
+  int i = fnv1a(key, strlen(key)) & mask;
+  for (;; i = (i + 1) & mask) {
+    int slot = m->slots[i];
+    if (slot == 0)
+      return i;
+    if (slot == MAP_TOMBSTONE)
+      continue;
+    char *s = m->keys->data[slot - 1];
+    if (s == key || !strcmp(s, key))
+      return i;
+  }
+}
+
+static void map_rehash(map_t *m, int nslots) {
+  arena_t *a = m->keys->arena;
+  if (!a)
+    free(m->slots);
+  m->nslots = nslots;
+  m->nused = 0;
+  m->slots = alloc_in(a, nslots * sizeof(int));
+  for (int i = 0; i < m->len; i++) {
+    char *key = m->keys->data[i];
+    if (key == NULL)
+      continue;
+    m->slots[map_probe(m, key)] = i + 1;
+    m->nused++;
+  }
+}
+
 void map_put(map_t *m, char *key, void *item) {
   int i;
   if ((i = map_index(m, key)) != -1) {
@@ -110,6 +225,18 @@ void map_put(map_t *m, char *key, void *item) {
   vec_push(m->keys, key);
   vec_push(m->items, item);
   m->len++;
+  if (key == NULL)
+    return;
+  // Keep the load factor (including tombstones) under 3/4.
+  if ((m->nused + 1) * 4 > m->nslots * 3) {
+    int nslots = m->nslots;
+    while (m->len * 2 > nslots)
+      nslots *= 2;
+    map_rehash(m, nslots);
+    return;
+  }
+  m->slots[map_probe(m, key)] = m->len;
+  m->nused++;
   return;
 }
 
@@ -137,17 +264,18 @@ int map_find(map_t *m, char *key) {
 int map_index(map_t *m, char *key) {
   if (key == NULL)
     return -1;
-  for (int i = 0; i < m->len; i++) {
-    char *s;
-    if ((s = vec_get(m->keys, i)) == NULL)
-      return -1;
-    if (!strcmp(s, key))
-      return i;
-  }
-  return -1;
+  int slot = m->slots[map_probe(m, key)];
+  if (slot == 0)
+    return -1;
+  return slot - 1;
 }
 
+// Removes the most recently inserted key, which is how scopes are unwound.
 void map_pop(map_t *m) {
+  char *key = vec_get(m->keys, m->len - 1);
+  if (key != NULL) {
+    m->slots[map_probe(m, key)] = MAP_TOMBSTONE;
+  }
   vec_pop(m->keys);
   vec_pop(m->items);
   m->len--;
@@ -156,21 +284,146 @@ void map_pop(map_t *m) {
 
 size_t map_len(map_t *m) { return m->len; }
 
+#define ARENA_CHUNK_SIZE (64 * 1024)
+
+typedef struct _chunk {
+  struct _chunk *next;
+  size_t size;
+  size_t used;
+} chunk_t;
+
+THREAD_LOCAL ctx_t *ctx;
+
+ctx_t *new_ctx() {
+  ctx_t *c = calloc(1, sizeof(ctx_t));
+  c->token_arena = new_arena("token");
+  c->ast_arena = new_arena("ast");
+  c->ir_arena = new_arena("ir");
+  c->heap = new_arena("heap");
+  c->include_files = arena_map(c->heap);
+  c->include_dirs = arena_map(c->heap);
+  c->events = arena_vec(c->heap);
+  c->open_events = arena_vec(c->heap);
+  c->node_lists = arena_vec(c->heap);
+  c->node_stack = arena_vec(c->heap);
+  return c;
+}
+
+// Interned strings and whatever came from the heap are owned by the context
+// and go away with it.
+void free_ctx(ctx_t *c) {
+  arena_release(c->token_arena);
+  arena_release(c->ast_arena);
+  arena_release(c->ir_arena);
+  free(c->token_arena);
+  free(c->ast_arena);
+  free(c->ir_arena);
+  for (int i = 0; c->files && i < vec_len(c->files); i += 2) {
+    char *p = vec_get(c->files, i);
+    long size = (intptr_t)vec_get(c->files, i + 1);
+    if (size < 0)
+      free(p);
+    else
+      munmap(p, size);
+  }
+  for (int i = 0; i < c->intern_nslots; i++)
+    free(c->intern_strs[i]);
+  free(c->intern_strs);
+  free(c->intern_hashes);
+  arena_release(c->heap);
+  free(c->heap);
+  free(c);
+}
+
+arena_t *new_arena(char *name) {
+  arena_t *a = calloc(1, sizeof(arena_t));
+  a->name = name;
+  return a;
+}
+
+// Returns zeroed memory, like calloc.
+void *arena_alloc(arena_t *a, size_t size) {
+  size = (size + 15) & ~15;
+  chunk_t *c = a->chunk;
+  if (!c || c->used + size > c->size) {
+    size_t csize = size > ARENA_CHUNK_SIZE ? size : ARENA_CHUNK_SIZE;
+    chunk_t *nc = malloc(sizeof(chunk_t) + 16 + csize);
+    nc->size = csize;
+    nc->used = 0;
+    // Oversized blocks go behind the current chunk so its free space is kept.
+    if (c && csize > ARENA_CHUNK_SIZE) {
+      nc->next = c->next;
+      c->next = nc;
+    } else {
+      nc->next = c;
+      a->chunk = nc;
+    }
+    c = nc;
+    a->nchunks++;
+    a->reserved += csize;
+    if (a->peak < a->reserved)
+      a->peak = a->reserved;
+  }
+  char *p = (char *)c + ((sizeof(chunk_t) + 15) & ~15) + c->used;
+  c->used += size;
+  a->used += size;
+  a->nallocs++;
+  memset(p, 0, size);
+  return p;
+}
+
+// Frees every chunk at once. The usage counters are kept for --stats.
+void arena_release(arena_t *a) {
+  chunk_t *c = a->chunk;
+  while (c) {
+    chunk_t *next = c->next;
+    free(c);
+    c = next;
+  }
+  a->chunk = NULL;
+  a->reserved = 0;
+  return;
+}
+
+// The header and the first bytes of data share one allocation.
+#define BUF_INLINE_SIZE 16
+
 buf_t *new_buf() {
-  buf_t *b = calloc(1, sizeof(buf_t));
+  arena_t *a = ctx_heap();
+  buf_t *b = alloc_in(a, sizeof(buf_t) + BUF_INLINE_SIZE);
   b->len = 0;
-  b->cap = sizeof(char);
-  b->data = malloc(sizeof(char));
+  b->cap = BUF_INLINE_SIZE;
+  b->data = (char *)(b + 1);
+  b->arena = a;
   return b;
 }
 
+void free_buf(buf_t *b) {
+  if (b->arena)
+    return;
+  if (b->data != (char *)(b + 1))
+    free(b->data);
+  free(b);
+}
+
 void grow_buf(buf_t *b, int len) {
   int blen = b->len + len;
   if (b->cap >= blen)
     return;
+  int cap = b->cap;
   while (blen > b->cap)
     b->cap *= 2;
-  b->data = realloc(b->data, b->cap);
+  if (b->arena) {
+    char *data = arena_alloc(b->arena, b->cap);
+    memcpy(data, b->data, b->len);
+    b->data = data;
+  } else if (b->data == (char *)(b + 1)) {
+    char *data = malloc(b->cap);
+    memcpy(data, b->data, cap);
+    b->data = data;
+  } else {
+    b->data = realloc(b->data, b->cap);
+  }
   return;
 }
 
@@ -181,15 +434,14 @@ void buf_push(buf_t *b, char c) {
 }
 
 void buf_append(buf_t *b, char *str) {
-  int len = strlen(str);
-  for (int i = 0; i < len; i++)
-    buf_push(b, str[i]);
+  buf_appendn(b, str, strlen(str));
   return;
 }
 
 void buf_appendn(buf_t *b, char *str, int n) {
-  for (int i = 0; i < n; i++)
-    buf_push(b, str[i]);
+  grow_buf(b, n);
+  memcpy(b->data + b->len, str, n);
+  b->len += n;
   return;
 }
 
@@ -200,6 +452,214 @@ char buf_get(buf_t *b, int offset) {
 size_t buf_len(buf_t *b) { return b->len; }
 
 char *buf_str(buf_t *b) {
+  grow_buf(b, 1);
   b->data[b->len] = '\0';
   return b->data;
 }
+
+char *format(char *fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  int len = vsnprintf(NULL, 0, fmt, ap);
+  va_end(ap);
+  char *s = alloc_in(ctx_heap(), len + 1);
+  va_start(ap, fmt);
+  vsnprintf(s, len + 1, fmt, ap);
+  va_end(ap);
+  return s;
+}
+
+// Rounds n up to a multiple of align, a power of two.
+int align_to(int n, int align) { return (n + align - 1) & -align; }
+
+#define OUT_BUF_SIZE (1 << 16)
+
+// NULL path means stdout.
+out_t *out_open(char *path) {
+  out_t *o = calloc(1, sizeof(out_t));
+  o->fd = 1;
+  if (path) {
+    o->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (o->fd < 0)
+      error("Cannot open %s", path);
+  }
+  o->buf = malloc(OUT_BUF_SIZE);
+  return o;
+}
+
+// Output written to a socket for the compile server's client. The fd is not
+// owned by the out_t.
+out_t *out_frames(int fd, char channel) {
+  out_t *o = calloc(1, sizeof(out_t));
+  o->fd = fd;
+  o->frame = channel;
+  o->buf = malloc(OUT_BUF_SIZE);
+  return o;
+}
+
+// Output kept in memory, in o->mem.
+out_t *out_mem() {
+  out_t *o = calloc(1, sizeof(out_t));
+  o->fd = -1;
+  o->mem = new_buf();
+  o->buf = malloc(OUT_BUF_SIZE);
+  return o;
+}
+
+static void write_all(int fd, char *p, int n) {
+  while (n > 0) {
+    ssize_t w = write(fd, p, n);
+    if (w < 0)
+      error("Cannot write output");
+    p += w;
+    n -= w;
+  }
+  return;
+}
+
+// A frame is the channel byte, the length as 4 little-endian bytes and the
+// data, at most FRAME_MAX bytes of it.
+void write_frame(int fd, char channel, char *p, int n) {
+  do {
+    int len = n < FRAME_MAX ? n : FRAME_MAX;
+    char header[5] = {channel, len & 0xff, (len >> 8) & 0xff,
+                      (len >> 16) & 0xff, (len >> 24) & 0xff};
+    write_all(fd, header, 5);
+    write_all(fd, p, len);
+    p += len;
+    n -= len;
+  } while (n > 0);
+  return;
+}
+
+static void out_write(out_t *o, char *p, int n) {
+  if (o->mem)
+    buf_appendn(o->mem, p, n);
+  else if (o->frame)
+    write_frame(o->fd, o->frame, p, n);
+  else
+    write_all(o->fd, p, n);
+  return;
+}
+
+void out_flush(out_t *o) {
+  if (o->len)
+    out_write(o, o->buf, o->len);
+  o->len = 0;
+  return;
+}
+
+void out_close(out_t *o) {
+  out_flush(o);
+  if (o->fd != 1 && o->fd != -1 && !o->frame)
+    close(o->fd);
+  free(o->buf);
+  free(o);
+  return;
+}
+
+void out_putn(out_t *o, char *s, int n) {
+  if (o->len + n > OUT_BUF_SIZE) {
+    out_flush(o);
+    if (n > OUT_BUF_SIZE) {
+      out_write(o, s, n);
+      return;
+    }
+  }
+  memcpy(o->buf + o->len, s, n);
+  o->len += n;
+  return;
+}
+
+void out_puts(out_t *o, char *s) {
+  out_putn(o, s, strlen(s));
+  return;
+}
+
+void out_putc(out_t *o, char c) {
+  if (o->len == OUT_BUF_SIZE)
+    out_flush(o);
+  o->buf[o->len++] = c;
+  return;
+}
+
+// Formats a decimal integer without going through printf.
+void out_int(out_t *o, long n) {
+  char tmp[24];
+  char *p = tmp + sizeof(tmp);
+  unsigned long u = n < 0 ? -(unsigned long)n : n;
+  do {
+    *--p = '0' + u % 10;
+    u /= 10;
+  } while (u);
+  if (n < 0)
+    *--p = '-';
+  out_putn(o, p, tmp + sizeof(tmp) - p);
+  return;
+}
+
+// String intern pool of the current context. Every spelling is stored once,
+// so strings that came out of the pool can be compared by pointer.
+
+static void intern_grow() {
+  char **strs = ctx->intern_strs;
+  unsigned int *hashes = (unsigned int *)ctx->intern_hashes;
+  int nslots = ctx->intern_nslots;
+  ctx->intern_nslots = nslots ? nslots * 2 : 1024;
+  char **new_strs = calloc(ctx->intern_nslots, sizeof(char *));
+  unsigned int *new_hashes = calloc(ctx->intern_nslots, sizeof(unsigned int));
+  int mask = ctx->intern_nslots - 1;
+  for (int i = 0; i < nslots; i++) {
+    if (!strs[i])
+      continue;
+    int j = hashes[i] & mask;
+    while (new_strs[j])
+      j = (j + 1) & mask;
+    new_strs[j] = strs[i];
+    new_hashes[j] = hashes[i];
+  }
+  free(strs);
+  free(hashes);
+  ctx->intern_strs = new_strs;
+  ctx->intern_hashes = (int *)new_hashes;
+}
+
+char *intern_n(char *s, int len) {
+  if ((ctx->intern_count + 1) * 2 > ctx->intern_nslots)
+    intern_grow();
+  char **strs = ctx->intern_strs;
+  unsigned int *hashes = (unsigned int *)ctx->intern_hashes;
+  unsigned int h = fnv1a(s, len);
+  int mask = ctx->intern_nslots - 1;
+  int i = h & mask;
+  for (; strs[i]; i = (i + 1) & mask) {
+    char *str = strs[i];
+    if (hashes[i] == h && !strncmp(str, s, len) && str[len] == '\0') {
+      ctx->intern_hits++;
+      return str;
+    }
+  }
+  ctx->intern_misses++;
+  char *str = malloc(len + 1);
+  memcpy(str, s, len);
+  str[len] = '\0';
+  strs[i] = str;
+  hashes[i] = h;
+  ctx->intern_count++;
+  return str;
+}
+
+char *intern(char *s) { return intern_n(s, strlen(s)); }
+
+// Interns a string literal. The result is cached by the literal's address,
+// so `s` must never be modified.
+char *intern_lit(char *s) {
+  int i = ((uintptr_t)s >> 2) & 255;
+  if (ctx->lit_keys[i] == s)
+    return ctx->lit_strs[i];
+  ctx->lit_keys[i] = s;
+  ctx->lit_strs[i] = intern(s);
+  return ctx->lit_strs[i];
+}
+
+int intern_len() { return ctx->intern_count; }